@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "admin.h"
+
+#define MAX_ROUTES 16
+#define REQUEST_SIZE 2048
+#define ADMIN_TIMEOUT 5  // seconds a scraper gets to send its request and take the reply
+
+typedef struct {
+    const char *path;
+    const char *type;
+    void (*write)(FILE *out);
+} route_t;
+
+static route_t routes[MAX_ROUTES];
+static int route_count = 0;
+
+void admin_route(const char *path, const char *type, void (*write)(FILE *out)) {
+    if (route_count < MAX_ROUTES) {
+        routes[route_count++] = (route_t){ path, type, write };
+    }
+}
+
+// Read up to the end of the request header. The request line is all we look at.
+static int read_request(int fd, char *buf, size_t size) {
+    size_t len = 0;
+    while (len < size - 1) {
+        ssize_t r = recv(fd, buf + len, size - 1 - len, 0);
+        if (r <= 0) {
+            return -1;
+        }
+        len += (size_t)r;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+            return 0;
+        }
+    }
+    return 0;  // header too big - the request line is still in there
+}
+
+// Answer one scrape. The socket is ours to close, whichever way it goes.
+static void answer(int fd) {
+    char req[REQUEST_SIZE];
+    if (read_request(fd, req, sizeof(req)) < 0) {
+        close(fd);  // scraper timed out or hung up
+        return;
+    }
+
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        return;
+    }
+
+    char method[8], path[256];
+    const route_t *route = NULL;
+    if (sscanf(req, "%7s %255s", method, path) == 2 && strcmp(method, "GET") == 0) {
+        path[strcspn(path, "?")] = '\0';  // scrapers like to add parameters
+        for (int i = 0; i < route_count && !route; i++) {
+            if (strcmp(routes[i].path, path) == 0) {
+                route = &routes[i];
+            }
+        }
+    }
+
+    if (route) {
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nConnection: close\r\n\r\n", route->type);
+        route->write(out);
+    } else {
+        fprintf(out, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n");
+        for (int i = 0; i < route_count; i++) {
+            fprintf(out, "%s\n", routes[i].path);
+        }
+    }
+    fclose(out);  // closes fd too
+}
+
+static void *admin_thread(void *arg) {
+    int listenfd = (int)(long)arg;
+    while (1) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        // A stuck scraper shouldn't keep the next one waiting forever
+        struct timeval tv = { ADMIN_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        answer(fd);
+    }
+    return NULL;
+}
+
+int admin_start(unsigned short port) {
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // local only
+    addr.sin_port = htons(port);
+
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 16) < 0) {
+        close(listenfd);
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_thread, (void *)(long)listenfd) != 0) {
+        close(listenfd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
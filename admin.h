@@ -0,0 +1,17 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stdio.h>
+
+// Tiny HTTP/1.0 endpoint on 127.0.0.1 for operators and scrapers. One thread,
+// one request per connection, GET only - each path maps to a function that
+// writes the response body.
+
+// Serve path with write(), as content type type. Add routes before admin_start.
+void admin_route(const char *path, const char *type, void (*write)(FILE *out));
+
+// Listen on 127.0.0.1:port and answer from a thread of its own. -1 if the
+// port can't be had.
+int admin_start(unsigned short port);
+
+#endif
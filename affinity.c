@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "affinity.h"
+
+#define MAX_NODES 64
+#define MAX_IRQS 4096
+#define REPORT_IRQS 16  // per NIC, the rest are summarised
+
+// CPU -> node, filled in once from /sys/devices/system/node
+static int cpu_node[AFFINITY_MAX_CPUS];
+static int node_count = 0;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+// Read a small sysfs/procfs file into buf, trailing newline dropped. -1 if it isn't there.
+static int read_line(const char *path, char *buf, size_t size) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    if (!fgets(buf, (int)size, f)) {
+        buf[0] = '\0';
+    }
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+// "0-3,8" into a set of CPUs. -1 on anything else.
+static int parse_ranges(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10);
+        long hi = lo;
+        if (end == s || lo < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo) {
+                return -1;
+            }
+        }
+        if (hi >= AFFINITY_MAX_CPUS) {
+            return -1;
+        }
+        for (long c = lo; c <= hi; c++) {
+            CPU_SET((int)c, set);
+        }
+        s = end;
+        if (*s == ',') {
+            s++;
+        } else if (*s) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void load_topology() {
+    char path[128], buf[4096];
+    for (int node = 0; node < MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        cpu_set_t set;
+        if (read_line(path, buf, sizeof(buf)) < 0 || parse_ranges(buf, &set) < 0) {
+            continue;
+        }
+        for (int c = 0; c < AFFINITY_MAX_CPUS; c++) {
+            if (CPU_ISSET(c, &set)) {
+                cpu_node[c] = node;
+            }
+        }
+        node_count = node + 1;
+    }
+}
+
+int affinity_cpu_node(int cpu) {
+    pthread_once(&topology_once, load_topology);
+    return cpu >= 0 && cpu < AFFINITY_MAX_CPUS ? cpu_node[cpu] : 0;
+}
+
+// CPUs that are online right now
+static void online_cpus(cpu_set_t *set) {
+    char buf[4096];
+    if (read_line("/sys/devices/system/cpu/online", buf, sizeof(buf)) == 0 && parse_ranges(buf, set) == 0) {
+        return;
+    }
+    CPU_ZERO(set);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long c = 0; c < n && c < AFFINITY_MAX_CPUS; c++) {
+        CPU_SET((int)c, set);
+    }
+}
+
+int affinity_parse(const char *spec, cpulist_t *out) {
+    char buf[4096];
+    cpu_set_t online;
+    online_cpus(&online);
+    out->n = 0;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        cpu_set_t set;
+        if (tok[0] == 'n') {
+            // a whole node
+            char path[128], list[4096];
+            char *end;
+            long node = strtol(tok + 1, &end, 10);
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", node);
+            if (end == tok + 1 || *end || read_line(path, list, sizeof(list)) < 0 ||
+                parse_ranges(list, &set) < 0) {
+                return -1;
+            }
+        } else if (parse_ranges(tok, &set) < 0) {
+            return -1;
+        }
+
+        for (int c = 0; c < AFFINITY_MAX_CPUS; c++) {
+            if (!CPU_ISSET(c, &set)) {
+                continue;
+            }
+            if (!CPU_ISSET(c, &online) || out->n >= AFFINITY_MAX_CPUS) {
+                return -1;
+            }
+            out->cpus[out->n++] = (unsigned short)c;
+        }
+    }
+    return out->n > 0 ? 0 : -1;
+}
+
+int affinity_attr_cpu(pthread_attr_t *attr, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int affinity_pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int affinity_enter(int cpu, cpu_set_t *saved) {
+    if (pthread_getaffinity_np(pthread_self(), sizeof(*saved), saved) != 0) {
+        return -1;
+    }
+    return affinity_pin(cpu);
+}
+
+void affinity_leave(const cpu_set_t *saved) {
+    pthread_setaffinity_np(pthread_self(), sizeof(*saved), saved);
+}
+
+// "0-3,8 (node0)" style summary of a CPU list
+static void print_cpulist(FILE *out, const cpulist_t *list) {
+    if (list->n == 0) {
+        fprintf(out, "unpinned");
+        return;
+    }
+    unsigned long long nodes = 0;
+    for (int i = 0; i < list->n; i++) {
+        int start = list->cpus[i];
+        while (i + 1 < list->n && list->cpus[i + 1] == list->cpus[i] + 1) {
+            i++;
+        }
+        fprintf(out, "%s%d", start == list->cpus[0] ? "cpus " : ",", start);
+        if (list->cpus[i] != start) {
+            fprintf(out, "-%d", list->cpus[i]);
+        }
+    }
+    for (int i = 0; i < list->n; i++) {
+        nodes |= 1ull << affinity_cpu_node(list->cpus[i]);
+    }
+    fprintf(out, " (node");
+    for (int node = 0, first = 1; node < MAX_NODES; node++) {
+        if (nodes & (1ull << node)) {
+            fprintf(out, "%s%d", first ? "" : ",", node);
+            first = 0;
+        }
+    }
+    fprintf(out, ")");
+}
+
+// IRQ number -> the name /proc/interrupts gives it (the last column)
+static char **load_irq_names() {
+    char **names = calloc(MAX_IRQS, sizeof(char *));
+    FILE *f = fopen("/proc/interrupts", "r");
+    if (!names || !f) {
+        if (f) {
+            fclose(f);
+        }
+        return names;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        char *end;
+        long irq = strtol(line, &end, 10);
+        if (end == line || *end != ':' || irq < 0 || irq >= MAX_IRQS) {
+            continue;  // header, or NMI/LOC and friends
+        }
+        line[strcspn(line, "\n")] = '\0';
+        char *name = strrchr(line, ' ');
+        names[irq] = strdup(name ? name + 1 : "");
+    }
+    fclose(f);
+    return names;
+}
+
+// Which IRQs belong to a NIC: the MSI vectors of its device (or of the PCI
+// device above it, for virtio), else anything in /proc/interrupts named after it
+static int nic_irqs(const char *ifname, char **names, int *irqs, int max) {
+    static const char *dirs[] = { "device/msi_irqs", "device/../msi_irqs" };
+    char path[PATH_MAX];
+    int n = 0;
+
+    for (size_t d = 0; d < sizeof(dirs) / sizeof(dirs[0]) && n == 0; d++) {
+        snprintf(path, sizeof(path), "/sys/class/net/%s/%s", ifname, dirs[d]);
+        DIR *dir = opendir(path);
+        if (!dir) {
+            continue;
+        }
+        struct dirent *de;
+        while ((de = readdir(dir)) && n < max) {
+            if (de->d_name[0] >= '0' && de->d_name[0] <= '9') {
+                irqs[n++] = atoi(de->d_name);
+            }
+        }
+        closedir(dir);
+    }
+
+    for (int irq = 0; irq < MAX_IRQS && n == 0; irq++) {
+        if (names[irq] && strstr(names[irq], ifname)) {
+            irqs[n++] = irq;
+        }
+    }
+    return n;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// One NIC's part of the report. Returns the nodes its IRQs are steered to.
+static unsigned long long report_nic(FILE *out, const char *ifname, char **names) {
+    char path[PATH_MAX], buf[4096];
+    unsigned long long nodes = 0;
+
+    // Receive queues, and whether RPS spreads them in software
+    int rxq = 0, rps = 0;
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    DIR *dir = opendir(path);
+    struct dirent *de;
+    while (dir && (de = readdir(dir))) {
+        if (strncmp(de->d_name, "rx-", 3) != 0) {
+            continue;
+        }
+        rxq++;
+        snprintf(path, sizeof(path), "/sys/class/net/%s/queues/%s/rps_cpus", ifname, de->d_name);
+        if (read_line(path, buf, sizeof(buf)) == 0 && strspn(buf, "0,") != strlen(buf)) {
+            rps = 1;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ifname);
+    int dev_node = read_line(path, buf, sizeof(buf)) == 0 ? atoi(buf) : -1;
+
+    fprintf(out, "net %s: %d rx queue%s, rps %s", ifname, rxq, rxq == 1 ? "" : "s", rps ? "on" : "off");
+    if (dev_node >= 0) {
+        fprintf(out, ", device on node%d", dev_node);
+    }
+    fprintf(out, "\n");
+
+    int irqs[MAX_IRQS];
+    int n = nic_irqs(ifname, names, irqs, MAX_IRQS);
+    qsort(irqs, (size_t)n, sizeof(int), cmp_int);
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irqs[i]);
+        cpu_set_t set;
+        if (read_line(path, buf, sizeof(buf)) < 0 || parse_ranges(buf, &set) < 0) {
+            continue;
+        }
+        for (int c = 0; c < AFFINITY_MAX_CPUS; c++) {
+            if (CPU_ISSET(c, &set)) {
+                nodes |= 1ull << affinity_cpu_node(c);
+            }
+        }
+        if (i < REPORT_IRQS) {
+            const char *name = irqs[i] < MAX_IRQS && names[irqs[i]] ? names[irqs[i]] : "?";
+            fprintf(out, "  irq %d %s -> cpus %s\n", irqs[i], name, buf);
+        }
+    }
+    if (n > REPORT_IRQS) {
+        fprintf(out, "  ... and %d more\n", n - REPORT_IRQS);
+    }
+    return nodes;
+}
+
+void affinity_report(FILE *out, const cpulist_t *acceptors, const cpulist_t *workers) {
+    char path[PATH_MAX], buf[4096];
+    pthread_once(&topology_once, load_topology);
+
+    fprintf(out, "numa: %d node%s", node_count ? node_count : 1, node_count > 1 ? "s" : "");
+    for (int node = 0; node < node_count; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_line(path, buf, sizeof(buf)) == 0) {
+            fprintf(out, "%s node%d cpus %s", node ? "," : " -", node, buf);
+        }
+    }
+    fprintf(out, "\n");
+
+    // Real NICs only - the ones with a device behind them
+    char **names = load_irq_names();
+    unsigned long long irq_nodes = 0;
+    DIR *dir = opendir("/sys/class/net");
+    struct dirent *de;
+    while (names && dir && (de = readdir(dir))) {
+        snprintf(path, sizeof(path), "/sys/class/net/%s/device", de->d_name);
+        if (de->d_name[0] != '.' && access(path, F_OK) == 0) {
+            irq_nodes |= report_nic(out, de->d_name, names);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    for (int i = 0; names && i < MAX_IRQS; i++) {
+        free(names[i]);
+    }
+    free(names);
+
+    fprintf(out, "acceptors: ");
+    print_cpulist(out, acceptors);
+    fprintf(out, ", workers: ");
+    print_cpulist(out, workers);
+    fprintf(out, "\n");
+
+    // Packets get handled where their IRQ fires - an acceptor elsewhere pulls every request across nodes
+    for (int i = 0; irq_nodes && i < acceptors->n; i++) {
+        int node = affinity_cpu_node(acceptors->cpus[i]);
+        if (!(irq_nodes & (1ull << node))) {
+            fprintf(out, "warning: acceptor cpu %d is on node%d, away from the NIC interrupts\n",
+                    acceptors->cpus[i], node);
+        }
+    }
+}
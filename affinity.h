@@ -0,0 +1,46 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+
+// CPU pinning and NUMA layout, read straight out of sysfs and procfs - no
+// libnuma needed. Memory placement relies on the kernel's first-touch policy:
+// a page lands on the node of the CPU that first writes it, so a thread that
+// is pinned before it sets up its buffers gets them node-local.
+//
+// Users need _GNU_SOURCE defined before their first include, for cpu_set_t.
+#define AFFINITY_MAX_CPUS 1024
+
+// An ordered list of CPUs - thread i gets cpus[i % n]
+typedef struct {
+    int n;
+    unsigned short cpus[AFFINITY_MAX_CPUS];
+} cpulist_t;
+
+// Parse "0-3,8,n1": single CPUs, ranges, and nN for every CPU on node N.
+// -1 if it doesn't parse or names a CPU that isn't online.
+int affinity_parse(const char *spec, cpulist_t *out);
+
+// The NUMA node a CPU belongs to, 0 if the machine doesn't say
+int affinity_cpu_node(int cpu);
+
+// Have threads created with attr start out on cpu
+int affinity_attr_cpu(pthread_attr_t *attr, int cpu);
+
+// Keep the calling thread on cpu from now on
+int affinity_pin(int cpu);
+
+// Move the calling thread onto cpu for a moment (to allocate memory on its
+// node), saving where it was allowed to run before / put it back
+int affinity_enter(int cpu, cpu_set_t *saved);
+void affinity_leave(const cpu_set_t *saved);
+
+// Startup report: nodes and their CPUs, each NIC's receive queues and
+// where their interrupts go, and where acceptors and workers will run -
+// with a warning when they're on a different node from the NIC's IRQs.
+// Either list may be empty (not pinned).
+void affinity_report(FILE *out, const cpulist_t *acceptors, const cpulist_t *workers);
+
+#endif
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "affinity.h"
+
+// Checks for CPU lists and pinning: what affinity_parse takes and turns away,
+// and that pinning and entering/leaving a CPU show up in the thread's
+// affinity. It only pins to CPU 0 and otherwise sticks to CPUs that are
+// online, so it runs anywhere. Exits non-zero if anything's off. Build with
+// the affinity code, e.g. gcc -O2 -pthread affinity_test.c affinity.c
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+  fprintf(stdout, "%-48s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+// Parses to exactly these CPUs, in this order
+static int parses_to(const char *spec, const int *cpus, int n) {
+  cpulist_t list;
+  if (affinity_parse(spec, &list) < 0 || list.n != n) {
+    return 0;
+  }
+  for (int i = 0; i < n; i++) {
+    if (list.cpus[i] != cpus[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int refused(const char *spec) {
+  cpulist_t list;
+  return affinity_parse(spec, &list) < 0;
+}
+
+static int only_on(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  return sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) == 1 &&
+         CPU_ISSET(cpu, &set);
+}
+
+static void parsing() {
+  static const int zero[] = { 0 }, twice[] = { 0, 0 };
+  check(parses_to("0", zero, 1), "a single CPU");
+  check(parses_to("0-0", zero, 1), "a range of one");
+  check(parses_to("0,0", twice, 2), "a CPU listed twice is used twice");
+
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  char all[32];
+  cpulist_t list;
+  snprintf(all, sizeof(all), "0-%ld", online - 1);
+  check(affinity_parse(all, &list) == 0 && list.n == online, "every online CPU");
+
+  if (access("/sys/devices/system/node/node0/cpulist", R_OK) == 0) {
+    check(affinity_parse("n0", &list) == 0 && list.n > 0, "a whole node");
+  }
+  check(refused("n99"), "a node that isn't there is refused");
+  check(refused("n"), "a node without a number is refused");
+
+  check(refused(""), "an empty list is refused");
+  check(refused("a"), "a word is refused");
+  check(refused("-1"), "a negative CPU is refused");
+  check(refused("3-1"), "a backwards range is refused");
+  check(refused("0-"), "an open range is refused");
+  check(refused("99999"), "a CPU past the limit is refused");
+  if (online < AFFINITY_MAX_CPUS) {
+    char offline[16];
+    snprintf(offline, sizeof(offline), "%d", AFFINITY_MAX_CPUS - 1);
+    check(refused(offline), "a CPU that isn't online is refused");
+  }
+}
+
+static void pinning() {
+  cpu_set_t before, saved, after;
+  CPU_ZERO(&before);
+  CPU_ZERO(&after);
+  int ok = sched_getaffinity(0, sizeof(before), &before) == 0;
+
+  ok = ok && affinity_enter(0, &saved) == 0 && only_on(0);
+  check(ok, "enter moves the thread onto the CPU");
+  affinity_leave(&saved);
+  ok = ok && sched_getaffinity(0, sizeof(after), &after) == 0 && CPU_EQUAL(&before, &after);
+  check(ok, "leave puts it back where it was");
+
+  check(affinity_pin(0) == 0 && only_on(0), "pin keeps the thread on the CPU");
+}
+
+int main() {
+  parsing();
+  pinning();
+
+  fprintf(stdout, "%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
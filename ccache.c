@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ccache.h"
+
+#define CCACHE_SHARDS 16
+#define CCACHE_BUCKETS 1024  // hash chains per shard, power of two
+
+struct ccache_entry {
+    struct ccache_entry *hnext;  // hash chain
+    struct ccache_entry *prev;   // CLOCK ring
+    struct ccache_entry *next;
+    uint64_t hash;
+    int refs;        // the cache's own plus one per user
+    int referenced;  // hit since the hand last went past
+    size_t size;
+    char *data;      // points just past the path, same allocation
+    char path[];
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    ccache_entry_t *buckets[CCACHE_BUCKETS];
+    ccache_entry_t *hand;  // next entry the CLOCK looks at, NULL when empty
+    size_t bytes;
+    size_t entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} ccache_shard_t;
+
+struct ccache {
+    size_t shard_budget;
+    size_t max_size;
+    ccache_shard_t shards[CCACHE_SHARDS];
+};
+
+// FNV-1a
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *path; path++) {
+        h = (h ^ (unsigned char)*path) * 1099511628211ull;
+    }
+    return h;
+}
+
+static ccache_shard_t *shard_for(ccache_t *c, uint64_t hash) {
+    return &c->shards[(hash >> 32) % CCACHE_SHARDS];
+}
+
+static ccache_entry_t **bucket_for(ccache_shard_t *s, uint64_t hash) {
+    return &s->buckets[hash & (CCACHE_BUCKETS - 1)];
+}
+
+// Look a path up, shard lock held
+static ccache_entry_t *shard_find(ccache_shard_t *s, uint64_t hash, const char *path) {
+    for (ccache_entry_t *e = *bucket_for(s, hash); e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Take an entry out of the hash and the ring, shard lock held. The cache's
+// reference is the caller's to drop (after unlocking).
+static void shard_unlink(ccache_shard_t *s, ccache_entry_t *e) {
+    ccache_entry_t **link = bucket_for(s, e->hash);
+    while (*link != e) {
+        link = &(*link)->hnext;
+    }
+    *link = e->hnext;
+
+    if (e->next == e) {
+        s->hand = NULL;
+    } else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (s->hand == e) {
+            s->hand = e->next;
+        }
+    }
+    s->bytes -= e->size;
+    s->entries--;
+}
+
+// Sweep the hand until there's room for size more bytes. Evicted entries are
+// chained through hnext for the caller to release once the lock is dropped.
+static ccache_entry_t *shard_make_room(ccache_t *c, ccache_shard_t *s, size_t size) {
+    ccache_entry_t *victims = NULL;
+    while (s->hand && s->bytes + size > c->shard_budget) {
+        ccache_entry_t *e = s->hand;
+        if (e->referenced) {
+            e->referenced = 0;  // second chance
+            s->hand = e->next;
+            continue;
+        }
+        shard_unlink(s, e);
+        e->hnext = victims;
+        victims = e;
+        s->evictions++;
+    }
+    return victims;
+}
+
+ccache_t *ccache_create(size_t budget) {
+    ccache_t *c = calloc(1, sizeof(ccache_t));
+    if (!c) {
+        return NULL;
+    }
+    c->shard_budget = budget / CCACHE_SHARDS;
+    c->max_size = c->shard_budget / 4;
+    for (int i = 0; i < CCACHE_SHARDS; i++) {
+        pthread_mutex_init(&c->shards[i].lock, NULL);
+    }
+    return c;
+}
+
+void ccache_destroy(ccache_t *c) {
+    if (!c) {
+        return;
+    }
+    for (int i = 0; i < CCACHE_SHARDS; i++) {
+        ccache_shard_t *s = &c->shards[i];
+        while (s->hand) {
+            ccache_entry_t *e = s->hand;
+            shard_unlink(s, e);
+            ccache_release(e);
+        }
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(c);
+}
+
+// Find path and take a reference - counted in the hit/miss stats if count is set
+static ccache_entry_t *lookup(ccache_t *c, const char *path, int count) {
+    uint64_t hash = hash_path(path);
+    ccache_shard_t *s = shard_for(c, hash);
+
+    pthread_mutex_lock(&s->lock);
+    ccache_entry_t *e = shard_find(s, hash, path);
+    if (e) {
+        e->referenced = 1;
+        ccache_ref(e);
+    }
+    if (count) {
+        if (e) {
+            s->hits++;
+        } else {
+            s->misses++;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return e;
+}
+
+ccache_entry_t *ccache_get(ccache_t *c, const char *path) {
+    return lookup(c, path, 1);
+}
+
+ccache_entry_t *ccache_peek(ccache_t *c, const char *key) {
+    return lookup(c, key, 0);
+}
+
+// A new entry for path with room for size bytes, holding our reference and the caller's
+static ccache_entry_t *entry_new(const char *path, size_t size) {
+    size_t plen = strlen(path) + 1;
+    ccache_entry_t *e = malloc(sizeof(ccache_entry_t) + plen + size);
+    if (!e) {
+        return NULL;
+    }
+    memcpy(e->path, path, plen);
+    e->data = e->path + plen;
+    e->size = size;
+    e->hash = hash_path(path);
+    e->refs = 2;  // ours and the caller's
+    e->referenced = 0;
+    return e;
+}
+
+// Put a filled-in entry in its shard, or hand back the one that beat it there
+static ccache_entry_t *entry_insert(ccache_t *c, ccache_entry_t *e) {
+    ccache_shard_t *s = shard_for(c, e->hash);
+    pthread_mutex_lock(&s->lock);
+
+    // Someone else filled it first - use theirs
+    ccache_entry_t *have = shard_find(s, e->hash, e->path);
+    if (have) {
+        ccache_ref(have);
+        pthread_mutex_unlock(&s->lock);
+        free(e);
+        return have;
+    }
+
+    ccache_entry_t *victims = shard_make_room(c, s, e->size);
+
+    // New entries go in just behind the hand, so they get a full lap before it comes round
+    e->hnext = *bucket_for(s, e->hash);
+    *bucket_for(s, e->hash) = e;
+    if (s->hand) {
+        e->next = s->hand;
+        e->prev = s->hand->prev;
+        e->prev->next = e;
+        s->hand->prev = e;
+    } else {
+        e->next = e->prev = e;
+        s->hand = e;
+    }
+    s->bytes += e->size;
+    s->entries++;
+    pthread_mutex_unlock(&s->lock);
+
+    while (victims) {
+        ccache_entry_t *next = victims->hnext;
+        ccache_release(victims);
+        victims = next;
+    }
+    return e;
+}
+
+ccache_entry_t *ccache_fill(ccache_t *c, const char *path, int fd, size_t size) {
+    if (size > c->max_size) {
+        return NULL;
+    }
+
+    // Read it in before taking the lock - the disk can be slow
+    ccache_entry_t *e = entry_new(path, size);
+    if (!e) {
+        return NULL;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, e->data + done, size - done, (off_t)done);
+        if (n <= 0) {
+            free(e);
+            return NULL;
+        }
+        done += (size_t)n;
+    }
+    return entry_insert(c, e);
+}
+
+ccache_entry_t *ccache_put(ccache_t *c, const char *key, const void *data, size_t size) {
+    if (size > c->max_size) {
+        return NULL;
+    }
+    ccache_entry_t *e = entry_new(key, size);
+    if (!e) {
+        return NULL;
+    }
+    memcpy(e->data, data, size);
+    return entry_insert(c, e);
+}
+
+void ccache_invalidate(ccache_t *c, const char *path) {
+    uint64_t hash = hash_path(path);
+    ccache_shard_t *s = shard_for(c, hash);
+
+    pthread_mutex_lock(&s->lock);
+    ccache_entry_t *e = shard_find(s, hash, path);
+    if (e) {
+        shard_unlink(s, e);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (e) {
+        ccache_release(e);
+    }
+}
+
+size_t ccache_max_size(const ccache_t *c) {
+    return c->max_size;
+}
+
+void ccache_ref(ccache_entry_t *e) {
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+}
+
+void ccache_release(void *entry) {
+    ccache_entry_t *e = entry;
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(e);
+    }
+}
+
+const char *ccache_data(const ccache_entry_t *e) {
+    return e->data;
+}
+
+size_t ccache_size(const ccache_entry_t *e) {
+    return e->size;
+}
+
+void ccache_stats(ccache_t *c, ccache_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < CCACHE_SHARDS; i++) {
+        ccache_shard_t *s = &c->shards[i];
+        pthread_mutex_lock(&s->lock);
+        out->hits += s->hits;
+        out->misses += s->misses;
+        out->evictions += s->evictions;
+        out->bytes += s->bytes;
+        out->entries += s->entries;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
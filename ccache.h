@@ -0,0 +1,59 @@
+#ifndef CCACHE_H
+#define CCACHE_H
+
+#include <stddef.h>
+
+// File content cache, keyed by path. Split into shards that each have their
+// own lock, byte budget and CLOCK hand: a hit sets the entry's reference bit,
+// and when a shard needs room the hand sweeps past entries, clearing bits,
+// until it finds one nobody has hit since its last pass.
+//
+// Entries are reference counted. Whoever gets one from ccache_get/ccache_fill
+// can keep using its bytes after it's been evicted, until ccache_release.
+typedef struct ccache ccache_t;
+typedef struct ccache_entry ccache_entry_t;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;    // file bytes held right now
+    size_t entries;
+} ccache_stats_t;
+
+// budget is the total bytes of file content to hold. Files bigger than a
+// quarter of a shard's share are never cached. NULL on failure.
+ccache_t *ccache_create(size_t budget);
+void ccache_destroy(ccache_t *c);
+
+// Cached copy of path with a reference taken, or NULL (counted as a miss)
+ccache_entry_t *ccache_get(ccache_t *c, const char *path);
+
+// Same, but left out of the hit/miss counts - for derived keys (see
+// ccache_put), so the stats stay about the files requests asked for
+ccache_entry_t *ccache_peek(ccache_t *c, const char *key);
+
+// Read size bytes of fd into the cache under path and return it referenced.
+// NULL if it's too big to cache or the read comes up short.
+ccache_entry_t *ccache_fill(ccache_t *c, const char *path, int fd, size_t size);
+
+// Same for bytes that are already in memory (derived data, like a compressed
+// copy of a file), under any key. They're copied.
+ccache_entry_t *ccache_put(ccache_t *c, const char *key, const void *data, size_t size);
+
+// Drop path's entry, if there is one - the file changed under us. Anyone
+// still sending the old bytes keeps them until they release.
+void ccache_invalidate(ccache_t *c, const char *path);
+
+// Largest file ccache_fill will take
+size_t ccache_max_size(const ccache_t *c);
+
+void ccache_ref(ccache_entry_t *e);
+void ccache_release(void *entry);  // void * so it can be handed out as a callback
+
+const char *ccache_data(const ccache_entry_t *e);
+size_t ccache_size(const ccache_entry_t *e);
+
+void ccache_stats(ccache_t *c, ccache_stats_t *out);
+
+#endif
@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "ccache.h"
+
+// Checks for the content cache: size limits, peeks that stay out of the stats,
+// eviction order, and that reference counts keep bytes alive past eviction and
+// invalidation. Then a stress run of gets, puts and invalidations from several
+// threads, checking every entry's bytes as it goes. Refcount mistakes that
+// don't corrupt data show up as leaks or use-after-free - run a
+// -fsanitize=address build for those. Exits non-zero if anything's off. Build
+// with the cache, e.g. gcc -O2 -pthread ccache_test.c ccache.c
+
+#define MAX_THREADS 256
+#define SHARDS 16                // same as ccache.c
+#define SHARD_BUDGET (64 << 10)  // per shard, so files up to 16K are cached
+#define ENTRY_SIZE 4096
+#define STRESS_KEYS 256
+
+#define USAGE                                                                  \
+  "usage:\n"                                                                   \
+  "  ccache_test [options]\n"                                                  \
+  "options:\n"                                                                 \
+  "  -h                  Show this help message\n"                             \
+  "  -t [threads]        Stress threads (Default: 8)\n"                        \
+  "  -n [ops]            Cache operations per thread (Default: 200000)\n"
+
+static struct option gLongOptions[] = {
+  {"threads", required_argument, NULL, 't'},
+  {"ops", required_argument, NULL, 'n'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static int nthreads = 8;
+static long nops = 200000;
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+  fprintf(stdout, "%-48s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+// Every byte of a key's data says which key it is
+static void fill_pattern(char *buf, size_t len, int key) {
+  memset(buf, 'a' + key % 26, len);
+}
+
+static int has_pattern(const ccache_entry_t *e, size_t len, int key) {
+  const char *data = ccache_data(e);
+  if (ccache_size(e) != len) {
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] != 'a' + key % 26) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static ccache_entry_t *put_key(ccache_t *c, const char *key, int n, size_t len) {
+  char buf[ENTRY_SIZE];
+  fill_pattern(buf, len, n);
+  return ccache_put(c, key, buf, len);
+}
+
+// Same FNV-1a and shard pick as ccache.c, so a test can line keys up in one shard
+static int shard_of(const char *path) {
+  uint64_t h = 14695981039346656037ull;
+  for (; *path; path++) {
+    h = (h ^ (unsigned char)*path) * 1099511628211ull;
+  }
+  return (int)((h >> 32) % SHARDS);
+}
+
+// The next key of the form /kN that lands in shard
+static void key_in_shard(int shard, int *next, char *key, size_t size) {
+  do {
+    snprintf(key, size, "/k%d", (*next)++);
+  } while (shard_of(key) != shard);
+}
+
+static void basics() {
+  ccache_t *c = ccache_create(SHARDS * SHARD_BUDGET);
+  size_t max = ccache_max_size(c);
+  check(max == SHARD_BUDGET / 4, "largest cacheable file is a quarter shard");
+
+  ccache_entry_t *e = put_key(c, "/a", 0, 100);
+  ccache_release(e);
+  e = ccache_get(c, "/a");
+  check(e && has_pattern(e, 100, 0), "get returns what was put");
+  ccache_release(e);
+  check(ccache_get(c, "/nope") == NULL, "unknown path misses");
+
+  e = put_key(c, "/a", 1, 100);
+  check(e && has_pattern(e, 100, 0), "a second put keeps the first copy");
+  ccache_release(e);
+
+  char big[SHARD_BUDGET];
+  memset(big, 'x', sizeof(big));
+  check(ccache_put(c, "/big", big, max + 1) == NULL, "too big is refused");
+  e = ccache_put(c, "/max", big, max);
+  check(e != NULL, "exactly the limit is taken");
+  ccache_release(e);
+
+  // From a file, and from one that's shorter than we were told
+  char path[] = "/tmp/ccache_test_XXXXXX";
+  int fd = mkstemp(path);
+  char buf[ENTRY_SIZE];
+  fill_pattern(buf, sizeof(buf), 2);
+  int wrote = fd >= 0 && write(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf);
+  e = wrote ? ccache_fill(c, "/file", fd, sizeof(buf)) : NULL;
+  check(e && has_pattern(e, sizeof(buf), 2), "fill reads the file in");
+  if (e) {
+    ccache_release(e);
+  }
+  check(wrote && ccache_fill(c, "/short", fd, sizeof(buf) + 1) == NULL, "short read is refused");
+  if (fd >= 0) {
+    close(fd);
+    unlink(path);
+  }
+
+  // Peeks find the same entries but stay out of the hit ratio
+  e = ccache_peek(c, "/a");
+  check(e && has_pattern(e, 100, 0), "peek returns what was put");
+  if (e) {
+    ccache_release(e);
+  }
+  check(ccache_peek(c, "/nope") == NULL, "peek at an unknown key finds nothing");
+
+  ccache_stats_t st;
+  ccache_stats(c, &st);
+  check(st.hits == 1 && st.misses == 1 && st.entries == 3, "hits, misses and entries counted");
+  ccache_destroy(c);
+}
+
+// Sixteen 4K entries fill a shard. The hand starts at the oldest, so the next
+// insert evicts it - unless it was hit since, in which case it gets a second
+// chance and the one after it goes instead.
+static void eviction() {
+  ccache_t *c = ccache_create(SHARDS * SHARD_BUDGET);
+  char keys[SHARD_BUDGET / ENTRY_SIZE + 1][32];
+  int per_shard = SHARD_BUDGET / ENTRY_SIZE;
+  int next = 0;
+
+  for (int i = 0; i <= per_shard; i++) {
+    key_in_shard(3, &next, keys[i], sizeof(keys[i]));
+  }
+  for (int i = 0; i < per_shard; i++) {
+    ccache_release(put_key(c, keys[i], i, ENTRY_SIZE));
+  }
+  ccache_stats_t st;
+  ccache_stats(c, &st);
+  check(st.evictions == 0 && st.bytes == SHARD_BUDGET, "a shard fills to its budget");
+
+  // Hit the oldest, then make room for one more
+  ccache_release(ccache_get(c, keys[0]));
+  ccache_release(put_key(c, keys[per_shard], per_shard, ENTRY_SIZE));
+  ccache_entry_t *e0 = ccache_get(c, keys[0]);
+  ccache_entry_t *e1 = ccache_get(c, keys[1]);
+  ccache_entry_t *e2 = ccache_get(c, keys[2]);
+  check(e0 != NULL, "a hit entry gets a second chance");
+  check(e1 == NULL && e2 != NULL, "the hand takes the next one instead");
+  ccache_stats(c, &st);
+  check(st.evictions == 1 && st.bytes == SHARD_BUDGET, "one in, one out");
+
+  // Bytes someone still holds outlive the entry being evicted or invalidated
+  ccache_invalidate(c, keys[0]);
+  check(ccache_get(c, keys[0]) == NULL, "invalidated entry is gone");
+  check(has_pattern(e0, ENTRY_SIZE, 0), "its holder still has the bytes");
+  for (int i = 0; i < 2 * per_shard; i++) {
+    char key[32];
+    key_in_shard(3, &next, key, sizeof(key));
+    ccache_release(put_key(c, key, 7, ENTRY_SIZE));
+  }
+  check(ccache_get(c, keys[2]) == NULL, "evicted entry is gone");
+  check(has_pattern(e2, ENTRY_SIZE, 2), "its holder still has the bytes");
+  ccache_release(e0);
+  ccache_release(e2);
+
+  ccache_stats(c, &st);
+  check(st.bytes <= SHARD_BUDGET, "the shard stays within its budget");
+  ccache_destroy(c);
+}
+
+static ccache_t *shared;
+static int stress_ok = 1;
+
+// Random gets, puts and invalidations over a key set that doesn't fit. Key n's
+// bytes are all the same letter and its size depends on n, so any mix-up shows.
+static void *stress_thread(void *arg) {
+  unsigned seed = (unsigned)(uintptr_t)arg;
+  char key[32];
+  for (long i = 0; i < nops; i++) {
+    int n = rand_r(&seed) % STRESS_KEYS;
+    size_t len = 1024 + (size_t)n * 37 % (ENTRY_SIZE - 1024);
+    snprintf(key, sizeof(key), "/s%d", n);
+
+    int op = rand_r(&seed) % 10;
+    ccache_entry_t *e;
+    if (op < 6) {
+      e = ccache_get(shared, key);
+    } else if (op < 9) {
+      e = put_key(shared, key, n, len);
+    } else {
+      ccache_invalidate(shared, key);
+      continue;
+    }
+    if (e) {
+      if (!has_pattern(e, len, n)) {
+        __atomic_store_n(&stress_ok, 0, __ATOMIC_RELAXED);
+      }
+      ccache_release(e);
+    }
+  }
+  return NULL;
+}
+
+static void stress() {
+  pthread_t threads[MAX_THREADS];
+
+  // A quarter of what the keys would take, so eviction never stops
+  shared = ccache_create(STRESS_KEYS * ENTRY_SIZE / 4);
+  for (long i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, stress_thread, (void *)(i + 1));
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  ccache_stats_t st;
+  ccache_stats(shared, &st);
+  check(stress_ok, "stress: every entry had the right bytes");
+  check(st.bytes <= STRESS_KEYS * ENTRY_SIZE / 4 && st.evictions > 0,
+        "stress: evicted to stay in budget");
+  ccache_destroy(shared);
+}
+
+int main(int argc, char **argv) {
+  int option_char = 0;
+
+  while ((option_char = getopt_long(argc, argv, "t:n:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 't':
+        nthreads = atoi(optarg);
+        break;
+      case 'n':
+        nops = atol(optarg);
+        break;
+      case 'h':
+        fprintf(stdout, "%s", USAGE);
+        exit(0);
+      default:
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+    }
+  }
+
+  if (nthreads < 1 || nthreads > MAX_THREADS || nops < 1) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  basics();
+  eviction();
+  fprintf(stdout, "%d threads, %ld ops each\n", nthreads, nops);
+  stress();
+
+  fprintf(stdout, "%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
@@ -5,12 +5,20 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
 
 #include "gfclient-student.h"
 
 #define REQ_BUFSIZE 1024
 #define HDR_BUFSIZE 4096
 #define DATA_BUFSIZE 4096
+#define POOL_SIZE 64
+#define POOL_IDLE_SECS 5  // drop pooled connections before the server's idle timeout gets them
+#define MAX_HDR_TOKENS 8
+#define MAX_STREAMS 128  // requests per gfc_perform_multi call (matches the server's per-connection cap)
 
 // Main request 
 struct gfcrequest_t {
@@ -27,8 +35,84 @@ struct gfcrequest_t {
     gfstatus_t status;
     size_t filelen;
     size_t bytesreceived;
+
+    // optional byte range, and what the server said about it
+    int range;
+    size_t range_off;
+    size_t range_len;
+    size_t totallen;  // size of the whole file
+
+    // compressed transfer: offered, and whether this response took us up on it
+    int deflate;
+    int deflated;
+    size_t wirelen;        // body bytes the server sends - filelen unless compressed
+    size_t wirereceived;
+    z_stream zs;
+    int zs_ready;
 };
 
+// Idle kept-alive connection, keyed by server:port
+typedef struct {
+    int used;
+    char server[256];
+    unsigned short port;
+    int fd;
+    time_t since;
+} pooled_conn_t;
+
+// Connection pool shared by every request in the process
+static pooled_conn_t pool[POOL_SIZE];
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Take an idle connection to server:port out of the pool, -1 if there isn't one
+static int pool_get(const char *server, unsigned short port) {
+    int fd = -1;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&pool_mtx);
+    for (int i = 0; i < POOL_SIZE && fd < 0; i++) {
+        if (!pool[i].used || pool[i].port != port || strcmp(pool[i].server, server) != 0) {
+            continue;
+        }
+        pool[i].used = 0;
+        if (now - pool[i].since >= POOL_IDLE_SECS) {
+            close(pool[i].fd);  // too old, the server has probably given up on it
+            continue;
+        }
+        fd = pool[i].fd;
+    }
+    pthread_mutex_unlock(&pool_mtx);
+
+    return fd;
+}
+
+// Put a connection back for reuse - evicts the oldest entry if the pool is full
+static void pool_put(const char *server, unsigned short port, int fd) {
+    pthread_mutex_lock(&pool_mtx);
+
+    int slot = 0;
+    for (int i = 0; i < POOL_SIZE; i++) {
+        if (!pool[i].used) {
+            slot = i;
+            break;
+        }
+        if (pool[i].since < pool[slot].since) {
+            slot = i;
+        }
+    }
+    if (pool[slot].used) {
+        close(pool[slot].fd);
+    }
+
+    pool[slot].used = 1;
+    snprintf(pool[slot].server, sizeof(pool[slot].server), "%s", server);
+    pool[slot].port = port;
+    pool[slot].fd = fd;
+    pool[slot].since = time(NULL);
+
+    pthread_mutex_unlock(&pool_mtx);
+}
+
 // Helper function
 static int send_all(int sockfd, const void *buf, size_t len) {
     const char *p = buf;
@@ -65,6 +149,9 @@ static gfstatus_t parse_status(const char *status_str) {
 
 void gfc_cleanup(gfcrequest_t **gfr) {
     if (gfr && *gfr) {
+        if ((*gfr)->zs_ready) {
+            inflateEnd(&(*gfr)->zs);
+        }
         free(*gfr);
         *gfr = NULL;
     }
@@ -106,10 +193,30 @@ size_t gfc_get_filelen(gfcrequest_t **gfr) {
     return (*gfr)->filelen;
 }
 
+// Size of the whole file - differs from gfc_get_filelen for range requests
+size_t gfc_get_totallen(gfcrequest_t **gfr) {
+    if (!gfr || !*gfr) {
+        return 0;
+    }
+    return (*gfr)->totallen;
+}
+
 void gfc_global_init() {
+    pthread_mutex_lock(&pool_mtx);
+    memset(pool, 0, sizeof(pool));
+    pthread_mutex_unlock(&pool_mtx);
 }
 
 void gfc_global_cleanup() {
+    // Close whatever is still sitting in the pool
+    pthread_mutex_lock(&pool_mtx);
+    for (int i = 0; i < POOL_SIZE; i++) {
+        if (pool[i].used) {
+            close(pool[i].fd);
+            pool[i].used = 0;
+        }
+    }
+    pthread_mutex_unlock(&pool_mtx);
 }
 
 void gfc_set_path(gfcrequest_t **gfr, const char *path) {
@@ -120,6 +227,27 @@ void gfc_set_path(gfcrequest_t **gfr, const char *path) {
     (*gfr)->path[sizeof((*gfr)->path) - 1] = '\0';  // make sure it's null terminated
 }
 
+// Only fetch len bytes starting at offset (len 0 means up to the end). Lets
+// callers resume a broken download or pull slices of one file in parallel.
+void gfc_set_range(gfcrequest_t **gfr, size_t offset, size_t len) {
+    if (!gfr || !*gfr) {
+        return;
+    }
+    (*gfr)->range = 1;
+    (*gfr)->range_off = offset;
+    (*gfr)->range_len = len;
+}
+
+// Offer to take the body zlib-compressed. Servers that have a compressed copy
+// send that instead, and it's inflated before it reaches the write callback,
+// so callers see the same bytes either way. Range requests always come raw.
+void gfc_set_deflate(gfcrequest_t **gfr, int enabled) {
+    if (!gfr || !*gfr) {
+        return;
+    }
+    (*gfr)->deflate = enabled;
+}
+
 void gfc_set_headerfunc(gfcrequest_t **gfr, void (*headerfunc)(void *, size_t, void *)) {
     if (!gfr || !*gfr) {
         return;
@@ -163,19 +291,8 @@ void gfc_set_writefunc(gfcrequest_t **gfr, void (*writefunc)(void *, size_t, voi
     (*gfr)->writefunc = writefunc;
 }
 
-// Main function 
-int gfc_perform(gfcrequest_t **gfr) {
-    if (!gfr || !*gfr) {
-        return -1;
-    }
-    
-    gfcrequest_t *req = *gfr;
-    
-    // Reset state
-    req->bytesreceived = 0;
-    req->filelen = 0;
-    req->status = GF_INVALID;
-    
+// Open a fresh connection to the request's server
+static int connect_server(gfcrequest_t *req) {
     // Resolve the server address
     char portstr[16];
     snprintf(portstr, sizeof(portstr), "%hu", req->port);
@@ -206,133 +323,518 @@ int gfc_perform(gfcrequest_t **gfr) {
     }
     
     freeaddrinfo(res);
-    
-    if (sockfd == -1) {
-        return -1;  // couldn't connect
+    return sockfd;
+}
+
+// Split the response line into tokens and fill in status/filelen.
+// Returns -1 if it isn't a GETFILE response.
+static int parse_header(gfcrequest_t *req, const char *hdr, size_t len, int *keepalive) {
+    char line[HDR_BUFSIZE];
+    if (len >= sizeof(line)) {
+        return -1;
     }
-    
-    // Build and send the request
-    char reqbuf[REQ_BUFSIZE];
-    int n = snprintf(reqbuf, sizeof(reqbuf), "GETFILE GET %s\r\n\r\n", req->path);
-    
-    if (n <= 0 || (size_t)n >= sizeof(reqbuf)) {
-        close(sockfd);
+    memcpy(line, hdr, len);
+    line[len] = '\0';
+
+    char *tokens[MAX_HDR_TOKENS];
+    int ntok = 0;
+    char *save = NULL;
+    for (char *t = strtok_r(line, " \r\n", &save); t && ntok < MAX_HDR_TOKENS;
+         t = strtok_r(NULL, " \r\n", &save)) {
+        tokens[ntok++] = t;
+    }
+
+    if (ntok < 2 || strcmp(tokens[0], "GETFILE") != 0) {
         return -1;
     }
+
+    req->status = parse_status(tokens[1]);
+    req->filelen = 0;
+    req->totallen = 0;
+    req->deflated = 0;
+    *keepalive = 0;
+    int ranged = 0;
+    size_t inflated_len = 0;
+
+    // Some responses don't include file length, and newer servers add options after it
+    int i = 2;
+    if (req->status == GF_OK) {
+        if (ntok < 3) {
+            return -1;
+        }
+        char *endp;
+        req->filelen = strtoull(tokens[2], &endp, 10);
+        if (*endp != '\0') {
+            return -1;
+        }
+        i = 3;
+    }
+    req->totallen = req->filelen;
+    for (; i < ntok; i++) {
+        if (strcmp(tokens[i], "KEEPALIVE") == 0) {
+            *keepalive = 1;
+        } else if (strcmp(tokens[i], "RANGE") == 0 && i + 2 < ntok) {
+            char *endp1, *endp2;
+            size_t off = strtoull(tokens[i + 1], &endp1, 10);
+            req->totallen = strtoull(tokens[i + 2], &endp2, 10);
+            if (*endp1 != '\0' || *endp2 != '\0' || off != req->range_off) {
+                return -1;
+            }
+            ranged = 1;
+            i += 2;
+        } else if (strcmp(tokens[i], "DEFLATE") == 0 && i + 1 < ntok && req->deflate) {
+            char *endp;
+            inflated_len = strtoull(tokens[i + 1], &endp, 10);
+            if (*endp != '\0') {
+                return -1;
+            }
+            req->deflated = 1;
+            i++;
+        }
+    }
+
+    // Compressed: what comes over the wire isn't what the caller gets
+    req->wirelen = req->filelen;
+    if (req->deflated) {
+        req->filelen = req->totallen = inflated_len;
+    }
+
+    // A server that doesn't know about ranges sends the whole file - not what we asked for
+    if (req->status == GF_OK && req->range && !ranged) {
+        req->status = GF_INVALID;
+        return -1;
+    }
+    return 0;
+}
+
+// The request line for req, plus extra options (e.g. KEEPALIVE) before the end marker
+static int format_request(const gfcrequest_t *req, char *buf, size_t size, const char *extra) {
+    char range[64] = "";
+    if (req->range) {
+        snprintf(range, sizeof(range), " RANGE %zu %zu", req->range_off, req->range_len);
+    }
+    const char *deflate = req->deflate && !req->range ? " DEFLATE" : "";
+    int n = snprintf(buf, size, "GETFILE GET %s%s%s%s\r\n\r\n", req->path, range, deflate, extra);
+    return (n <= 0 || (size_t)n >= size) ? -1 : n;
+}
+
+// Get ready for a response body - a fresh inflate stream if it's compressed
+static int body_start(gfcrequest_t *req) {
+    req->wirereceived = 0;
+    if (!req->deflated) {
+        return 0;
+    }
+    if (req->zs_ready) {
+        return inflateReset(&req->zs) == Z_OK ? 0 : -1;
+    }
+    memset(&req->zs, 0, sizeof(req->zs));
+    if (inflateInit(&req->zs) != Z_OK) {
+        return -1;
+    }
+    req->zs_ready = 1;
+    return 0;
+}
+
+// Body bytes off the wire go to the write callback - inflated on the way
+// through, a buffer at a time, if the server compressed them
+static int body_deliver(gfcrequest_t *req, const void *data, size_t len) {
+    req->wirereceived += len;
+    if (!req->deflated) {
+        if (req->writefunc) {
+            req->writefunc((void *)data, len, req->writearg);
+        }
+        req->bytesreceived += len;
+        return 0;
+    }
+
+    char out[DATA_BUFSIZE];
+    req->zs.next_in = (Bytef *)data;
+    req->zs.avail_in = (uInt)len;
+    do {
+        req->zs.next_out = (Bytef *)out;
+        req->zs.avail_out = sizeof(out);
+        int rc = inflate(&req->zs, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            return -1;  // corrupt stream
+        }
+
+        size_t got = sizeof(out) - req->zs.avail_out;
+        if (req->bytesreceived + got > req->filelen) {
+            return -1;  // inflates to more than we were promised
+        }
+        if (got > 0 && req->writefunc) {
+            req->writefunc(out, got, req->writearg);
+        }
+        req->bytesreceived += got;
+
+        if (rc == Z_STREAM_END) {
+            return req->zs.avail_in == 0 ? 0 : -1;  // nothing may follow the end
+        }
+        if (rc == Z_BUF_ERROR) {
+            break;  // needs more input
+        }
+    } while (req->zs.avail_out == 0 || req->zs.avail_in > 0);
+    return 0;
+}
+
+// All the wire bytes are in - a compressed body has to have inflated to the full file
+static int body_complete(const gfcrequest_t *req) {
+    return req->bytesreceived == req->filelen ? 0 : -1;
+}
+
+// Result of one request/response exchange on a socket
+#define XFER_OK 0
+#define XFER_FAILED -1
+#define XFER_STALE -2  // nothing came back at all - a pooled connection the server already closed
+
+// Send the request on sockfd and read the whole response
+static int exchange(gfcrequest_t *req, int sockfd, int *keepalive) {
+    *keepalive = 0;
+
+    // Build and send the request - always offer keep-alive, old servers ignore it
+    char reqbuf[REQ_BUFSIZE];
+    int n = format_request(req, reqbuf, sizeof(reqbuf), " KEEPALIVE");
+    if (n < 0) {
+        return XFER_FAILED;
+    }
     
     if (send_all(sockfd, reqbuf, (size_t)n) < 0) {
-        close(sockfd);
-        return -1;
+        return XFER_STALE;
     }
     
     // Now read the response header
     char hdrbuf[HDR_BUFSIZE];
     size_t hdrlen = 0;
+    size_t header_bytes = 0;
     
     // Keep reading until we find the end of header marker
-    while (hdrlen + 1 < sizeof(hdrbuf)) {
+    while (!header_bytes) {
+        if (hdrlen + 1 >= sizeof(hdrbuf)) {
+            return XFER_FAILED;  // header was too large or malformed
+        }
+
         ssize_t r = recv(sockfd, hdrbuf + hdrlen, sizeof(hdrbuf) - hdrlen - 1, 0);
         
         if (r <= 0) {
-            close(sockfd);
-            return -1;
+            return hdrlen == 0 ? XFER_STALE : XFER_FAILED;
         }
         
+        // Only look at the new bytes (and the 3 before them, in case the marker got split)
+        size_t from = hdrlen > 3 ? hdrlen - 3 : 0;
         hdrlen += (size_t)r;
         hdrbuf[hdrlen] = '\0';
         
         // Look for end of header
-        char *end = strstr(hdrbuf, "\r\n\r\n");
+        char *end = strstr(hdrbuf + from, "\r\n\r\n");
         if (end) {
-            size_t header_bytes = (end + 4) - hdrbuf;
-            
-            // Parse the header line
-            char proto[32], status_str[32];
-            size_t filelen = 0;
-            int parsed = sscanf(hdrbuf, "%31s %31s %zu", proto, status_str, &filelen);
-            
-            // Some responses don't include file length 
-            if (parsed < 2) {
-                close(sockfd);
-                return -1;
-            }
-            
-            if (parsed == 2) {
-                filelen = 0;  // no file length provided
-            }
-            
-            if (strcmp(proto, "GETFILE") != 0) {
-                close(sockfd);
-                return -1;
-            }
-            
-            req->status = parse_status(status_str);
-            req->filelen = filelen;
-            
-            // Call header callback if set
-            if (req->headerfunc) {
-                req->headerfunc(hdrbuf, header_bytes, req->headerarg);
-            }
-            
-            // Check if there's any data after the header
-            size_t remaining = hdrlen - header_bytes;
-            
-            if (req->status == GF_OK) {
-                if (remaining > 0 && req->writefunc) {
-                    req->writefunc(hdrbuf + header_bytes, remaining, req->writearg);
-                }
-                req->bytesreceived += remaining;
-            }
-            
-            goto read_body;  // jump to body reading
+            header_bytes = (end + 4) - hdrbuf;
         }
     }
-    
-    // Header was too large or malformed
-    close(sockfd);
-    return -1;
 
-read_body:
+    if (parse_header(req, hdrbuf, header_bytes, keepalive) < 0) {
+        return XFER_FAILED;
+    }
+            
+    // Call header callback if set
+    if (req->headerfunc) {
+        req->headerfunc(hdrbuf, header_bytes, req->headerarg);
+    }
+
     // If status isn't OK, we're done
     if (req->status != GF_OK) {
-        req->bytesreceived = 0;
-        close(sockfd);
-        return 0;
+        return XFER_OK;
+    }
+            
+    // Whatever came in after the header is the start of the body
+    size_t remaining = hdrlen - header_bytes;
+    if (remaining > req->wirelen) {
+        return XFER_FAILED;  // more than we were promised
+    }
+    if (body_start(req) < 0) {
+        return XFER_FAILED;
+    }
+    if (remaining > 0 && body_deliver(req, hdrbuf + header_bytes, remaining) < 0) {
+        return XFER_FAILED;
     }
     
-    // Read the file data
+    // Read the rest of the file data - never past the end, the connection may be reused
     char databuf[DATA_BUFSIZE];
     
-    for (;;) {
-        ssize_t r = recv(sockfd, databuf, sizeof(databuf), 0);
+    while (req->wirereceived < req->wirelen) {
+        size_t want = req->wirelen - req->wirereceived;
+        if (want > sizeof(databuf)) {
+            want = sizeof(databuf);
+        }
+
+        ssize_t r = recv(sockfd, databuf, want, 0);
         
-        if (r < 0) {
+        if (r <= 0) {
+            return XFER_FAILED;  // error or premature close
+        }
+        
+        if (body_deliver(req, databuf, (size_t)r) < 0) {
+            return XFER_FAILED;
+        }
+    }
+    
+    return body_complete(req) == 0 ? XFER_OK : XFER_FAILED;
+}
+
+// Main function 
+int gfc_perform(gfcrequest_t **gfr) {
+    if (!gfr || !*gfr) {
+        return -1;
+    }
+    
+    gfcrequest_t *req = *gfr;
+    
+    // Reset state
+    req->bytesreceived = 0;
+    req->filelen = 0;
+    req->status = GF_INVALID;
+
+    // Reuse an idle connection if we have one
+    int sockfd = pool_get(req->server, req->port);
+    int pooled = sockfd >= 0;
+
+    if (!pooled) {
+        sockfd = connect_server(req);
+    }
+    if (sockfd == -1) {
+        return -1;  // couldn't connect
+    }
+
+    int keepalive = 0;
+    int rc = exchange(req, sockfd, &keepalive);
+
+    // The server may have timed out a pooled connection just as we picked it up.
+    // Nothing was delivered yet, so it's safe to retry once on a fresh one.
+    if (rc == XFER_STALE && pooled) {
+        close(sockfd);
+        sockfd = connect_server(req);
+        if (sockfd == -1) {
+            return -1;
+        }
+        rc = exchange(req, sockfd, &keepalive);
+    }
+
+    if (rc != XFER_OK) {
+        close(sockfd);
+        return -1;
+    }
+
+    if (req->status != GF_OK) {
+        req->bytesreceived = 0;
+    }
+
+    if (keepalive) {
+        pool_put(req->server, req->port, sockfd);
+    } else {
+        close(sockfd);
+    }
+    return 0;
+}
+
+// Per-stream bookkeeping while demultiplexing
+typedef struct {
+    char hdr[HDR_BUFSIZE];
+    size_t hdrlen;
+    int header_done;
+    int done;
+} mux_stream_t;
+
+// Frame payload bytes for one stream. The first frame of every stream is its
+// response header, everything after that is body.
+static int mux_deliver(gfcrequest_t *req, mux_stream_t *ms, const char *data, size_t len, int frame_end) {
+    if (!ms->header_done) {
+        if (ms->hdrlen + len >= sizeof(ms->hdr)) {
+            return -1;
+        }
+        memcpy(ms->hdr + ms->hdrlen, data, len);
+        ms->hdrlen += len;
+        if (!frame_end) {
+            return 0;
+        }
+
+        int keepalive;
+        if (parse_header(req, ms->hdr, ms->hdrlen, &keepalive) < 0) {
+            return -1;
+        }
+        ms->header_done = 1;
+        if (req->headerfunc) {
+            req->headerfunc(ms->hdr, ms->hdrlen, req->headerarg);
+        }
+        if (req->status != GF_OK || req->wirelen == 0) {
+            ms->done = 1;
+        }
+        return body_start(req);
+    }
+
+    if (req->wirereceived + len > req->wirelen) {
+        return -1;  // more than we were promised
+    }
+    if (body_deliver(req, data, len) < 0) {
+        return -1;
+    }
+    if (req->wirereceived == req->wirelen) {
+        ms->done = 1;
+        return body_complete(req);
+    }
+    return 0;
+}
+
+// Run several requests against the same server over one connection. They all
+// go out up front, each tagged with a stream id, and the server answers them
+// in whatever order the files are ready, in interleaved frames. Each request's
+// callbacks only ever see its own bytes. Servers that don't speak the framed
+// mode answer the first request plainly, in which case we redo them one by one.
+int gfc_perform_multi(gfcrequest_t **gfrs, size_t count) {
+    if (!gfrs || count == 0 || count > MAX_STREAMS) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!gfrs[i]) {
+            return -1;
+        }
+        gfrs[i]->bytesreceived = 0;
+        gfrs[i]->filelen = 0;
+        gfrs[i]->status = GF_INVALID;
+    }
+
+    int sockfd = connect_server(gfrs[0]);
+    if (sockfd == -1) {
+        return -1;
+    }
+
+    // Stream ids start at 1 - 0 is where the server reports requests it couldn't parse
+    char *reqbuf = malloc(count * REQ_BUFSIZE);
+    mux_stream_t *streams = calloc(count, sizeof(mux_stream_t));
+    if (!reqbuf || !streams) {
+        free(reqbuf);
+        free(streams);
+        close(sockfd);
+        return -1;
+    }
+
+    size_t reqlen = 0;
+    for (size_t i = 0; i < count; i++) {
+        char stream[32];
+        snprintf(stream, sizeof(stream), " STREAM %zu", i + 1);
+        int n = format_request(gfrs[i], reqbuf + reqlen, REQ_BUFSIZE, stream);
+        if (n < 0) {
+            free(reqbuf);
+            free(streams);
             close(sockfd);
             return -1;
         }
-        
-        if (r == 0) {
-            // Connection closed, check if we got everything
-            if (req->bytesreceived < req->filelen) {
-                close(sockfd);
-                return -1;  // premature close
-            }
+        reqlen += (size_t)n;
+    }
+
+    int rc = send_all(sockfd, reqbuf, reqlen);
+    free(reqbuf);
+
+    // Frame parser state
+    unsigned char fhdr[8];
+    size_t fhave = 0;       // frame header bytes collected
+    size_t cur = 0;         // stream index the current frame belongs to
+    size_t cur_left = 0;    // payload bytes left in the current frame
+    size_t pending = count;
+    int first = 1;
+
+    char databuf[DATA_BUFSIZE * 4];
+
+    while (rc == 0 && pending > 0) {
+        ssize_t r = recv(sockfd, databuf, sizeof(databuf), 0);
+        if (r <= 0) {
+            // Dropped before anything came back - a one-request-per-connection server
+            // may reset us over the requests it never read. Nothing was delivered, so
+            // it's safe to redo them one by one.
+            rc = first ? 1 : -1;
             break;
         }
-        
-        req->bytesreceived += (size_t)r;
-        
-        if (req->writefunc) {
-            req->writefunc(databuf, (size_t)r, req->writearg);
-        }
-        
-        // Stop when we've received all the bytes
-        if (req->bytesreceived >= req->filelen) {
+
+        // Plain response - this server doesn't multiplex
+        if (first && r >= 4 && memcmp(databuf, "GETF", 4) == 0) {
+            rc = 1;
             break;
         }
+        first = 0;
+
+        char *p = databuf;
+        size_t left = (size_t)r;
+        while (left > 0 && rc == 0) {
+            if (fhave < sizeof(fhdr)) {
+                size_t n = sizeof(fhdr) - fhave < left ? sizeof(fhdr) - fhave : left;
+                memcpy(fhdr + fhave, p, n);
+                fhave += n;
+                p += n;
+                left -= n;
+                if (fhave < sizeof(fhdr)) {
+                    break;
+                }
+
+                uint32_t sid, len;
+                memcpy(&sid, fhdr, 4);
+                memcpy(&len, fhdr + 4, 4);
+                sid = ntohl(sid);
+                cur_left = ntohl(len);
+
+                if (sid == 0 || sid > count || streams[sid - 1].done) {
+                    rc = -1;  // not one of ours
+                    break;
+                }
+                cur = sid - 1;
+                if (cur_left == 0) {
+                    // Empty frame - nothing to deliver, but it still ends a header
+                    fhave = 0;
+                    if (mux_deliver(gfrs[cur], &streams[cur], p, 0, 1) < 0) {
+                        rc = -1;
+                    } else if (streams[cur].done) {
+                        pending--;
+                    }
+                }
+                continue;
+            }
+
+            size_t n = cur_left < left ? cur_left : left;
+            cur_left -= n;
+            if (mux_deliver(gfrs[cur], &streams[cur], p, n, cur_left == 0) < 0) {
+                rc = -1;
+                break;
+            }
+            p += n;
+            left -= n;
+
+            if (cur_left == 0) {
+                fhave = 0;
+                if (streams[cur].done) {
+                    pending--;
+                }
+            }
+        }
     }
-    
+
+    free(streams);
     close(sockfd);
+
+    if (rc == 1) {
+        // Fall back to one request per exchange
+        for (size_t i = 0; i < count; i++) {
+            if (gfc_perform(&gfrs[i]) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (gfrs[i]->status != GF_OK) {
+            gfrs[i]->bytesreceived = 0;
+        }
+    }
     return 0;
 }
 
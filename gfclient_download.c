@@ -8,10 +8,13 @@
 
 #include "gfclient-student.h"
 #include "workload.h"
-#include "steque.h"
+#include "mpmc.h"
 
 #define MAX_THREADS 1024
 #define PATH_BUFFER_SIZE 512
+#define MAX_STREAMS 128
+#define JOB_QUEUE_SIZE 1024  // jobs queued ahead of the workers, main waits when it's full
+#define MAX_RESUMES 3  // times a broken download is picked up again before giving up
 
 // Usage message
 #define USAGE                                                             \
@@ -23,7 +26,9 @@
   "  -p [server_port]    Server port (Default: 56726)\n"                  \
   "  -w [workload_path]  Path to workload file (Default: workload.txt)\n" \
   "  -t [nthreads]       Number of threads (Default 8 Max: 1024)\n"       \
-  "  -n [num_requests]   Request download total (Default: 16)\n"
+  "  -n [num_requests]   Request download total (Default: 16)\n"          \
+  "  -m [nstreams]       Requests multiplexed per connection (Default: 1)\n" \
+  "  -z                  Ask for compressed transfers\n"
 
 static struct option gLongOptions[] = {
     {"nrequests", required_argument, NULL, 'n'},
@@ -32,6 +37,8 @@ static struct option gLongOptions[] = {
     {"server", required_argument, NULL, 's'},
     {"help", no_argument, NULL, 'h'},
     {"workload", required_argument, NULL, 'w'},
+    {"streams", required_argument, NULL, 'm'},
+    {"deflate", no_argument, NULL, 'z'},
     {NULL, 0, NULL, 0}
 };
 
@@ -95,9 +102,22 @@ typedef struct {
 
 // Shared queue and synch work
 
-static steque_t job_queue;
-static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static mpmc_t *job_queue;
+
+// Requests each worker multiplexes over one connection
+static int nstreams = 1;
+
+// Offer to take bodies compressed
+static int use_deflate = 0;
+
+// From gfclient.c - several requests over one framed connection
+extern int gfc_perform_multi(gfcrequest_t **gfrs, size_t count);
+
+// From gfclient.c - byte-range requests
+extern void gfc_set_range(gfcrequest_t **gfr, size_t offset, size_t len);
+
+// From gfclient.c - compressed transfers
+extern void gfc_set_deflate(gfcrequest_t **gfr, int enabled);
 
 // Progress tracking variables
 static int total_requests = 0;
@@ -106,65 +126,113 @@ static pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Worker thread
 
-static void* worker(void *arg) {
-  (void)arg;  // Not using this parameter
+// Start the download for one job - opens the local file and sets up the request
+static gfcrequest_t *start_job(job_t *job, FILE **file) {
+  *file = openFile(job->local_path);
 
-  while (1) {
-    // Lock the queue to check for jobs
-    pthread_mutex_lock(&job_mutex);
+  // Setup GFC request
+  gfcrequest_t *gfr = gfc_create();
+  gfc_set_path(&gfr, job->req_path);
+  gfc_set_server(&gfr, job->server);
+  gfc_set_port(&gfr, job->port);
+  gfc_set_writefunc(&gfr, writecb);
+  gfc_set_writearg(&gfr, *file);
+  gfc_set_deflate(&gfr, use_deflate);
 
-    // Wait until there's something in the queue
-    while (steque_isempty(&job_queue)) {
-      pthread_cond_wait(&job_cond, &job_mutex);
+  fprintf(stdout, "Requesting %s%s\n", job->server, job->req_path);
+
+  return gfr;
+}
+
+// The transfer broke off. A request that never got its header is just asked
+// again. One that broke off part way through the body asks for the rest - what
+// we got is already in the file, so it keeps appending. A status the server
+// did send (FILE_NOT_FOUND, ERROR) stands, the connection only went after it.
+static int resume_job(job_t *job, gfcrequest_t **gfr) {
+  size_t offset = 0;
+
+  for (int tries = 0; tries < MAX_RESUMES; tries++) {
+    gfstatus_t status = gfc_get_status(gfr);
+    if (status == GF_FILE_NOT_FOUND || status == GF_ERROR) {
+      return 0;
     }
 
-    // Pop a job from the queue
-    job_t *job = (job_t*) steque_front(&job_queue);
-    steque_pop(&job_queue);
+    if (status == GF_OK) {
+      if (gfc_get_bytesreceived(gfr) == gfc_get_filelen(gfr)) {
+        return 0;  // this one was complete before the connection went
+      }
+      offset += gfc_get_bytesreceived(gfr);
+      fprintf(stdout, "Resuming %s%s at byte %zu\n", job->server, job->req_path, offset);
+      gfc_set_range(gfr, offset, 0);
+    } else {
+      fprintf(stdout, "Retrying %s%s\n", job->server, job->req_path);
+    }
 
-    pthread_mutex_unlock(&job_mutex);
+    if (gfc_perform(gfr) == 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
 
-    // Do the work for this job
-    FILE *file = openFile(job->local_path);
+// Wrap up one job once its request has been performed
+static void finish_job(job_t *job, gfcrequest_t *gfr, FILE *file, int rc) {
+  if (rc < 0) {
+    fprintf(stdout, "gfc_perform returned error %d\n", rc);
+    fclose(file);
+    unlink(job->local_path);  // Remove incomplete file
+  } else {
+    fclose(file);
+  }
 
-    // Setup GFC request
-    gfcrequest_t *gfr = gfc_create();
-    gfc_set_path(&gfr, job->req_path);
-    gfc_set_server(&gfr, job->server);
-    gfc_set_port(&gfr, job->port);
-    gfc_set_writefunc(&gfr, writecb);
-    gfc_set_writearg(&gfr, file);
+  // Check status and clean up failed downloads
+  if (gfc_get_status(&gfr) != GF_OK) {
+    unlink(job->local_path);
+  }
 
-    fprintf(stdout, "Requesting %s%s\n", job->server, job->req_path);
+  // Output stats about the download
+  fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(&gfr)));
+  fprintf(stdout, "Received %zu of %zu bytes\n",
+          gfc_get_bytesreceived(&gfr),
+          gfc_get_filelen(&gfr));
 
-    // Actually perform the download
-    int rc = gfc_perform(&gfr);
+  gfc_cleanup(&gfr);
+  free(job);
+}
 
-    if (rc < 0) {
-      fprintf(stdout, "gfc_perform returned error %d\n", rc);
-      fclose(file);
-      unlink(job->local_path);  // Remove incomplete file
-    } else {
-      fclose(file);
+static void* worker(void *arg) {
+  (void)arg;  // Not using this parameter
+
+  job_t *jobs[MAX_STREAMS];
+  FILE *files[MAX_STREAMS];
+  gfcrequest_t *gfrs[MAX_STREAMS];
+
+  while (1) {
+    // Wait until there's something in the queue
+    int count = 0;
+    jobs[count++] = (job_t*) mpmc_pop(job_queue);
+
+    // Then take as many more as are ready, up to what we multiplex onto one connection
+    while (count < nstreams && (jobs[count] = (job_t*) mpmc_try_pop(job_queue))) {
+      count++;
     }
 
-    // Check status and clean up failed downloads
-    if (gfc_get_status(&gfr) != GF_OK) {
-      unlink(job->local_path);
+    // Do the work for these jobs
+    for (int i = 0; i < count; i++) {
+      gfrs[i] = start_job(jobs[i], &files[i]);
     }
 
-    // Output stats about the download
-    fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(&gfr)));
-    fprintf(stdout, "Received %zu of %zu bytes\n",
-            gfc_get_bytesreceived(&gfr),
-            gfc_get_filelen(&gfr));
+    // Actually perform the download
+    int rc = count == 1 ? gfc_perform(&gfrs[0]) : gfc_perform_multi(gfrs, (size_t)count);
 
-    gfc_cleanup(&gfr);
-    free(job);
+    for (int i = 0; i < count; i++) {
+      int job_rc = rc < 0 ? resume_job(jobs[i], &gfrs[i]) : rc;
+      finish_job(jobs[i], gfrs[i], files[i], job_rc);
+    }
 
-    // Count this completed request
+    // Count these completed requests
     pthread_mutex_lock(&count_mutex);
-    completed_requests++;
+    completed_requests += count;
     pthread_mutex_unlock(&count_mutex);
   }
 
@@ -186,7 +254,7 @@ int main(int argc, char **argv) {
   setbuf(stdout, NULL);  // Turn off stdout buffering
 
   // Parse command line options
-  while ((option_char = getopt_long(argc, argv, "p:n:hs:t:r:w:", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "p:n:hs:t:r:w:m:z", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 's':
         server = optarg;
@@ -204,6 +272,12 @@ int main(int argc, char **argv) {
       case 'p':
         port = atoi(optarg);
         break;
+      case 'm':
+        nstreams = atoi(optarg);
+        break;
+      case 'z':
+        use_deflate = 1;
+        break;
       case 'h':
         Usage();
         exit(0);
@@ -225,10 +299,20 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  // Validate stream count
+  if (nstreams < 1 || nstreams > MAX_STREAMS) {
+    fprintf(stderr, "Invalid number of streams\n");
+    exit(EXIT_FAILURE);
+  }
+
   gfc_global_init();
 
   // Initialize the job queue
-  steque_init(&job_queue);
+  job_queue = mpmc_create(JOB_QUEUE_SIZE);
+  if (!job_queue) {
+    fprintf(stderr, "Unable to create the job queue.\n");
+    exit(EXIT_FAILURE);
+  }
 
   // Spawn worker threads
   pthread_t tid;
@@ -254,11 +338,8 @@ int main(int argc, char **argv) {
 
     localPath(req_path, job->local_path);
 
-    // Enqueue the job
-    pthread_mutex_lock(&job_mutex);
-    steque_enqueue(&job_queue, job);
-    pthread_cond_signal(&job_cond);  // Signal a waiting worker
-    pthread_mutex_unlock(&job_mutex);
+    // Enqueue the job - wakes a sleeping worker, waits if they're far behind
+    mpmc_push(job_queue, job);
 
     // Count this request
     pthread_mutex_lock(&count_mutex);
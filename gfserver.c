@@ -1,17 +1,202 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include "gfserver-student.h"
+#include "gfuring.h"
+#include "objpool.h"
+#include "timerwheel.h"
+#include "affinity.h"
+#include "stats.h"
+#include "trace.h"
 
 #define BUF_SIZE 4096
+#define MAX_EVENTS 256
+#define MAX_TOKENS 8
+#define PATH_SIZE 256
+#define MAX_LISTENERS 256
+#define DEFAULT_IDLE_TIMEOUT 10    // seconds a kept-alive connection may sit between requests
+#define DEFAULT_HEADER_TIMEOUT 10  // seconds to get a whole request header in
+#define DEFAULT_SEND_TIMEOUT 30    // seconds a send may go without any progress
+#define TIMER_TICK_MS 100          // timer wheel granularity - deadlines fire within a tick of due
 
-// Context structure - holds client connection info
-struct gfcontext_t {
+// Multiplexed connections
+#define MUX_FRAME_MAX (16 * 1024)  // biggest payload per frame, so streams take turns on the socket
+#define MUX_MAX_STREAMS 128        // streams in flight per connection before we start refusing
+
+// io_uring engine sizing
+#define URING_ENTRIES 256
+#define URING_ACCEPTS 16      // accepts kept in flight on the listener
+#define URING_SEND_BUFS 4     // registered buffers per sending thread
+#define URING_SEND_BUFSIZE (64 * 1024)
+
+// Zero-copy sends
+#define ZC_CHUNK (1024 * 1024)  // max bytes per sendfile/splice call
+
+// OK headers are held back and go out in the same write as the start of the body
+#define HDR_PENDING_SIZE 128
+#define COALESCE_MAX (16 * 1024)  // bodies up to this size go out in one writev with the header
+
+// Connections and contexts come from pools, carved this many at a time
+#define POOL_SLAB 256
+
+// Writer threads - bodies for slow clients are streamed from here instead of a worker
+#define DEFAULT_WRITERS 1
+#define MAX_WRITERS 64
+#define WRITER_BUDGET (256 * 1024)  // bytes per socket per turn, so one fast client can't hog a writer
+
+// Parser states
+enum {
+    PARSE_SPACE,  // between tokens on the request line
+    PARSE_TOKEN,  // inside a request line token
+    PARSE_TAIL,   // past the request line, just looking for the blank line
+    PARSE_DONE,
+    PARSE_BAD
+};
+
+// What a parked connection's timer is counting down to
+enum {
+    DEADLINE_NONE,
+    DEADLINE_HEADER,  // request header has to be complete by then
+    DEADLINE_IDLE     // kept-alive connection has to start its next request by then
+};
+
+// Incremental request parser - fed by large reads and resumable between them.
+// Every byte is looked at exactly once, and anything read past the end of the
+// header stays in buf for whoever wants it next.
+typedef struct {
+    char buf[BUF_SIZE];
+    size_t len;         // bytes currently in buf
+    size_t pos;         // next byte to scan
+    int state;
+    int marker;         // how much of "\r\n\r\n" we've matched so far
+
+    // request line tokens, as offsets into buf
+    size_t tok_start[MAX_TOKENS];
+    size_t tok_len[MAX_TOKENS];
+    int ntok;
+} gfparser_t;
+
+typedef struct gfloop_t gfloop_t;
+typedef struct gfconn_t gfconn_t;
+typedef struct gfwriter_t gfwriter_t;
+
+// Connection structure - one per client socket. Outlives individual requests
+// when the client keeps the connection alive or multiplexes streams over it.
+struct gfconn_t {
     int clientfd;  // socket file descriptor for this client
+    gfserver_t *srv;  // server this connection came in on
+    gfparser_t parser;  // request header as it comes in
+
+    gfloop_t *loop;  // event loop that owns the connection between requests, NULL if none
+    int refs;  // the loop while it owns the connection, plus one per live request
+    int mux;  // framed mode - stays in the loop reading requests while streams are answered
+    pthread_mutex_t wlock;  // mux: one frame on the socket at a time
+
+    // link for the loop's return list
+    gfconn_t *next;
+
+    // header-read or idle deadline while parked in a loop (loop thread only)
+    tw_timer_t timer;
+    int deadline;
+
+    uint64_t hdr_start_ns;  // current request header started arriving, 0 if it hasn't yet
+};
+
+// Context structure - one per request, this is what the handler gets
+struct gfcontext_t {
+    gfconn_t *conn;
+    uint32_t stream;  // mux stream id the response goes out on
+    int keepalive;  // client asked for it and we agreed
+    int header_sent;
+    uint64_t start_ns;  // request header complete - first byte and transfer times count from here
+    uint64_t trace_id;  // 0 with tracing off
+    size_t resp_len;    // body length the header promised
+    size_t resp_left;  // body bytes still owed for the current response
+
+    // byte range the client asked for, if any
+    int range;
+    size_t range_off;
+    size_t range_len;
+    int deflate;  // client takes zlib-compressed bodies
+
+    // OK header waiting to ride along with the first body bytes
+    char pending[HDR_PENDING_SIZE];
+    size_t pending_len;
+    size_t pending_off;  // how much of it a writer has sent so far
+
+    // body handed off to a writer thread (writer thread only once it's there)
+    int body_fd;
+    const char *body_buf;  // in-memory body instead of body_fd, indexed by body_off
+    void (*body_release)(void *);  // called with body_arg once body_buf is done with
+    void *body_arg;
+    off_t body_off;
+    size_t body_left;
+    size_t body_total;
+    gfwriter_t *writer;
+    gfcontext_t *next;  // link for the writer's hand-off list
+    tw_timer_t timer;   // send deadline while the writer has it
+};
+
+// Frame header on multiplexed connections: stream id, then payload length (both big-endian)
+typedef struct {
+    uint32_t stream;
+    uint32_t len;
+} gfframe_t;
+
+// Parsed request line
+typedef struct {
+    char path[PATH_SIZE];
+    int keepalive;
+    int stream;  // request carried a STREAM id
+    uint32_t stream_id;
+    int range;  // request carried RANGE <offset> <len>
+    uint64_t range_off;
+    uint64_t range_len;
+    int deflate;  // request carried DEFLATE
+} gfrequest_t;
+
+// Per-thread epoll loop state
+struct gfloop_t {
+    int epfd;
+    int evfd;  // workers poke this when they hand a connection back
+
+    pthread_mutex_t lock;
+    gfconn_t *returned;  // connections handed back by workers (protected by lock)
+
+    // deadlines for parked connections (loop thread only)
+    timerwheel_t wheel;
+};
+
+// Writer thread state - its own epoll set of sockets waiting for EPOLLOUT
+struct gfwriter_t {
+    gfserver_t *srv;
+    int epfd;
+    int evfd;  // workers poke this when they hand a body over
+
+    pthread_mutex_t lock;
+    gfcontext_t *incoming;  // handed over by workers (protected by lock)
+
+    // send deadlines (writer thread only)
+    timerwheel_t wheel;
 };
 
 // Server structure - holds all the server configuration
@@ -20,13 +205,73 @@ struct gfserver_t {
     int backlog;  // max pending connections in listen queue
     gfh_error_t (*handler)(gfcontext_t **, const char *, void *);
     void *arg;  // argument to pass to handler
+    int use_epoll;  // non-zero to run the epoll acceptor/reader instead of blocking accept
+    int nlisteners;  // SO_REUSEPORT listening sockets, each with its own accept loop
+    int use_uring;  // try the io_uring engine first, falls back if the kernel says no
+    int idle_timeout;  // seconds, 0 turns keep-alive off
+    int header_timeout;  // seconds to finish sending a request header, 0 for no limit
+    int send_timeout;  // seconds a response send may stall, 0 for no limit
+    int nwriters;  // threads streaming bodies to slow clients, 0 to send from the workers
+    cpulist_t acceptor_cpus;  // listener i (and writer i) runs on cpus[i % n], empty for the defaults
+
+    gfwriter_t *writers;
+    unsigned next_writer;  // round-robin for hand-offs
+
+    // recycled gfconn_t / gfcontext_t so the request path doesn't hit malloc
+    objpool_t *conn_pool;
+    objpool_t *ctx_pool;
 };
 
+// One accept loop and the socket it owns
+typedef struct {
+    gfserver_t *srv;
+    int listenfd;
+    int cpu;  // core to pin the loop to, -1 to leave it floating
+} listener_t;
+
+static int set_nonblocking(int fd, int enabled) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+// How long a send to the connection may stall, in ms for poll - -1 for no limit.
+// Blocking sends get the same limit from SO_SNDTIMEO on the socket.
+static int send_timeout_ms(const gfconn_t *conn) {
+    return conn->srv->send_timeout > 0 ? conn->srv->send_timeout * 1000 : -1;
+}
+
+// Wait for room in the send buffer - mux sockets are non-blocking since the loop reads them
+static int wait_writable(int fd, int timeout_ms) {
+    // EAGAIN on a blocking socket means SO_SNDTIMEO already ran out
+    if (errno == EAGAIN && !(fcntl(fd, F_GETFL, 0) & O_NONBLOCK)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc == 0) {
+        errno = ETIMEDOUT;  // client stopped reading
+        return -1;
+    }
+    return rc < 0 && errno != EINTR ? -1 : 0;
+}
+
 // Helper function to make sure we send all the data
-static int send_all(int fd, const void *buf, size_t len) {
+static int send_all_flags(int fd, const void *buf, size_t len, int flags, int timeout_ms) {
     const char *p = buf;
     while (len > 0) {
-        ssize_t sent = send(fd, p, len, 0);
+        ssize_t sent = send(fd, p, len, MSG_NOSIGNAL | flags);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (wait_writable(fd, timeout_ms) < 0) {
+                return -1;
+            }
+            continue;
+        }
         if (sent <= 0) {
             return -1;  // connection error
         }
@@ -36,6 +281,120 @@ static int send_all(int fd, const void *buf, size_t len) {
     return 0;
 }
 
+static int send_all(int fd, const void *buf, size_t len, int timeout_ms) {
+    return send_all_flags(fd, buf, len, 0, timeout_ms);
+}
+
+// Same as send_all for a header + payload pair
+static int send_all2(int fd, const void *a, size_t alen, const void *b, size_t blen, int timeout_ms) {
+    struct iovec iov[2] = { { (void *)a, alen }, { (void *)b, blen } };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+
+    while (iov[0].iov_len + iov[1].iov_len > 0) {
+        msg.msg_iov = iov[0].iov_len ? iov : iov + 1;
+        msg.msg_iovlen = iov[0].iov_len ? 2 : 1;
+
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (wait_writable(fd, timeout_ms) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+
+        for (int i = 0; i < 2 && sent > 0; i++) {
+            size_t n = (size_t)sent < iov[i].iov_len ? (size_t)sent : iov[i].iov_len;
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+            sent -= n;
+        }
+    }
+    return 0;
+}
+
+static void parser_reset(gfparser_t *p) {
+    p->len = 0;
+    p->pos = 0;
+    p->state = PARSE_SPACE;
+    p->marker = 0;
+    p->ntok = 0;
+}
+
+// Scan whatever arrived since last time. Returns PARSE_DONE once the blank
+// line is seen, PARSE_BAD on garbage, and anything else means "need more".
+static int parser_feed(gfparser_t *p) {
+    while (p->pos < p->len && p->state != PARSE_DONE && p->state != PARSE_BAD) {
+        char c = p->buf[p->pos];
+
+        // Track the end marker across reads
+        if (c == '\r') {
+            p->marker = (p->marker == 2) ? 3 : 1;
+        } else if (c == '\n') {
+            p->marker = (p->marker == 1 || p->marker == 3) ? p->marker + 1 : 0;
+        } else {
+            p->marker = 0;
+        }
+
+        switch (p->state) {
+            case PARSE_SPACE:
+                if (c == '\r' || c == '\n') {
+                    p->state = PARSE_TAIL;
+                } else if (c != ' ') {
+                    if (p->ntok == MAX_TOKENS) {
+                        p->state = PARSE_BAD;
+                        break;
+                    }
+                    p->tok_start[p->ntok] = p->pos;
+                    p->tok_len[p->ntok] = 1;
+                    p->ntok++;
+                    p->state = PARSE_TOKEN;
+                }
+                break;
+            case PARSE_TOKEN:
+                if (c == ' ') {
+                    p->state = PARSE_SPACE;
+                } else if (c == '\r' || c == '\n') {
+                    p->state = PARSE_TAIL;
+                } else {
+                    p->tok_len[p->ntok - 1]++;
+                }
+                break;
+            default:
+                break;
+        }
+
+        p->pos++;
+
+        if (p->marker == 4) {
+            p->state = PARSE_DONE;
+        }
+    }
+
+    // Out of room and still no end marker
+    if (p->state != PARSE_DONE && p->len == sizeof(p->buf)) {
+        p->state = PARSE_BAD;
+    }
+    return p->state;
+}
+
+// Compare a request line token against a literal
+static int token_is(const gfparser_t *p, int i, const char *s) {
+    size_t n = strlen(s);
+    return i < p->ntok && p->tok_len[i] == n && memcmp(p->buf + p->tok_start[i], s, n) == 0;
+}
+
+// Pull any bytes read past the header (the next request) to the front and start over
+static void parser_next(gfparser_t *p) {
+    size_t extra = p->len - p->pos;
+    memmove(p->buf, p->buf + p->pos, extra);
+    parser_reset(p);
+    p->len = extra;
+}
+
 // Convert status code to string for protocol
 static const char *get_status_str(gfstatus_t status) {
     if (status == GF_OK) {
@@ -50,15 +409,145 @@ static const char *get_status_str(gfstatus_t status) {
     return "INVALID";  
 }
 
-// Abort a connection - close socket and free context
+// Which response counter a status goes under
+static stat_counter_t status_counter(gfstatus_t status) {
+    if (status == GF_OK) {
+        return STAT_STATUS_OK;
+    }
+    if (status == GF_FILE_NOT_FOUND) {
+        return STAT_STATUS_FILE_NOT_FOUND;
+    }
+    if (status == GF_ERROR) {
+        return STAT_STATUS_ERROR;
+    }
+    return STAT_STATUS_INVALID;
+}
+
+static void loop_return(gfloop_t *loop, gfconn_t *conn);
+
+static void conn_ref(gfconn_t *conn) {
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference - the last one closes the socket
+static void conn_unref(gfconn_t *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(conn->clientfd);
+        pthread_mutex_destroy(&conn->wlock);
+        objpool_put(conn->srv->conn_pool, conn);
+    }
+}
+
+// Send one mux frame. The lock keeps frames from different streams whole.
+static int conn_send_frame(gfconn_t *conn, uint32_t stream, const void *data, size_t len) {
+    gfframe_t frame = { htonl(stream), htonl((uint32_t)len) };
+
+    pthread_mutex_lock(&conn->wlock);
+    int rc = send_all2(conn->clientfd, &frame, sizeof(frame), data, len, send_timeout_ms(conn));
+    pthread_mutex_unlock(&conn->wlock);
+    return rc;
+}
+
+// Turn a stream down from the loop thread, which can't wait on any one client.
+// The frame goes out whole right away or the connection is dropped - a client
+// this far over the stream limit that isn't reading doesn't get to stall the
+// loop, and half a frame would leave it out of sync anyway.
+static void conn_refuse_stream(gfconn_t *conn, uint32_t stream) {
+    static const char hdr[] = "GETFILE ERROR\r\n\r\n";
+    gfframe_t frame = { htonl(stream), htonl(sizeof(hdr) - 1) };
+    struct iovec iov[2] = { { &frame, sizeof(frame) }, { (void *)hdr, sizeof(hdr) - 1 } };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    // A worker holding the lock may be waiting on the client itself
+    if (pthread_mutex_trylock(&conn->wlock) != 0) {
+        shutdown(conn->clientfd, SHUT_RDWR);
+        return;
+    }
+    ssize_t sent = sendmsg(conn->clientfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent != (ssize_t)(sizeof(frame) + sizeof(hdr) - 1)) {
+        shutdown(conn->clientfd, SHUT_RDWR);  // before anyone else gets a frame in
+    }
+    pthread_mutex_unlock(&conn->wlock);
+}
+
+// Write response bytes for a request - framed and chopped up on mux connections.
+// A held-back header goes out in the same write.
+static int ctx_write(gfcontext_t *ctx, const void *data, size_t len) {
+    gfconn_t *conn = ctx->conn;
+    if (!conn->mux) {
+        size_t hlen = ctx->pending_len;
+        ctx->pending_len = 0;
+        int timeout_ms = send_timeout_ms(conn);
+        return hlen ? send_all2(conn->clientfd, ctx->pending, hlen, data, len, timeout_ms)
+                    : send_all(conn->clientfd, data, len, timeout_ms);
+    }
+
+    const char *p = data;
+    do {
+        size_t chunk = len > MUX_FRAME_MAX ? MUX_FRAME_MAX : len;
+        if (conn_send_frame(conn, ctx->stream, p, chunk) < 0) {
+            return -1;
+        }
+        p += chunk;
+        len -= chunk;
+    } while (len > 0);
+    return 0;
+}
+
+// Abort a request - on a plain connection that closes the socket. A mux
+// connection is shared, so a stream that never started just gets an error,
+// and a half-sent one takes the connection down (the client can't resync).
 void gfs_abort(gfcontext_t **ctx) {
     if (!ctx || !*ctx) {
         return;  // already cleaned up or NULL
     }
     
-    close((*ctx)->clientfd);
-    free(*ctx);
+    gfconn_t *conn = (*ctx)->conn;
+    trace_record(TRACE_ABORT, (*ctx)->trace_id, 0);
+    if (conn->mux) {
+        if (!(*ctx)->header_sent) {
+            static const char hdr[] = "GETFILE ERROR\r\n\r\n";
+            conn_send_frame(conn, (*ctx)->stream, hdr, sizeof(hdr) - 1);
+        } else {
+            shutdown(conn->clientfd, SHUT_RDWR);
+        }
+    }
+
+    objpool_put(conn->srv->ctx_pool, *ctx);
+    *ctx = NULL;
+    conn_unref(conn);
+}
+
+// The whole response is out - hand the connection back for the next request,
+// or let it go if it isn't being kept alive
+static void finish_response(gfcontext_t **ctx) {
+    gfconn_t *conn = (*ctx)->conn;
+    int keepalive = (*ctx)->keepalive;
+    uint64_t now = stats_now();
+    stats_record(STAT_TRANSFER, now - (*ctx)->start_ns);
+    trace_record_at(TRACE_LAST_BYTE, (*ctx)->trace_id, (*ctx)->resp_len, now);
+
+    objpool_put(conn->srv->ctx_pool, *ctx);
     *ctx = NULL;
+
+    if (keepalive) {
+        loop_return(conn->loop, conn);  // our reference goes with it
+    } else {
+        conn_unref(conn);
+    }
+}
+
+// Account for body bytes sent and finish the response once nothing is owed
+static void sent_body(gfcontext_t **ctx, size_t len) {
+    gfcontext_t *c = *ctx;
+    stats_add(STAT_BYTES_SENT, len);
+    c->resp_left = len < c->resp_left ? c->resp_left - len : 0;
+    if (c->resp_left == 0) {
+        finish_response(ctx);
+    }
 }
 
 // Send data to client
@@ -67,15 +556,18 @@ ssize_t gfs_send(gfcontext_t **ctx, const void *data, size_t len) {
         return -1;
     }
     
-    if (send_all((*ctx)->clientfd, data, len) < 0) {
+    if (ctx_write(*ctx, data, len) < 0) {
+        gfs_abort(ctx);  // connection is broken, nothing more to do with it
         return -1;
     }
     
+    sent_body(ctx, len);
     return (ssize_t)len;
 }
 
 // Send the response header
-ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len) {
+// Build and send a response header - extra goes after the length on OK responses
+static ssize_t send_header(gfcontext_t **ctx, gfstatus_t status, size_t file_len, const char *extra) {
     if (!ctx || !*ctx) {
         return -1;
     }
@@ -83,152 +575,1537 @@ ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len) {
     char buf[BUF_SIZE];
     int len;
 
+    // Never keep a connection that sent us garbage
+    if (status == GF_INVALID) {
+        (*ctx)->keepalive = 0;
+    }
+    const char *keep = (*ctx)->keepalive ? " KEEPALIVE" : "";
+
     // For OK status, we include the file length
     // For errors, we don't send length
     if (status == GF_OK) {
-        len = snprintf(buf, sizeof(buf), "GETFILE OK %zu\r\n\r\n", file_len);
+        len = snprintf(buf, sizeof(buf), "GETFILE OK %zu%s%s\r\n\r\n", file_len, extra, keep);
+        (*ctx)->resp_left = file_len;
     } else {
-        len = snprintf(buf, sizeof(buf), "GETFILE %s\r\n\r\n", get_status_str(status));
+        len = snprintf(buf, sizeof(buf), "GETFILE %s%s\r\n\r\n", get_status_str(status), keep);
+        (*ctx)->resp_left = 0;
+    }
+
+    // A held-back header goes out with the handler's very next send, so this is its time too
+    (*ctx)->header_sent = 1;
+    (*ctx)->resp_len = (*ctx)->resp_left;
+    uint64_t now = stats_now();
+    stats_record(STAT_FIRST_BYTE, now - (*ctx)->start_ns);
+    stat_counter_t counter = status_counter(status);
+    stats_add(counter, 1);
+    trace_record_at(TRACE_HEADER_SENT, (*ctx)->trace_id, (uint64_t)(counter - STAT_STATUS_OK), now);
+    if (len <= 0) {
+        gfs_abort(ctx);
+        return -1;
+    }
+
+    // A body is coming - hold the header so both leave in one segment
+    if ((*ctx)->resp_left > 0 && !(*ctx)->conn->mux && (size_t)len <= sizeof((*ctx)->pending)) {
+        memcpy((*ctx)->pending, buf, len);
+        (*ctx)->pending_len = len;
+        return (ssize_t)len;
     }
 
-    if (len <= 0 || send_all((*ctx)->clientfd, buf, len) < 0) {
+    if (ctx_write(*ctx, buf, len) < 0) {
+        gfs_abort(ctx);
         return -1;
     }
+
+    // No body to follow - the response is already complete
+    if ((*ctx)->resp_left == 0) {
+        finish_response(ctx);
+    }
     
     return (ssize_t)len;
 }
 
-// Create a new server instance
-gfserver_t *gfserver_create() {
-    gfserver_t *srv = malloc(sizeof(gfserver_t));
-    if (srv) {
-        memset(srv, 0, sizeof(gfserver_t));
-        srv->backlog = 5;  // default backlog
-    }
-    return srv;
+ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len) {
+    return send_header(ctx, status, file_len, "");
 }
 
-// Set the port number for the server
-void gfserver_set_port(gfserver_t **gfs, unsigned short port) {
-    if (gfs && *gfs) {
-        (*gfs)->port = port;
-    }
+// Trace id of the request, for stamps the handler makes - 0 when not tracing
+uint64_t gfs_trace_id(gfcontext_t **ctx) {
+    return ctx && *ctx ? (*ctx)->trace_id : 0;
 }
 
-// Set the handler argument 
-void gfserver_set_handlerarg(gfserver_t **gfs, void *arg) {
-    if (gfs && *gfs) {
-        (*gfs)->arg = arg;
+// Did the client ask for part of the file? Returns 1 and fills in offset/len
+// (len 0 means up to the end) if so, 0 for a whole-file request.
+int gfs_get_range(gfcontext_t **ctx, size_t *offset, size_t *len) {
+    if (!ctx || !*ctx || !(*ctx)->range) {
+        return 0;
     }
+    *offset = (*ctx)->range_off;
+    *len = (*ctx)->range_len;
+    return 1;
 }
 
-// Set the request handler callback
-void gfserver_set_handler(gfserver_t **gfs, gfh_error_t (*handler)(gfcontext_t **, const char *, void *)) {
-    if (gfs && *gfs) {
-        (*gfs)->handler = handler;
-    }
+// OK header for a slice of a file: the length is the slice, and the header
+// also says where it starts and how big the whole file is
+ssize_t gfs_sendheader_range(gfcontext_t **ctx, size_t offset, size_t len, size_t total) {
+    char extra[64];
+    snprintf(extra, sizeof(extra), " RANGE %zu %zu", offset, total);
+    return send_header(ctx, GF_OK, len, extra);
 }
 
-// Set max pending connections
-void gfserver_set_maxpending(gfserver_t **gfs, int n_pending) {
-    if (gfs && *gfs) {
-        (*gfs)->backlog = n_pending;
-    }
+// Did the client say it can take a zlib-compressed body?
+int gfs_accepts_deflate(gfcontext_t **ctx) {
+    return ctx && *ctx && (*ctx)->deflate;
 }
 
-// Main server loop 
-void gfserver_serve(gfserver_t **gfs) {
-    if (!gfs || !*gfs) {
-        return;
+// OK header for a compressed body: the length is what goes over the wire,
+// and the header also carries the size it inflates back to
+ssize_t gfs_sendheader_deflate(gfcontext_t **ctx, size_t encoded_len, size_t original_len) {
+    char extra[64];
+    snprintf(extra, sizeof(extra), " DEFLATE %zu", original_len);
+    return send_header(ctx, GF_OK, encoded_len, extra);
+}
+
+// Per-thread ring for sending file bodies, set up on first use
+typedef struct {
+    int state;  // 0 = not tried yet, 1 = ready, -1 = unavailable
+    gfuring_t ring;
+    char *bufs[URING_SEND_BUFS];
+} send_ring_t;
+
+static __thread send_ring_t send_ring;
+
+static gfuring_t *get_send_ring() {
+    send_ring_t *sr = &send_ring;
+    if (sr->state != 0) {
+        return sr->state > 0 ? &sr->ring : NULL;
     }
-    
-    gfserver_t *srv = *gfs;
 
-    // Create listening socket
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenfd < 0) {
-        perror("socket");
-        exit(1);
+    sr->state = -1;
+    if (gfuring_init(&sr->ring, URING_ENTRIES) < 0) {
+        return NULL;
     }
 
-    // Set socket option to reuse address 
-    int opt = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // One allocation carved into the registered buffers
+    struct iovec iov[URING_SEND_BUFS];
+    char *mem = malloc((size_t)URING_SEND_BUFS * URING_SEND_BUFSIZE);
+    if (!mem) {
+        gfuring_exit(&sr->ring);
+        return NULL;
+    }
+    for (int i = 0; i < URING_SEND_BUFS; i++) {
+        sr->bufs[i] = mem + (size_t)i * URING_SEND_BUFSIZE;
+        iov[i].iov_base = sr->bufs[i];
+        iov[i].iov_len = URING_SEND_BUFSIZE;
+    }
+    if (gfuring_register_buffers(&sr->ring, iov, URING_SEND_BUFS) < 0) {
+        free(mem);
+        gfuring_exit(&sr->ring);
+        return NULL;
+    }
 
-    // Setup address structure
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;  // listen on all interfaces
-    addr.sin_port = htons(srv->port);
+    sr->state = 1;
+    return &sr->ring;
+}
 
-    // Bind to port
-    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        exit(1);
+// user_data for the batch deadline and its removal - well clear of the chunk indexes
+#define URING_SEND_DEADLINE 0x100
+
+// Push up to URING_SEND_BUFS chunks as one linked chain of read -> send -> read -> send...
+// and submit it with a single syscall. Returns how many bytes made it out in order,
+// or -1 if the socket failed.
+static ssize_t uring_send_batch(gfuring_t *ring, int sockfd, int fd, off_t offset, size_t len,
+                                int timeout_ms) {
+    size_t sizes[URING_SEND_BUFS];
+    int n = 0;
+
+    while (len > 0 && n < URING_SEND_BUFS) {
+        size_t chunk = len > URING_SEND_BUFSIZE ? URING_SEND_BUFSIZE : len;
+        struct io_uring_sqe *rd = gfuring_get_sqe(ring);
+        struct io_uring_sqe *wr = gfuring_get_sqe(ring);
+
+        gfuring_prep_read_fixed(rd, fd, send_ring.bufs[n], chunk, offset, n, (unsigned long long)n << 1);
+        rd->flags |= IOSQE_IO_LINK;
+        // MSG_WAITALL makes a short send fail the link, so nothing after it goes out
+        gfuring_prep_send(wr, sockfd, send_ring.bufs[n], chunk, MSG_NOSIGNAL | MSG_WAITALL,
+                          ((unsigned long long)n << 1) | 1);
+
+        sizes[n++] = chunk;
+        offset += chunk;
+        len -= chunk;
+        if (len > 0 && n < URING_SEND_BUFS) {
+            wr->flags |= IOSQE_IO_LINK;
+        }
     }
 
-    // Start listening
-    listen(listenfd, srv->backlog);
+    // Ring sends don't honour SO_SNDTIMEO, so the batch gets its own deadline
+    struct __kernel_timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL };
+    struct io_uring_sqe *sqe = timeout_ms > 0 ? gfuring_get_sqe(ring) : NULL;
+    if (sqe) {
+        gfuring_prep_timeout(sqe, &ts, URING_SEND_DEADLINE);
+    }
+    int deadline_pending = sqe != NULL;
 
-    // Main accept loop
-    while (1) {
-        int clientfd = accept(listenfd, NULL, NULL);
-        if (clientfd < 0) {
-            continue;  // accept failed, try again
+    // Don't wait on anything here - a stalled client may only ever complete the
+    // first read and the deadline, and the loop below has to see the deadline
+    if (gfuring_submit(ring, 0) < 0) {
+        // The SQEs are already published and may still run - tear the ring down so
+        // nothing lands in the buffers later, and send the rest the plain way
+        gfuring_exit(ring);
+        free(send_ring.bufs[0]);  // the one allocation the buffers were carved from
+        send_ring.state = -1;
+        return 0;
+    }
+
+    // Collect every completion before the buffers can be reused, one at a time
+    int results[2 * URING_SEND_BUFS];
+    for (int i = 0; i < 2 * n; ) {
+        struct io_uring_cqe *cqe;
+        while (!(cqe = gfuring_peek_cqe(ring))) {
+            gfuring_submit(ring, 1);
         }
+        unsigned long long data = cqe->user_data;
+        int res = cqe->res;
+        gfuring_cqe_seen(ring);
 
-        // Create context for this connection
-        gfcontext_t *ctx = malloc(sizeof(gfcontext_t));
-        ctx->clientfd = clientfd;
+        if (data == URING_SEND_DEADLINE) {
+            // Client stopped reading - kill the socket so the stuck sends complete
+            deadline_pending = 0;
+            if (res == -ETIME) {
+                shutdown(sockfd, SHUT_RDWR);
+            }
+            continue;
+        }
+        results[data] = res;
+        i++;
+    }
 
-        // Read the request header
-        char req[BUF_SIZE];
-        ssize_t received = 0;
-        
-        // Read byte by byte until we see the end marker
-        while (received < BUF_SIZE - 1) {
-            ssize_t r = recv(clientfd, req + received, 1, 0);
-            if (r <= 0) {
-                break;  // error or connection closed
+    // Take the deadline back, and wait for it so it can't land in the next batch
+    if (deadline_pending) {
+        sqe = gfuring_get_sqe(ring);
+        gfuring_prep_timeout_remove(sqe, URING_SEND_DEADLINE, URING_SEND_DEADLINE + 1);
+        gfuring_submit(ring, 0);
+        for (int left = 2; left > 0; left--) {
+            struct io_uring_cqe *cqe;
+            while (!(cqe = gfuring_peek_cqe(ring))) {
+                gfuring_submit(ring, 1);
             }
-            received++;
-            req[received] = '\0';
-            
-            // Check if we got the complete header
-            if (strstr(req, "\r\n\r\n")) {
+            gfuring_cqe_seen(ring);
+        }
+    }
+
+    // A short read or send cancels the rest of the chain. Count the whole pairs up to
+    // it, plus whatever the short send got out - those bytes went in order.
+    ssize_t done = 0;
+    int i = 0;
+    for (; i < n; i++) {
+        int rd = results[i << 1];
+        int wr = results[(i << 1) | 1];
+        if (wr < 0 && wr != -ECANCELED) {
+            return -1;  // client is gone
+        }
+        if (rd != (int)sizes[i] || wr != (int)sizes[i]) {
+            done += wr > 0 ? wr : 0;
+            break;
+        }
+        done += wr;
+    }
+
+    // Anything sent after the gap is out of order on the wire, and the stream
+    // can't be repaired by resending - drop the connection instead
+    for (i++; i < n; i++) {
+        if (results[(i << 1) | 1] > 0) {
+            return -1;
+        }
+    }
+    return done;
+}
+
+// Per-thread pipe for splice(), created on first use
+static __thread int zc_pipe[2] = { -1, -1 };
+
+static void zc_pipe_reset() {
+    if (zc_pipe[0] >= 0) {
+        close(zc_pipe[0]);
+        close(zc_pipe[1]);
+    }
+    zc_pipe[0] = zc_pipe[1] = -1;
+}
+
+// sendfile() the whole range. Returns bytes sent - if that's short, errno says why.
+static size_t zc_sendfile(int sockfd, int fd, off_t offset, size_t len, int timeout_ms) {
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = len - done > ZC_CHUNK ? ZC_CHUNK : len - done;
+        ssize_t n = sendfile(sockfd, fd, &offset, chunk);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (wait_writable(sockfd, timeout_ms) < 0) {
                 break;
             }
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;  // file shrank under us
+            }
+            break;
         }
+        done += (size_t)n;
+    }
+    return done;
+}
 
-        // Parse the request line
-        char scheme[16];
-        char method[16];
-        char path[256];
-        int parts = sscanf(req, "%s %s %s", scheme, method, path);
+// file -> pipe -> socket with splice(), for when sendfile() won't take the pair
+static size_t zc_splice(int sockfd, int fd, off_t offset, size_t len, int timeout_ms) {
+    if (zc_pipe[0] < 0 && pipe2(zc_pipe, O_CLOEXEC) < 0) {
+        return 0;
+    }
 
-        // Validate the request format
-        if (parts != 3 || strcmp(scheme, "GETFILE") != 0 || 
-            strcmp(method, "GET") != 0 || path[0] != '/') {
-            
-            // Invalid request
-            gfs_sendheader(&ctx, GF_INVALID, 0);
-            gfs_abort(&ctx);
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = len - done > ZC_CHUNK ? ZC_CHUNK : len - done;
+        ssize_t in = splice(fd, &offset, zc_pipe[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) {
             continue;
         }
+        if (in <= 0) {
+            if (in == 0) {
+                errno = EIO;
+            }
+            break;
+        }
 
-        // Call the handler if we have one
-        if (srv->handler) {
-            srv->handler(&ctx, path, srv->arg);
-            
-            // If handler didn't consume the context, clean it up
-            if (ctx) {
-                gfs_abort(&ctx);
+        // Drain the pipe completely before the next fill
+        while (in > 0) {
+            ssize_t out = splice(zc_pipe[0], NULL, sockfd, NULL, (size_t)in,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                if (wait_writable(sockfd, timeout_ms) < 0) {
+                    zc_pipe_reset();
+                    return done;
+                }
+                continue;
             }
-        } else {
-            gfs_sendheader(&ctx, GF_ERROR, 0);
-            gfs_abort(&ctx);
+            if (out <= 0) {
+                zc_pipe_reset();  // leftovers in the pipe would corrupt the next response
+                errno = EPIPE;
+                return done;
+            }
+            in -= out;
+            done += (size_t)out;
         }
     }
-    
+    return done;
+}
+
+// Get a file range onto the socket - zero-copy if the kernel will do it for
+// this fd pair, otherwise through a buffer. Returns 0 once it's all out.
+static int send_region(int sockfd, int fd, off_t offset, size_t len, int timeout_ms) {
+    size_t done = zc_sendfile(sockfd, fd, offset, len, timeout_ms);
+
+    // sendfile() refuses some sources/destinations outright - try splice, then copy
+    if (done < len && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+        done += zc_splice(sockfd, fd, offset + done, len - done, timeout_ms);
+        if (done < len && !(errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            return -1;
+        }
+    } else if (done < len) {
+        return -1;  // socket error or the file shrank
+    }
+
+    char buf[BUF_SIZE];
+    while (done < len) {
+        size_t chunk = len - done > sizeof(buf) ? sizeof(buf) : len - done;
+        ssize_t bytes = pread(fd, buf, chunk, offset + done);
+        if (bytes <= 0 || send_all(sockfd, buf, (size_t)bytes, timeout_ms) < 0) {
+            return -1;
+        }
+        done += (size_t)bytes;
+    }
+    return 0;
+}
+
+// sendfile() won't take this fd pair - copy a chunk through a buffer instead
+static ssize_t xfer_copy(int sockfd, gfcontext_t *ctx, size_t len) {
+    char buf[COALESCE_MAX];
+    if (len > sizeof(buf)) {
+        len = sizeof(buf);
+    }
+    ssize_t got = pread(ctx->body_fd, buf, len, ctx->body_off);
+    if (got <= 0) {
+        return got;
+    }
+    ssize_t sent = send(sockfd, buf, (size_t)got, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent > 0) {
+        ctx->body_off += sent;  // anything not taken gets read again next time
+    }
+    return sent;
+}
+
+// Push as much of a handed-off response as the (non-blocking) socket takes
+// right now, at most budget body bytes. Returns 1 once it's all out, 0 if the
+// socket is full or the budget ran out, -1 if the transfer failed.
+static int xfer_step(gfcontext_t *ctx, size_t budget) {
+    int sockfd = ctx->conn->clientfd;
+
+    while (ctx->pending_off < ctx->pending_len) {
+        ssize_t n = send(sockfd, ctx->pending + ctx->pending_off, ctx->pending_len - ctx->pending_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT | (ctx->body_left ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        ctx->pending_off += (size_t)n;
+    }
+
+    while (ctx->body_left > 0 && budget > 0) {
+        size_t chunk = ctx->body_left < budget ? ctx->body_left : budget;
+        ssize_t n;
+        if (ctx->body_buf) {
+            n = send(sockfd, ctx->body_buf + ctx->body_off, chunk, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0) {
+                ctx->body_off += n;
+            }
+        } else {
+            n = sendfile(sockfd, ctx->body_fd, &ctx->body_off, chunk);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                n = xfer_copy(sockfd, ctx, chunk);
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;  // file shrank under us
+        }
+        ctx->body_left -= (size_t)n;
+        budget -= (size_t)n;
+    }
+    return ctx->body_left == 0 ? 1 : 0;
+}
+
+// Hand an in-memory body back to whoever lent it
+static void body_done(gfcontext_t *ctx) {
+    if (ctx->body_release) {
+        ctx->body_release(ctx->body_arg);
+        ctx->body_release = NULL;
+    }
+    ctx->body_buf = NULL;
+}
+
+// The writer is done with a transfer one way or the other
+static void writer_finish(gfwriter_t *w, gfcontext_t *ctx, int ok) {
+    timerwheel_cancel(&w->wheel, &ctx->timer);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, ctx->conn->clientfd, NULL);
+    ctx->pending_len = 0;
+    body_done(ctx);
+    if (ok) {
+        sent_body(&ctx, ctx->body_total);
+    } else {
+        gfs_abort(&ctx);
+    }
+}
+
+// Client took nothing for the whole send timeout
+static void writer_expired(tw_timer_t *t, void *arg) {
+    (void)t;
+    gfcontext_t *ctx = arg;
+    writer_finish(ctx->writer, ctx, 0);
+}
+
+// Send what the socket will take and keep the deadline moving while it does
+static void writer_pump(gfwriter_t *w, gfcontext_t *ctx) {
+    size_t before = ctx->body_left + ctx->pending_len - ctx->pending_off;
+    int rc = xfer_step(ctx, WRITER_BUDGET);
+    if (rc != 0) {
+        writer_finish(w, ctx, rc > 0);
+        return;
+    }
+    if (w->srv->send_timeout > 0 && ctx->body_left + ctx->pending_len - ctx->pending_off < before) {
+        timerwheel_arm(&w->wheel, &ctx->timer, (unsigned)w->srv->send_timeout * 1000);
+    }
+}
+
+// Writer thread - level-triggered EPOLLOUT, so a socket that still has room
+// after its budget just comes round again on the next wait
+static void *writer_thread(void *arg) {
+    gfwriter_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timerwheel_timeout(&w->wheel));
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr != w) {
+                writer_pump(w, events[i].data.ptr);
+                continue;
+            }
+
+            uint64_t count;
+            if (read(w->evfd, &count, sizeof(count)) < 0) {
+                // already drained
+            }
+            pthread_mutex_lock(&w->lock);
+            gfcontext_t *ctx = w->incoming;
+            w->incoming = NULL;
+            pthread_mutex_unlock(&w->lock);
+
+            while (ctx) {
+                gfcontext_t *next = ctx->next;
+                struct epoll_event ev;
+                ev.events = EPOLLOUT;
+                ev.data.ptr = ctx;
+                if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, ctx->conn->clientfd, &ev) < 0) {
+                    gfs_abort(&ctx);
+                } else {
+                    tw_timer_init(&ctx->timer, writer_expired, ctx);
+                    if (w->srv->send_timeout > 0) {
+                        timerwheel_arm(&w->wheel, &ctx->timer, (unsigned)w->srv->send_timeout * 1000);
+                    }
+                }
+                ctx = next;
+            }
+        }
+
+        timerwheel_advance(&w->wheel);
+    }
+    return NULL;
+}
+
+// Start the writer threads. They live as long as the server does.
+static void start_writers(gfserver_t *srv) {
+    srv->writers = calloc((size_t)srv->nwriters, sizeof(gfwriter_t));
+    if (!srv->writers) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < srv->nwriters; i++) {
+        gfwriter_t *w = &srv->writers[i];
+        w->srv = srv;
+        w->epfd = epoll_create1(0);
+        w->evfd = eventfd(0, EFD_NONBLOCK);
+        if (w->epfd < 0 || w->evfd < 0) {
+            perror("epoll_create1/eventfd");
+            exit(1);
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        timerwheel_init(&w->wheel, TIMER_TICK_MS);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = w;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+
+        // Writers do the acceptors' kind of work, so they go on the same cores
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (srv->acceptor_cpus.n > 0) {
+            affinity_attr_cpu(&attr, srv->acceptor_cpus.cpus[i % srv->acceptor_cpus.n]);
+        }
+
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, writer_thread, w) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+        pthread_detach(tid);
+    }
+}
+
+// Send a body without tying up the worker: whatever the socket takes right
+// away goes out here, and the rest is handed to a writer thread that streams
+// it as the client drains. The caller sets up body_fd or body_buf first; the
+// fd has to stay open until then (content.c keeps its fds for the life of the
+// server). Takes over the context.
+static ssize_t writer_start(gfcontext_t **ctx, off_t offset, size_t len) {
+    gfcontext_t *c = *ctx;
+    gfserver_t *srv = c->conn->srv;
+
+    c->body_off = offset;
+    c->body_left = len;
+    c->body_total = len;
+    c->pending_off = 0;
+    set_nonblocking(c->conn->clientfd, 1);
+
+    // Most bodies fit in the socket buffer - no reason to involve a writer for those
+    int rc = xfer_step(c, WRITER_BUDGET);
+    if (rc != 0) {
+        body_done(c);
+    }
+    if (rc < 0) {
+        gfs_abort(ctx);
+        return -1;
+    }
+    if (rc > 0) {
+        c->pending_len = 0;
+        sent_body(ctx, len);
+        return (ssize_t)len;
+    }
+
+    gfwriter_t *w = &srv->writers[__atomic_fetch_add(&srv->next_writer, 1, __ATOMIC_RELAXED) % srv->nwriters];
+    c->writer = w;
+    pthread_mutex_lock(&w->lock);
+    c->next = w->incoming;
+    w->incoming = c;
+    pthread_mutex_unlock(&w->lock);
+
+    uint64_t one = 1;
+    if (write(w->evfd, &one, sizeof(one)) < 0) {
+        // counter can't realistically overflow, and the writer drains it every wakeup
+    }
+
+    *ctx = NULL;
+    return (ssize_t)len;
+}
+
+// Send len bytes of fd starting at offset. Plain connections go out zero-copy
+// (sendfile, or splice through a pipe), or as batched io_uring reads and sends
+// when that engine is on. Mux connections do the same one frame at a time.
+ssize_t gfs_sendfile(gfcontext_t **ctx, int fd, off_t offset, size_t len) {
+    if (!ctx || !*ctx) {
+        return -1;
+    }
+
+    size_t total = len;
+    gfconn_t *conn = (*ctx)->conn;
+    int sockfd = conn->clientfd;
+    int timeout_ms = send_timeout_ms(conn);
+
+    if (conn->mux) {
+        while (len > 0) {
+            size_t chunk = len > MUX_FRAME_MAX ? MUX_FRAME_MAX : len;
+            gfframe_t frame = { htonl((*ctx)->stream), htonl((uint32_t)chunk) };
+
+            pthread_mutex_lock(&conn->wlock);
+            int rc = send_all(sockfd, &frame, sizeof(frame), timeout_ms);
+            if (rc == 0) {
+                rc = send_region(sockfd, fd, offset, chunk, timeout_ms);
+            }
+            pthread_mutex_unlock(&conn->wlock);
+
+            if (rc < 0) {
+                gfs_abort(ctx);
+                return -1;
+            }
+            offset += chunk;
+            len -= chunk;
+        }
+        sent_body(ctx, total);
+        return (ssize_t)total;
+    }
+
+    // Writer threads stream the body so the worker doesn't wait on the client
+    if (conn->srv->nwriters > 0 && len > 0) {
+        (*ctx)->body_fd = fd;
+        (*ctx)->body_buf = NULL;
+        (*ctx)->body_release = NULL;
+        return writer_start(ctx, offset, len);
+    }
+
+    // Small body: read it and send it together with the header in one writev
+    if ((*ctx)->pending_len && len <= COALESCE_MAX) {
+        char body[COALESCE_MAX];
+        if (pread(fd, body, len, offset) != (ssize_t)len || ctx_write(*ctx, body, len) < 0) {
+            gfs_abort(ctx);
+            return -1;
+        }
+        sent_body(ctx, total);
+        return (ssize_t)total;
+    }
+
+    // Bigger body: MSG_MORE holds the header back until the first body bytes fill the segment
+    if ((*ctx)->pending_len) {
+        size_t hlen = (*ctx)->pending_len;
+        (*ctx)->pending_len = 0;
+        if (send_all_flags(sockfd, (*ctx)->pending, hlen, MSG_MORE, timeout_ms) < 0) {
+            gfs_abort(ctx);
+            return -1;
+        }
+    }
+
+    gfuring_t *ring = conn->srv->use_uring ? get_send_ring() : NULL;
+
+    while (ring && len > 0) {
+        ssize_t sent = uring_send_batch(ring, sockfd, fd, offset, len, timeout_ms);
+        if (sent < 0) {
+            gfs_abort(ctx);
+            return -1;
+        }
+        if (sent == 0) {
+            break;  // short read or ring trouble, finish the regular way
+        }
+        offset += sent;
+        len -= (size_t)sent;
+    }
+
+    if (len > 0 && send_region(sockfd, fd, offset, len, timeout_ms) < 0) {
+        // file shrank, read error or client gone - the response can't be completed
+        gfs_abort(ctx);
+        return -1;
+    }
+
+    sent_body(ctx, total);
+    return (ssize_t)total;
+}
+
+// Send a body that's already in memory. release(arg) runs once nothing needs
+// buf any more - with writer threads on, that can be after this returns.
+ssize_t gfs_sendbuf(gfcontext_t **ctx, const void *buf, size_t len, void (*release)(void *), void *arg) {
+    if (!ctx || !*ctx) {
+        if (release) {
+            release(arg);
+        }
+        return -1;
+    }
+
+    if ((*ctx)->conn->srv->nwriters > 0 && !(*ctx)->conn->mux && len > 0) {
+        (*ctx)->body_fd = -1;
+        (*ctx)->body_buf = buf;
+        (*ctx)->body_release = release;
+        (*ctx)->body_arg = arg;
+        return writer_start(ctx, 0, len);
+    }
+
+    ssize_t rc = gfs_send(ctx, buf, len);
+    if (release) {
+        release(arg);
+    }
+    return rc;
+}
+
+// Create a new server instance
+gfserver_t *gfserver_create() {
+    gfserver_t *srv = malloc(sizeof(gfserver_t));
+    if (srv) {
+        memset(srv, 0, sizeof(gfserver_t));
+        srv->backlog = 5;  // default backlog
+        srv->nlisteners = 1;
+        srv->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+        srv->header_timeout = DEFAULT_HEADER_TIMEOUT;
+        srv->send_timeout = DEFAULT_SEND_TIMEOUT;
+        srv->nwriters = DEFAULT_WRITERS;
+        srv->conn_pool = objpool_create(sizeof(gfconn_t), POOL_SLAB);
+        srv->ctx_pool = objpool_create(sizeof(gfcontext_t), POOL_SLAB);
+        if (!srv->conn_pool || !srv->ctx_pool) {
+            objpool_destroy(srv->conn_pool);
+            objpool_destroy(srv->ctx_pool);
+            free(srv);
+            return NULL;
+        }
+    }
+    return srv;
+}
+
+// Set the port number for the server
+void gfserver_set_port(gfserver_t **gfs, unsigned short port) {
+    if (gfs && *gfs) {
+        (*gfs)->port = port;
+    }
+}
+
+// Set the handler argument 
+void gfserver_set_handlerarg(gfserver_t **gfs, void *arg) {
+    if (gfs && *gfs) {
+        (*gfs)->arg = arg;
+    }
+}
+
+// Set the request handler callback
+void gfserver_set_handler(gfserver_t **gfs, gfh_error_t (*handler)(gfcontext_t **, const char *, void *)) {
+    if (gfs && *gfs) {
+        (*gfs)->handler = handler;
+    }
+}
+
+// Set max pending connections
+void gfserver_set_maxpending(gfserver_t **gfs, int n_pending) {
+    if (gfs && *gfs) {
+        (*gfs)->backlog = n_pending;
+    }
+}
+
+// Switch between the blocking accept loop and the epoll event loop
+void gfserver_set_eventloop(gfserver_t **gfs, int enabled) {
+    if (gfs && *gfs) {
+        (*gfs)->use_epoll = enabled;
+    }
+}
+
+// Number of listening sockets (and accept loops) to shard connections across
+void gfserver_set_listeners(gfserver_t **gfs, int nlisteners) {
+    if (gfs && *gfs) {
+        if (nlisteners < 1) {
+            nlisteners = 1;
+        }
+        if (nlisteners > MAX_LISTENERS) {
+            nlisteners = MAX_LISTENERS;
+        }
+        (*gfs)->nlisteners = nlisteners;
+    }
+}
+
+// Use the io_uring engine for accept, header reads and file sends
+void gfserver_set_uring(gfserver_t **gfs, int enabled) {
+    if (gfs && *gfs) {
+        (*gfs)->use_uring = enabled;
+    }
+}
+
+// How long a kept-alive connection may sit idle, 0 disables keep-alive. Only
+// the epoll loop parks connections between requests, so it's the only one that
+// agrees to KEEPALIVE - the blocking and io_uring loops always close.
+void gfserver_set_idle_timeout(gfserver_t **gfs, int seconds) {
+    if (gfs && *gfs) {
+        (*gfs)->idle_timeout = seconds > 0 ? seconds : 0;
+    }
+}
+
+// How long a client gets to send a complete request header, 0 for no limit
+void gfserver_set_header_timeout(gfserver_t **gfs, int seconds) {
+    if (gfs && *gfs) {
+        (*gfs)->header_timeout = seconds > 0 ? seconds : 0;
+    }
+}
+
+// How long a response may go without the client taking any bytes, 0 for no limit
+void gfserver_set_send_timeout(gfserver_t **gfs, int seconds) {
+    if (gfs && *gfs) {
+        (*gfs)->send_timeout = seconds > 0 ? seconds : 0;
+    }
+}
+
+// Threads that stream response bodies to clients as they drain them, 0 to
+// have workers send (and wait on) the whole body themselves
+void gfserver_set_writers(gfserver_t **gfs, int nwriters) {
+    if (gfs && *gfs) {
+        if (nwriters < 0) {
+            nwriters = 0;
+        }
+        if (nwriters > MAX_WRITERS) {
+            nwriters = MAX_WRITERS;
+        }
+        (*gfs)->nwriters = nwriters;
+    }
+}
+
+// Pin listener i to cpus[i % n] - normally cores near the NIC's interrupts.
+// NULL or an empty list goes back to the default: a single listener floats,
+// sharded ones take a core each.
+void gfserver_set_acceptor_cpus(gfserver_t **gfs, const cpulist_t *cpus) {
+    if (gfs && *gfs) {
+        if (cpus) {
+            (*gfs)->acceptor_cpus = *cpus;
+        } else {
+            (*gfs)->acceptor_cpus.n = 0;
+        }
+    }
+}
+
+// Fresh connection for a just-accepted socket - the caller holds the first reference
+static gfconn_t *new_conn(gfserver_t *srv, gfloop_t *loop, int clientfd) {
+    gfconn_t *conn = objpool_get(srv->conn_pool);
+    if (!conn) {
+        close(clientfd);
+        return NULL;
+    }
+    conn->clientfd = clientfd;
+    conn->srv = srv;
+    parser_reset(&conn->parser);
+    conn->loop = loop;
+    conn->refs = 1;
+    conn->mux = 0;
+    pthread_mutex_init(&conn->wlock, NULL);
+    conn->next = NULL;
+    tw_timer_init(&conn->timer, NULL, conn);
+    conn->deadline = DEADLINE_NONE;
+    conn->hdr_start_ns = stats_now();
+
+    if (srv->send_timeout > 0) {
+        struct timeval tv = { srv->send_timeout, 0 };
+        setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    return conn;
+}
+
+// Parse an unsigned decimal request token
+static int token_uint(const gfparser_t *p, int i, uint32_t *out) {
+    if (i >= p->ntok || p->tok_len[i] == 0 || p->tok_len[i] > 9) {
+        return -1;
+    }
+    uint32_t v = 0;
+    for (size_t k = 0; k < p->tok_len[i]; k++) {
+        char c = p->buf[p->tok_start[i] + k];
+        if (c < '0' || c > '9') {
+            return -1;
+        }
+        v = v * 10 + (uint32_t)(c - '0');
+    }
+    *out = v;
+    return 0;
+}
+
+// Same for 64-bit values (file offsets and lengths)
+static int token_u64(const gfparser_t *p, int i, uint64_t *out) {
+    if (i >= p->ntok || p->tok_len[i] == 0 || p->tok_len[i] > 19) {
+        return -1;
+    }
+    uint64_t v = 0;
+    for (size_t k = 0; k < p->tok_len[i]; k++) {
+        char c = p->buf[p->tok_start[i] + k];
+        if (c < '0' || c > '9') {
+            return -1;
+        }
+        v = v * 10 + (uint64_t)(c - '0');
+    }
+    *out = v;
+    return 0;
+}
+
+// Validate a complete request header: GETFILE GET /path [options...]
+static int parse_request(const gfparser_t *p, gfrequest_t *req) {
+    memset(req, 0, sizeof(*req));
+
+    if (p->state != PARSE_DONE || p->ntok < 3 ||
+        !token_is(p, 0, "GETFILE") || !token_is(p, 1, "GET") ||
+        p->buf[p->tok_start[2]] != '/' || p->tok_len[2] >= sizeof(req->path)) {
+        return -1;
+    }
+
+    memcpy(req->path, p->buf + p->tok_start[2], p->tok_len[2]);
+    req->path[p->tok_len[2]] = '\0';
+
+    // Optional tokens after the path - unknown ones are ignored so old servers
+    // and new clients (and the other way round) still get along
+    for (int i = 3; i < p->ntok; i++) {
+        if (token_is(p, i, "KEEPALIVE")) {
+            req->keepalive = 1;
+        } else if (token_is(p, i, "STREAM") && token_uint(p, i + 1, &req->stream_id) == 0) {
+            req->stream = 1;
+            i++;
+        } else if (token_is(p, i, "RANGE") && token_u64(p, i + 1, &req->range_off) == 0 &&
+                   token_u64(p, i + 2, &req->range_len) == 0) {
+            req->range = 1;
+            i += 2;
+        } else if (token_is(p, i, "DEFLATE")) {
+            req->deflate = 1;
+        }
+    }
+    return 0;
+}
+
+// Hand a request off to the handler. The request takes its own reference on the connection.
+static void dispatch_request(gfserver_t *srv, gfconn_t *conn, const gfrequest_t *req, int valid) {
+    gfcontext_t *ctx = objpool_get(srv->ctx_pool);
+    if (!ctx) {
+        return;  // the caller's reference still closes the connection
+    }
+    uint64_t now = stats_now();
+    stats_record(STAT_HEADER_READ, now - conn->hdr_start_ns);
+
+    // Accept (or the start of this request) is stamped late, once there's an id to put on it
+    ctx->trace_id = trace_new_id();
+    trace_record_at(TRACE_ACCEPT, ctx->trace_id, 0, conn->hdr_start_ns);
+    trace_record_at(TRACE_HEADER, ctx->trace_id, 0, now);
+
+    conn_ref(conn);
+    ctx->conn = conn;
+    ctx->start_ns = now;
+    ctx->stream = req->stream_id;
+    // Only a connection an epoll loop can take back gets kept (see gfserver_set_idle_timeout)
+    ctx->keepalive = req->keepalive && conn->loop && !conn->mux && srv->idle_timeout > 0;
+    ctx->header_sent = 0;
+    ctx->resp_left = 0;
+    ctx->pending_len = 0;
+    ctx->pending_off = 0;
+    ctx->range = req->range;
+    ctx->range_off = (size_t)req->range_off;
+    ctx->range_len = (size_t)req->range_len;
+    ctx->deflate = req->deflate;
+
+    if (!valid) {
+        // Invalid request
+        gfs_sendheader(&ctx, GF_INVALID, 0);
+        gfs_abort(&ctx);
+        return;
+    }
+
+    // Don't let one connection queue up unlimited work. This runs on the loop
+    // thread, so the refusal can't go through the usual (blocking) sends.
+    if (conn->mux && __atomic_load_n(&conn->refs, __ATOMIC_RELAXED) > MUX_MAX_STREAMS + 1) {
+        stats_add(STAT_STATUS_ERROR, 1);
+        trace_record(TRACE_HEADER_SENT, ctx->trace_id, (uint64_t)(STAT_STATUS_ERROR - STAT_STATUS_OK));
+        conn_refuse_stream(conn, ctx->stream);
+        objpool_put(srv->ctx_pool, ctx);
+        conn_unref(conn);
+        return;
+    }
+
+    // Call the handler if we have one
+    if (srv->handler) {
+        srv->handler(&ctx, req->path, srv->arg);
+        
+        // If handler didn't consume the context, clean it up
+        if (ctx) {
+            gfs_abort(&ctx);
+        }
+    } else {
+        gfs_sendheader(&ctx, GF_ERROR, 0);
+        gfs_abort(&ctx);
+    }
+}
+
+// Single-request connections (blocking and io_uring loops): dispatch and let go
+static void dispatch_once(gfserver_t *srv, gfconn_t *conn) {
+    gfrequest_t req;
+    int valid = parse_request(&conn->parser, &req) == 0;
+    dispatch_request(srv, conn, &req, valid);
+    conn_unref(conn);
+}
+
+// Drain everything the socket has for us (edge-triggered, so read until EAGAIN).
+// Returns 1 once the header is complete (or hopeless - parse_request will say
+// INVALID), 0 if we need to wait for more, -1 to drop it.
+static int read_parked(gfconn_t *conn) {
+    gfparser_t *p = &conn->parser;
+
+    while (1) {
+        int state = parser_feed(p);
+        if (state == PARSE_DONE || state == PARSE_BAD) {
+            return 1;
+        }
+
+        ssize_t r = recv(conn->clientfd, p->buf + p->len, sizeof(p->buf) - p->len, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (r == 0) {
+            return -1;  // client went away before finishing the header
+        }
+        p->len += (size_t)r;
+        if (!conn->hdr_start_ns) {
+            conn->hdr_start_ns = stats_now();  // next request on a kept-alive connection
+        }
+    }
+}
+
+// On to the connection's next request. Pipelined bytes already here mean it has
+// started; otherwise read_parked starts its clock when something arrives.
+static void conn_next(gfconn_t *conn) {
+    parser_next(&conn->parser);
+    conn->hdr_start_ns = conn->parser.len > 0 ? stats_now() : 0;
+}
+
+// Deadline ran out on a parked connection - the loop lets go of it
+static void loop_expired(tw_timer_t *t, void *arg) {
+    (void)t;
+    gfconn_t *conn = arg;
+    conn->deadline = DEADLINE_NONE;
+    epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->clientfd, NULL);
+    conn_unref(conn);
+}
+
+// Start the clock on a parked connection. The header deadline isn't pushed
+// back by more bytes trickling in, only a complete request resets it.
+static void loop_deadline(gfserver_t *srv, gfloop_t *loop, gfconn_t *conn, int kind) {
+    int seconds = kind == DEADLINE_IDLE ? srv->idle_timeout : srv->header_timeout;
+    conn->deadline = kind;
+    if (seconds > 0) {
+        timerwheel_arm(&loop->wheel, &conn->timer, (unsigned)seconds * 1000);
+    } else {
+        timerwheel_cancel(&loop->wheel, &conn->timer);
+    }
+}
+
+// Waiting on the next request: nothing buffered yet means idle, otherwise it's mid-header
+static void loop_wait_next(gfserver_t *srv, gfloop_t *loop, gfconn_t *conn) {
+    loop_deadline(srv, loop, conn, conn->parser.len > 0 ? DEADLINE_HEADER : DEADLINE_IDLE);
+}
+
+// The connection is leaving the loop - its deadline goes with it
+static void loop_leave(gfloop_t *loop, gfconn_t *conn) {
+    timerwheel_cancel(&loop->wheel, &conn->timer);
+    conn->deadline = DEADLINE_NONE;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->clientfd, NULL);
+}
+
+// Called from whichever thread finished the response. The loop thread owns
+// the epoll set and the timers, so just queue it up and wake the loop.
+static void loop_return(gfloop_t *loop, gfconn_t *conn) {
+    pthread_mutex_lock(&loop->lock);
+    conn->next = loop->returned;
+    loop->returned = conn;
+    pthread_mutex_unlock(&loop->lock);
+
+    uint64_t one = 1;
+    if (write(loop->evfd, &one, sizeof(one)) < 0) {
+        // counter can't realistically overflow, and the loop drains it every wakeup
+    }
+}
+
+// Park a connection in epoll until its header is complete. Returns -1 (and
+// drops the loop's reference) if epoll won't take it.
+static int loop_park(gfloop_t *loop, gfconn_t *conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->clientfd, &ev) < 0) {
+        conn_unref(conn);
+        return -1;
+    }
+    return 0;
+}
+
+// Read and dispatch whatever requests a parked connection has for us.
+// Returns 1 if it's still parked waiting for more, 0 if it left the loop.
+static int loop_readable(gfserver_t *srv, gfloop_t *loop, gfconn_t *conn) {
+    while (1) {
+        int rc = read_parked(conn);
+        if (rc == 0) {
+            return 1;  // still waiting on the rest of the header
+        }
+
+        // Hangup, or garbage in the middle of a framed connection where there's
+        // no stream to answer on - the loop lets go, in-flight mux streams keep it open until done
+        if (rc < 0 || (conn->mux && conn->parser.state == PARSE_BAD)) {
+            loop_leave(loop, conn);
+            conn_unref(conn);
+            return 0;
+        }
+
+        gfrequest_t req;
+        int valid = parse_request(&conn->parser, &req) == 0;
+
+        // First STREAM request switches the connection to framed mode for good
+        if (valid && req.stream && !conn->mux) {
+            conn->mux = 1;  // only written once - workers read it from here on
+        }
+
+        if (conn->mux) {
+            // Stay in the loop and keep reading - responses come back in whatever order
+            dispatch_request(srv, conn, &req, valid);
+            conn_next(conn);
+            loop_wait_next(srv, loop, conn);
+            continue;
+        }
+
+        // One request at a time - the connection leaves the loop until the response is done
+        loop_leave(loop, conn);
+
+        // Handler and workers expect plain blocking sends
+        set_nonblocking(conn->clientfd, 0);
+        dispatch_request(srv, conn, &req, valid);
+        conn_unref(conn);
+        return 0;
+    }
+}
+
+// Read what's there. Once a kept-alive connection has started its next request
+// its idle wait turns into a header deadline.
+static void loop_poke(gfserver_t *srv, gfloop_t *loop, gfconn_t *conn) {
+    if (loop_readable(srv, loop, conn) && conn->deadline == DEADLINE_IDLE && conn->parser.len > 0) {
+        loop_deadline(srv, loop, conn, DEADLINE_HEADER);
+    }
+}
+
+// Kept-alive connection is back from a worker - start on its next request
+static void loop_rearm(gfserver_t *srv, gfloop_t *loop, gfconn_t *conn) {
+    conn_next(conn);
+    conn->next = NULL;
+
+    set_nonblocking(conn->clientfd, 1);
+    if (loop_park(loop, conn) < 0) {
+        return;
+    }
+
+    // Client may have pipelined the next request already, and edge-triggered
+    // epoll won't tell us about bytes we've already read
+    loop_wait_next(srv, loop, conn);
+    loop_poke(srv, loop, conn);
+}
+
+// Accept everything pending on the listener and park the new connections in epoll
+static void accept_pending(gfserver_t *srv, gfloop_t *loop, int listenfd) {
+    while (1) {
+        int clientfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (clientfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;  // EAGAIN (backlog drained) or a real error, either way stop for now
+        }
+
+        gfconn_t *conn = new_conn(srv, loop, clientfd);
+        if (conn && loop_park(loop, conn) == 0) {
+            tw_timer_init(&conn->timer, loop_expired, conn);
+            loop_deadline(srv, loop, conn, DEADLINE_HEADER);
+        }
+    }
+}
+
+// Event loop - never blocks on a single client, so slow senders can't stall accept
+static void serve_epoll(gfserver_t *srv, int listenfd) {
+    gfloop_t *loop = calloc(1, sizeof(gfloop_t));
+    if (!loop) {
+        perror("calloc");
+        exit(1);
+    }
+    pthread_mutex_init(&loop->lock, NULL);
+    timerwheel_init(&loop->wheel, TIMER_TICK_MS);
+
+    loop->epfd = epoll_create1(0);
+    loop->evfd = eventfd(0, EFD_NONBLOCK);
+    if (loop->epfd < 0 || loop->evfd < 0) {
+        perror("epoll_create1/eventfd");
+        exit(1);
+    }
+
+    set_nonblocking(listenfd, 1);
+
+    // The listener is the only entry with a NULL pointer, the wakeup fd points at the loop
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = loop;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // Only tick while some connection has a deadline running
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timerwheel_timeout(&loop->wheel));
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (!ptr) {
+                accept_pending(srv, loop, listenfd);
+                continue;
+            }
+
+            if (ptr == loop) {
+                uint64_t count;
+                if (read(loop->evfd, &count, sizeof(count)) < 0) {
+                    // already drained
+                }
+                pthread_mutex_lock(&loop->lock);
+                gfconn_t *conn = loop->returned;
+                loop->returned = NULL;
+                pthread_mutex_unlock(&loop->lock);
+
+                while (conn) {
+                    gfconn_t *next = conn->next;
+                    loop_rearm(srv, loop, conn);
+                    conn = next;
+                }
+                continue;
+            }
+
+            loop_poke(srv, loop, ptr);
+        }
+
+        timerwheel_advance(&loop->wheel);
+    }
+}
+
+// Grab an SQE, flushing what's queued so far if the submission ring is full
+static struct io_uring_sqe *uring_sqe(gfuring_t *ring) {
+    struct io_uring_sqe *sqe = gfuring_get_sqe(ring);
+    if (!sqe && gfuring_submit(ring, 0) >= 0) {
+        sqe = gfuring_get_sqe(ring);
+    }
+    return sqe;
+}
+
+static void uring_queue_accept(gfuring_t *ring) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (sqe) {
+        // listener is registered as fixed file 0, user_data 0 marks an accept
+        gfuring_prep_accept(sqe, 0, 1, 0);
+    }
+}
+
+// user_data 1 marks the loop's tick timer (accepts are 0, everything else is a connection)
+#define URING_TICK 1
+
+// Header deadline passed while a recv is still queued - shutting the socket down
+// makes that recv complete, and the completion drops the connection as usual
+static void uring_expired(tw_timer_t *t, void *arg) {
+    (void)t;
+    gfconn_t *conn = arg;
+    shutdown(conn->clientfd, SHUT_RDWR);
+}
+
+static void uring_queue_recv(gfuring_t *ring, gfconn_t *conn) {
+    gfparser_t *p = &conn->parser;
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    if (!sqe) {
+        conn_unref(conn);
+        return;
+    }
+    gfuring_prep_recv(sqe, conn->clientfd, p->buf + p->len, sizeof(p->buf) - p->len,
+                      (unsigned long long)(unsigned long)conn);
+}
+
+// io_uring loop - accepts and header reads are queued as SQEs, and everything
+// queued while handling one batch of completions goes in with a single enter.
+// Returns only if the ring couldn't be set up.
+static int serve_uring(gfserver_t *srv, int listenfd) {
+    gfuring_t ring;
+    if (gfuring_init(&ring, URING_ENTRIES * 4) < 0) {
+        return -1;
+    }
+    if (gfuring_register_files(&ring, &listenfd, 1) < 0) {
+        gfuring_exit(&ring);
+        return -1;
+    }
+
+    for (int i = 0; i < URING_ACCEPTS; i++) {
+        uring_queue_accept(&ring);
+    }
+
+    timerwheel_t wheel;
+    timerwheel_init(&wheel, TIMER_TICK_MS);
+    struct __kernel_timespec tick = { 0, TIMER_TICK_MS * 1000000LL };
+    int ticking = 0;
+
+    while (1) {
+        // Only tick while some connection has a deadline running
+        if (!ticking && timerwheel_timeout(&wheel) >= 0) {
+            struct io_uring_sqe *sqe = uring_sqe(&ring);
+            if (sqe) {
+                gfuring_prep_timeout(sqe, &tick, URING_TICK);
+                ticking = 1;
+            }
+        }
+
+        if (gfuring_submit(&ring, 1) < 0) {
+            continue;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = gfuring_peek_cqe(&ring))) {
+            unsigned long long data = cqe->user_data;
+            gfconn_t *conn = (gfconn_t *)(unsigned long)data;
+            int res = cqe->res;
+            gfuring_cqe_seen(&ring);
+
+            if (data == URING_TICK) {
+                ticking = 0;
+                continue;
+            }
+
+            if (!conn) {
+                // Accept finished - keep the same number of accepts in flight
+                uring_queue_accept(&ring);
+                if (res >= 0 && (conn = new_conn(srv, NULL, res))) {
+                    tw_timer_init(&conn->timer, uring_expired, conn);
+                    if (srv->header_timeout > 0) {
+                        timerwheel_arm(&wheel, &conn->timer, (unsigned)srv->header_timeout * 1000);
+                    }
+                    uring_queue_recv(&ring, conn);
+                }
+                continue;
+            }
+
+            if (res <= 0) {
+                timerwheel_cancel(&wheel, &conn->timer);
+                conn_unref(conn);  // client went away (or ran out of time) before finishing the header
+                continue;
+            }
+
+            gfparser_t *p = &conn->parser;
+            p->len += (size_t)res;
+            int state = parser_feed(p);
+            if (state == PARSE_DONE || state == PARSE_BAD) {
+                timerwheel_cancel(&wheel, &conn->timer);
+                dispatch_once(srv, conn);
+            } else {
+                uring_queue_recv(&ring, conn);
+            }
+        }
+
+        timerwheel_advance(&wheel);
+    }
+    return 0;
+}
+
+// Blocking accept loop - one client at a time
+static void serve_blocking(gfserver_t *srv, int listenfd) {
+    while (1) {
+        int clientfd = accept(listenfd, NULL, NULL);
+        if (clientfd < 0) {
+            continue;  // accept failed, try again
+        }
+
+        // Create context for this connection
+        gfconn_t *conn = new_conn(srv, NULL, clientfd);
+        if (!conn) {
+            continue;
+        }
+
+        // Read the request header in big chunks until the parser is happy,
+        // or the client runs out of time to send it
+        gfparser_t *p = &conn->parser;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        while (parser_feed(p) != PARSE_DONE && p->state != PARSE_BAD) {
+            if (srv->header_timeout > 0) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                long left = srv->header_timeout * 1000L - ((now.tv_sec - start.tv_sec) * 1000L +
+                                                           (now.tv_nsec - start.tv_nsec) / 1000000L);
+                struct pollfd pfd = { clientfd, POLLIN, 0 };
+                if (left <= 0 || poll(&pfd, 1, (int)left) <= 0) {
+                    break;
+                }
+            }
+
+            ssize_t r = recv(clientfd, p->buf + p->len, sizeof(p->buf) - p->len, 0);
+            if (r <= 0) {
+                break;  // error or connection closed
+            }
+            p->len += (size_t)r;
+        }
+
+        dispatch_once(srv, conn);
+    }
+}
+
+// Create, bind and listen. With reuseport set, several sockets can share the
+// port and the kernel load balances new connections between them.
+static int open_listener(gfserver_t *srv, int reuseport) {
+    // Create listening socket
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    // Set socket option to reuse address 
+    int opt = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(1);
+    }
+
+    // Setup address structure
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;  // listen on all interfaces
+    addr.sin_port = htons(srv->port);
+
+    // Bind to port
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+
+    // Start listening
+    listen(listenfd, srv->backlog);
+
+    return listenfd;
+}
+
+// Thread body for one listener shard
+static void *listener_thread(void *arg) {
+    listener_t *l = arg;
+
+    if (l->srv->use_uring) {
+        if (serve_uring(l->srv, l->listenfd) < 0) {
+            fprintf(stderr, "io_uring not available, falling back\n");
+        }
+    }
+
+    if (l->srv->use_epoll) {
+        serve_epoll(l->srv, l->listenfd);
+    } else {
+        serve_blocking(l->srv, l->listenfd);
+    }
+    return NULL;
+}
+
+// Main server loop 
+void gfserver_serve(gfserver_t **gfs) {
+    if (!gfs || !*gfs) {
+        return;
+    }
+    
+    gfserver_t *srv = *gfs;
+
+    // sendfile/splice have no MSG_NOSIGNAL - a client hanging up mid-body
+    // must not take the whole server down
+    signal(SIGPIPE, SIG_IGN);
+
+    if (srv->nwriters > 0) {
+        start_writers(srv);
+    }
+
+    // Single listener - just run the loop on this thread like always
+    if (srv->nlisteners <= 1) {
+        int cpu = srv->acceptor_cpus.n > 0 ? srv->acceptor_cpus.cpus[0] : -1;
+        listener_t l = { srv, open_listener(srv, 0), cpu };
+        if (cpu >= 0) {
+            affinity_pin(cpu);
+        }
+        listener_thread(&l);
+        return;
+    }
+
+    // Sharded: every socket is bound before any loop starts so a failure
+    // shows up right away, then each loop gets its own core
+    static listener_t listeners[MAX_LISTENERS];
+    pthread_t tids[MAX_LISTENERS];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) {
+        ncpu = 1;
+    }
+
+    for (int i = 0; i < srv->nlisteners; i++) {
+        listeners[i].srv = srv;
+        listeners[i].listenfd = open_listener(srv, 1);
+        if (srv->acceptor_cpus.n > 0) {
+            listeners[i].cpu = srv->acceptor_cpus.cpus[i % srv->acceptor_cpus.n];
+        } else {
+            listeners[i].cpu = (int)(i % ncpu);
+        }
+    }
+
+    for (int i = 0; i < srv->nlisteners; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        affinity_attr_cpu(&attr, listeners[i].cpu);
+        if (pthread_create(&tids[i], &attr, listener_thread, &listeners[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    for (int i = 0; i < srv->nlisteners; i++) {
+        pthread_join(tids[i], NULL);
+    }
 }
@@ -1,11 +1,19 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
+#include <pthread.h>
 #include <getopt.h>
 
 #include "gfserver-student.h"
 #include "gfserver.h"
 #include "content.h"
+#include "affinity.h"
+#include "stats.h"
+#include "admin.h"
+#include "trace.h"
 
 #define USAGE                                                                                     \
   "usage:\n"                                                                                      \
@@ -15,7 +23,25 @@
   "  -t [nthreads]       Number of threads (Default: 16)\n"                                       \
   "  -m [content_file]   Content file mapping keys to content files (Default: content.txt)\n"     \
   "  -p [listen_port]    Listen port (Default: 56726)\n"                                          \
-  "  -d [delay]          Delay in content_get, default 0, range 0-5000000 (microseconds)\n"
+  "  -d [delay]          Delay in content_get, default 0, range 0-5000000 (microseconds)\n"       \
+  "  -e                  Use the epoll event loop to accept and read requests\n"                  \
+  "  -l [nlisteners]     SO_REUSEPORT listeners, one accept loop per core (Default: 1)\n"         \
+  "  -u                  Use io_uring for accept, recv and (with -W 0) file sends if available\n" \
+  "  -k [seconds]        Keep-alive idle timeout, epoll loop only, 0 to disable (Default: 10)\n"  \
+  "  -q [depth]          Max queued requests, 0 for unbounded (Default: 0)\n"                     \
+  "  -Q [policy]         What to do when the queue is full: reject or block (Default: reject)\n"  \
+  "  -r [seconds]        Deadline for the request header, 0 for none (Default: 10)\n"             \
+  "  -w [seconds]        Time a response send may stall, 0 for none (Default: 30)\n"              \
+  "  -T [min:max]        Let the worker pool size itself within these bounds (Default: off)\n"    \
+  "  -W [nwriters]       Threads streaming bodies to clients, 0 to send on workers (Default: 1)\n" \
+  "  -S [order]          Queue order: fifo, or srpt to serve smaller files first (Default: fifo)\n" \
+  "  -c [megabytes]      Memory for caching file contents, 0 to disable (Default: 64)\n"          \
+  "  -V [ms]             Recheck cached file metadata this often, 0 = every time (Default: 1000)\n" \
+  "  -P [count]          Prefetch files seen following another this often, 0 = off (Default: 4)\n" \
+  "  -A [cpus]           Pin listeners and writers: 0-3,8, or n0 for node 0 (Default: off)\n"     \
+  "  -C [cpus]           Pin workers, round-robin over the list (Default: off)\n"                 \
+  "  -M [port]           Local admin port serving Prometheus /metrics, 0 = off (Default: 0)\n"    \
+  "  -x [dumpfile]       Trace requests; SIGUSR1 (or /trace with -M) dumps them (Default: off)\n"
 
 
   // Command line options structure
@@ -25,6 +51,24 @@ static struct option gLongOptions[] = {
     {"nthreads", required_argument, NULL, 't'},
     {"port", required_argument, NULL, 'p'},
     {"content", required_argument, NULL, 'm'},
+    {"epoll", no_argument, NULL, 'e'},
+    {"listeners", required_argument, NULL, 'l'},
+    {"uring", no_argument, NULL, 'u'},
+    {"keepalive", required_argument, NULL, 'k'},
+    {"queue", required_argument, NULL, 'q'},
+    {"queue-policy", required_argument, NULL, 'Q'},
+    {"header-timeout", required_argument, NULL, 'r'},
+    {"send-timeout", required_argument, NULL, 'w'},
+    {"pool", required_argument, NULL, 'T'},
+    {"writers", required_argument, NULL, 'W'},
+    {"sched", required_argument, NULL, 'S'},
+    {"cache", required_argument, NULL, 'c'},
+    {"recheck", required_argument, NULL, 'V'},
+    {"prefetch", required_argument, NULL, 'P'},
+    {"acceptor-cpus", required_argument, NULL, 'A'},
+    {"worker-cpus", required_argument, NULL, 'C'},
+    {"admin-port", required_argument, NULL, 'M'},
+    {"trace", required_argument, NULL, 'x'},
     {NULL, 0, NULL, 0}};
 
 extern unsigned long int content_delay;
@@ -33,31 +77,127 @@ extern unsigned long int content_delay;
 extern void init_threads(size_t numthreads);
 extern void cleanup_threads();
 extern gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void *arg);
+extern void set_queue_limit(size_t limit, int block);
+extern unsigned long queue_shed_count();
+extern unsigned long queue_blocked_count();
+extern void set_pool_bounds(size_t min, size_t max);
+extern size_t pool_worker_count();
+extern unsigned long pool_grow_count();
+extern unsigned long pool_shrink_count();
+extern void set_sched_srpt(int enabled);
+extern unsigned long flight_coalesced_count();
+extern void set_content_cache(size_t bytes);
+extern unsigned long cache_hit_count();
+extern unsigned long cache_miss_count();
+extern unsigned long cache_eviction_count();
+extern size_t cache_bytes();
+extern void set_meta_recheck(unsigned ms);
+extern unsigned long meta_hit_count();
+extern unsigned long meta_recheck_count();
+extern unsigned long meta_change_count();
+extern void set_prefetch(unsigned min_count);
+extern unsigned long prefetch_total();
+extern void set_worker_cpus(const cpulist_t *cpus);
+extern unsigned long queue_length();
+
+// Extra server options from gfserver.c
+extern void gfserver_set_eventloop(gfserver_t **gfs, int enabled);
+extern void gfserver_set_listeners(gfserver_t **gfs, int nlisteners);
+extern void gfserver_set_uring(gfserver_t **gfs, int enabled);
+extern void gfserver_set_idle_timeout(gfserver_t **gfs, int seconds);
+extern void gfserver_set_header_timeout(gfserver_t **gfs, int seconds);
+extern void gfserver_set_send_timeout(gfserver_t **gfs, int seconds);
+extern void gfserver_set_writers(gfserver_t **gfs, int nwriters);
+extern void gfserver_set_acceptor_cpus(gfserver_t **gfs, const cpulist_t *cpus);
+
+// Size counters as scrape readings
+static unsigned long worker_reading() {
+  return (unsigned long)pool_worker_count();
+}
+
+static unsigned long cache_bytes_reading() {
+  return (unsigned long)cache_bytes();
+}
 
-// Signal handler to cleanup on shutdown
-static void _sig_handler(int signo) {
-  if (signo == SIGINT || signo == SIGTERM) {
-    // Just exit
-    exit(signo);
+// What the admin port reports on top of the request stages
+static void register_metrics() {
+  stats_metric("gf_queue_depth", "gauge", "Jobs waiting for a worker.", queue_length);
+  stats_metric("gf_workers", "gauge", "Running worker threads.", worker_reading);
+  stats_metric("gf_shed_total", "counter", "Requests turned away with a full queue.", queue_shed_count);
+  stats_metric("gf_acceptor_blocked_total", "counter", "Times the acceptor waited for queue room.",
+               queue_blocked_count);
+  stats_metric("gf_lookups_coalesced_total", "counter", "Lookups that joined one in flight.",
+               flight_coalesced_count);
+  stats_metric("gf_cache_hits_total", "counter", "Content cache hits.", cache_hit_count);
+  stats_metric("gf_cache_misses_total", "counter", "Content cache misses.", cache_miss_count);
+  stats_metric("gf_cache_evictions_total", "counter", "Content cache evictions.", cache_eviction_count);
+  stats_metric("gf_cache_bytes", "gauge", "Bytes held by the content cache.", cache_bytes_reading);
+  stats_metric("gf_meta_hits_total", "counter", "Metadata cache hits.", meta_hit_count);
+  stats_metric("gf_prefetched_total", "counter", "Predicted files prefetched.", prefetch_total);
+}
+
+// SIGINT/SIGTERM stay blocked in every thread and are taken here with sigwait,
+// so the counters - some of them behind cache locks - are read outside a handler
+static sigset_t stop_signals;
+
+static void *shutdown_thread(void *arg) {
+  (void)arg;
+  int signo;
+  while (sigwait(&stop_signals, &signo) != 0) {
   }
+
+  // Report overload counters, then just exit
+  fprintf(stderr, "requests shed: %lu, acceptor blocked: %lu\n",
+          queue_shed_count(), queue_blocked_count());
+  fprintf(stderr, "workers: %zu, pool grew: %lu, shrank: %lu\n",
+          pool_worker_count(), pool_grow_count(), pool_shrink_count());
+  fprintf(stderr, "lookups coalesced: %lu\n", flight_coalesced_count());
+  fprintf(stderr, "cache hits: %lu, misses: %lu, evictions: %lu, bytes: %zu\n",
+          cache_hit_count(), cache_miss_count(), cache_eviction_count(), cache_bytes());
+  fprintf(stderr, "metadata hits: %lu, rechecks: %lu, changed: %lu\n",
+          meta_hit_count(), meta_recheck_count(), meta_change_count());
+  fprintf(stderr, "prefetched: %lu\n", prefetch_total());
+  exit(signo);
 }
 
 int main(int argc, char **argv) {
   char *content_map = "content.txt"; // default content map file
   gfserver_t *gfs = NULL;
   int nthreads = 16;
+  int use_epoll = 0;
+  int nlisteners = 1;
+  int use_uring = 0;
+  int idle_timeout = 10;
+  int idle_timeout_set = 0;
+  int queue_depth = 0;
+  int queue_block = 0;
+  int header_timeout = 10;
+  int send_timeout = 30;
+  int pool_min = 0;
+  int pool_max = 0;
+  int nwriters = 1;
+  int srpt = 0;
+  int cache_mb = 64;
+  int recheck_ms = 1000;
+  int prefetch = 4;
+  int admin_port = 0;
+  char *trace_file = NULL;
+  cpulist_t acceptor_cpus = { 0 };
+  cpulist_t worker_cpus = { 0 };
   unsigned short port = 56726;
   int option_char = 0;
 
   // Turn off buffering to see output
   setbuf(stdout, NULL);
 
-  // Setup signal handlers
-  signal(SIGINT, _sig_handler);
-  signal(SIGTERM, _sig_handler);
+  // Setup signal handling - block the shutdown signals before any thread starts
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
 
   // Parse command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:d:hm:t:", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "p:d:hm:t:el:uk:q:Q:r:w:T:W:S:c:V:P:A:C:M:x:", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 'h': // help
         fprintf(stdout, "%s", USAGE);
@@ -74,6 +214,84 @@ int main(int argc, char **argv) {
       case 'm': // content mapping file
         content_map = optarg;
         break;
+      case 'e': // epoll event loop
+        use_epoll = 1;
+        break;
+      case 'l': // number of listeners
+        nlisteners = atoi(optarg);
+        break;
+      case 'u': // io_uring engine
+        use_uring = 1;
+        break;
+      case 'k': // keep-alive idle timeout
+        idle_timeout = atoi(optarg);
+        idle_timeout_set = 1;
+        break;
+      case 'q': // job queue bound
+        queue_depth = atoi(optarg);
+        break;
+      case 'r': // header read deadline
+        header_timeout = atoi(optarg);
+        break;
+      case 'w': // send progress deadline
+        send_timeout = atoi(optarg);
+        break;
+      case 'T': // adaptive pool bounds
+        if (sscanf(optarg, "%d:%d", &pool_min, &pool_max) != 2 || pool_min < 1 || pool_max < pool_min) {
+          fprintf(stderr, "%s", USAGE);
+          exit(1);
+        }
+        break;
+      case 'W': // writer threads
+        nwriters = atoi(optarg);
+        break;
+      case 'S': // job order
+        if (strcmp(optarg, "srpt") == 0) {
+          srpt = 1;
+        } else if (strcmp(optarg, "fifo") == 0) {
+          srpt = 0;
+        } else {
+          fprintf(stderr, "%s", USAGE);
+          exit(1);
+        }
+        break;
+      case 'c': // content cache size
+        cache_mb = atoi(optarg);
+        break;
+      case 'V': // metadata recheck interval
+        recheck_ms = atoi(optarg);
+        break;
+      case 'P': // prefetch threshold
+        prefetch = atoi(optarg);
+        break;
+      case 'A': // acceptor CPUs
+        if (affinity_parse(optarg, &acceptor_cpus) < 0) {
+          fprintf(stderr, "%s", USAGE);
+          exit(1);
+        }
+        break;
+      case 'C': // worker CPUs
+        if (affinity_parse(optarg, &worker_cpus) < 0) {
+          fprintf(stderr, "%s", USAGE);
+          exit(1);
+        }
+        break;
+      case 'M': // admin port
+        admin_port = atoi(optarg);
+        break;
+      case 'x': // request tracing
+        trace_file = optarg;
+        break;
+      case 'Q': // full queue policy
+        if (strcmp(optarg, "block") == 0) {
+          queue_block = 1;
+        } else if (strcmp(optarg, "reject") == 0) {
+          queue_block = 0;
+        } else {
+          fprintf(stderr, "%s", USAGE);
+          exit(1);
+        }
+        break;
       default:
         fprintf(stderr, "%s", USAGE);
         exit(1);
@@ -82,11 +300,30 @@ int main(int argc, char **argv) {
 
   // Checks on parameters
   if (nthreads < 1) nthreads = 1; // need at least 1 thread
+  if (queue_depth < 0) queue_depth = 0;
+  if (cache_mb < 0) cache_mb = 0;
+  if (recheck_ms < 0) recheck_ms = 0;
+  if (prefetch < 0) prefetch = 0;
   if (content_delay > 5000000) {
     fprintf(stderr, "Content delay must be less than 5000000\n");
     exit(1);
   }
 
+  // Only the epoll loop keeps connections between requests - the blocking and
+  // io_uring loops answer without KEEPALIVE and close, so -k does nothing there
+  if (idle_timeout_set && idle_timeout > 0 && (!use_epoll || use_uring)) {
+    fprintf(stderr, "Keep-alive needs -e (and no -u), ignoring -k\n");
+  }
+
+  // Tracing - before any thread starts, so they all leave SIGUSR1 to the dumper
+  if (trace_file) {
+    trace_enable();
+    if (trace_dump_on(SIGUSR1, trace_file) < 0) {
+      fprintf(stderr, "Can't set up trace dumps\n");
+      exit(1);
+    }
+  }
+
   // Load the content mapping 
   content_init(content_map);
 
@@ -96,10 +333,51 @@ int main(int argc, char **argv) {
   gfserver_set_maxpending(&gfs, 24); // max pending connections in the queue
   gfserver_set_handler(&gfs, gfs_handler);
   gfserver_set_handlerarg(&gfs, NULL); // don't need handler args
+  gfserver_set_eventloop(&gfs, use_epoll);
+  gfserver_set_listeners(&gfs, nlisteners);
+  gfserver_set_uring(&gfs, use_uring);
+  gfserver_set_idle_timeout(&gfs, idle_timeout);
+  gfserver_set_header_timeout(&gfs, header_timeout);
+  gfserver_set_send_timeout(&gfs, send_timeout);
+  gfserver_set_writers(&gfs, nwriters);
+  gfserver_set_acceptor_cpus(&gfs, &acceptor_cpus);
+
+  // Where things will run, next to where the NIC's interrupts land
+  affinity_report(stderr, &acceptor_cpus, &worker_cpus);
 
   // Initialize the thread pool
+  set_queue_limit((size_t)queue_depth, queue_block);
+  set_sched_srpt(srpt);
+  set_content_cache((size_t)cache_mb << 20);
+  set_meta_recheck((unsigned)recheck_ms);
+  set_prefetch((unsigned)prefetch);
+  set_worker_cpus(&worker_cpus);
+  if (pool_max > 0) {
+    set_pool_bounds((size_t)pool_min, (size_t)pool_max);
+  }
   init_threads((size_t)nthreads);
 
+  // Metrics for scrapers, on a port of their own
+  if (admin_port > 0) {
+    register_metrics();
+    admin_route("/metrics", "text/plain; version=0.0.4", stats_write);
+    if (trace_file) {
+      admin_route("/trace", "application/octet-stream", trace_write);
+    }
+    if (admin_start((unsigned short)admin_port) < 0) {
+      fprintf(stderr, "Can't listen on admin port %d\n", admin_port);
+      exit(1);
+    }
+  }
+
+  // Now the thread that takes the shutdown signals, with everything it reports set up
+  pthread_t stop_tid;
+  if (pthread_create(&stop_tid, NULL, shutdown_thread, NULL) != 0) {
+    fprintf(stderr, "Can't start the shutdown thread\n");
+    exit(1);
+  }
+  pthread_detach(stop_tid);
+
   // Start serving
   gfserver_serve(&gfs);
 
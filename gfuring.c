@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "gfuring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Set up the ring and map the shared queues
+int gfuring_init(gfuring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = sys_setup(entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels let both rings share one mapping
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    if (single) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (!single) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+void gfuring_exit(gfuring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+int gfuring_register_buffers(gfuring_t *ring, const struct iovec *iov, unsigned count) {
+    return sys_register(ring->fd, IORING_REGISTER_BUFFERS, iov, count);
+}
+
+int gfuring_register_files(gfuring_t *ring, const int *fds, unsigned count) {
+    return sys_register(ring->fd, IORING_REGISTER_FILES, fds, count);
+}
+
+struct io_uring_sqe *gfuring_get_sqe(gfuring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= *ring->sq_mask + 1) {
+        return NULL;  // full, caller has to submit first
+    }
+
+    unsigned idx = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int gfuring_submit(gfuring_t *ring, unsigned wait_nr) {
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+
+    // Publish the new tail so the kernel sees the SQEs
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    do {
+        ret = sys_enter(ring->fd, to_submit, wait_nr, flags);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+struct io_uring_cqe *gfuring_peek_cqe(gfuring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void gfuring_cqe_seen(gfuring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void gfuring_prep_accept(struct io_uring_sqe *sqe, int fd, int fixed, unsigned long long data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->user_data = data;
+}
+
+void gfuring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, unsigned long long data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = (unsigned)len;
+    sqe->user_data = data;
+}
+
+void gfuring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len,
+                       int flags, unsigned long long data) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = (unsigned)len;
+    sqe->msg_flags = (unsigned)flags;
+    sqe->user_data = data;
+}
+
+void gfuring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, size_t len,
+                             off_t offset, int buf_index, unsigned long long data) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = (unsigned)len;
+    sqe->off = (unsigned long long)offset;
+    sqe->buf_index = (unsigned short)buf_index;
+    sqe->user_data = data;
+}
+
+void gfuring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts, unsigned long long data) {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+    sqe->off = 0;  // pure timer, not "after n completions"
+    sqe->user_data = data;
+}
+
+void gfuring_prep_timeout_remove(struct io_uring_sqe *sqe, unsigned long long target, unsigned long long data) {
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = data;
+}
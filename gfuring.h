@@ -0,0 +1,67 @@
+#ifndef GFURING_H
+#define GFURING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper - just enough for gfserver to batch accept, recv,
+// file reads and sends without pulling in liburing. Not thread safe; each
+// thread that wants to submit work owns its own ring.
+typedef struct {
+    int fd;
+
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;  // our local tail, published on submit
+
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // mappings so we can tear them down again
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} gfuring_t;
+
+// Returns 0 on success, -1 if io_uring isn't usable here (old kernel, seccomp, ...)
+int gfuring_init(gfuring_t *ring, unsigned entries);
+void gfuring_exit(gfuring_t *ring);
+
+int gfuring_register_buffers(gfuring_t *ring, const struct iovec *iov, unsigned count);
+int gfuring_register_files(gfuring_t *ring, const int *fds, unsigned count);
+
+// Next free SQE (zeroed), or NULL if the queue is full
+struct io_uring_sqe *gfuring_get_sqe(gfuring_t *ring);
+
+// Hand all queued SQEs to the kernel in one syscall and wait for wait_nr completions
+int gfuring_submit(gfuring_t *ring, unsigned wait_nr);
+
+// Completion queue access - peek returns NULL when empty
+struct io_uring_cqe *gfuring_peek_cqe(gfuring_t *ring);
+void gfuring_cqe_seen(gfuring_t *ring);
+
+// SQE helpers
+void gfuring_prep_accept(struct io_uring_sqe *sqe, int fd, int fixed, unsigned long long data);
+void gfuring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, unsigned long long data);
+void gfuring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len,
+                       int flags, unsigned long long data);
+void gfuring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, size_t len,
+                             off_t offset, int buf_index, unsigned long long data);
+
+// Timer that completes with -ETIME once ts has passed (ts must stay valid until then),
+// and a way to take it back early - the timer then completes with -ECANCELED
+void gfuring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts, unsigned long long data);
+void gfuring_prep_timeout_remove(struct io_uring_sqe *sqe, unsigned long long target, unsigned long long data);
+
+#endif
@@ -1,145 +1,1429 @@
+#define _GNU_SOURCE
+
 #include <pthread.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
+#include <zlib.h>
 
 #include "gfserver-student.h"
-#include "steque.h"
 #include "content.h"
+#include "objpool.h"
+#include "mpmc.h"
+#include "wsdeque.h"
+#include "ccache.h"
+#include "metacache.h"
+#include "affinity.h"
+#include "stats.h"
+#include "trace.h"
 
 #define MAX_THREADS 1024
-#define BUFSIZE 4096
+#define JOB_PATH_SIZE 256  // same limit the server puts on request paths
+#define JOB_SLAB 256
+#define INBOX_CAPACITY 4096   // per worker - with every inbox full the acceptor waits
+#define DEQUE_CAPACITY 256    // how much a worker takes on from its inbox at once
+#define CACHE_LINE 64
+
+// Adaptive pool tuning
+#define SUPERVISE_MS 100        // how often the supervisor looks at the queues
+#define GROW_WAIT_MS 5          // average queue wait that calls for more workers
+#define SHRINK_IDLE_MS 5000     // workers have to sit idle this long before one is retired
+
+// Shortest-first scheduling
+#define SRPT_CAPACITY 65536     // jobs the shared heap holds when no queue limit is set
+#define SRPT_AGE_NS_PER_KB 10000  // a job's place in line slips 10us per KB it's expected to send
+#define SIZE_CACHE_SLOTS 4096   // power of two
+
+#define FLIGHT_SHARDS 64  // locks for the in-flight lookup table
+#define META_RECHECK_MS 1000  // default for how long looked-up metadata is trusted
+
+// Compressed transfers
+#define DEFLATE_MIN 512          // smaller files aren't worth compressing
+#define DEFLATE_KEY " DEFLATE"   // cache key suffix for a file's compressed copy (paths have no spaces)
+#define DEFLATE_KEY_SIZE (JOB_PATH_SIZE + sizeof(DEFLATE_KEY))
+
+// Readahead and prefetching
+#define READAHEAD_MAX (4u << 20)  // how much of a newly opened file to start reading right away
+#define PREDICT_ROWS 1024         // power of two
+#define PREDICT_WAYS 2            // successors remembered per path
+#define PREDICT_LOCKS 64
+#define PREDICT_COUNT_MAX 64      // counts are halved here, so old habits fade
+#define PREDICT_MIN_COUNT 4       // default for how often a successor has to show up
+#define PREFETCH_QUEUE 64         // predictions waiting for the prefetch thread, extras are dropped
+
+// From gfserver.c - send a range of an open file to the client
+extern ssize_t gfs_sendfile(gfcontext_t **ctx, int fd, off_t offset, size_t len);
+
+// From gfserver.c - byte-range requests
+extern int gfs_get_range(gfcontext_t **ctx, size_t *offset, size_t *len);
+extern ssize_t gfs_sendheader_range(gfcontext_t **ctx, size_t offset, size_t len, size_t total);
+
+// From gfserver.c - send a body from memory, release(arg) once it's out
+extern ssize_t gfs_sendbuf(gfcontext_t **ctx, const void *buf, size_t len, void (*release)(void *), void *arg);
+
+// From gfserver.c - compressed bodies for clients that ask for them
+extern int gfs_accepts_deflate(gfcontext_t **ctx);
+extern ssize_t gfs_sendheader_deflate(gfcontext_t **ctx, size_t encoded_len, size_t original_len);
+
+// From gfserver.c - the request's id in trace stamps
+extern uint64_t gfs_trace_id(gfcontext_t **ctx);
 
 // Job Strucutre - keeps track of what each worker needs to do
-typedef struct {
+typedef struct job {
     gfcontext_t *ctx;   // the context for this request
-    char *path;      // path to the file we need to serve        
+    uint64_t queued_ns;  // when it was handed to the pool, for the wait time
+    uint64_t deadline;   // srpt: queued_ns pushed back by the expected size, smallest goes first
+    char path[JOB_PATH_SIZE];  // path to the file we need to serve
+
+    // file lookup - done by this job, or filled in by the one it waited on
+    int resolved;
+    int fd;
+    int stat_ok;
+    size_t size;
+    ccache_entry_t *cached;  // the file's bytes from the content cache (a reference), or NULL
+
+    // single flight: leaders are chained per shard, waiters per leader
+    uint64_t hash;
+    struct job *flight_next;
+    struct job *waiters;
 } job_t;
 
+// Jobs are recycled - allocated on the acceptor, freed on a worker
+static objpool_t *job_pool;
+
 // Gloval stuff for managing the thread pool
 
-static steque_t job_queue;
+// Each worker has its own queues instead of everyone sharing one. Acceptors drop
+// jobs in a worker's inbox; the worker moves a batch of them into its deque and
+// works through that. Workers with nothing to do steal from the others.
+//
+// The pool can grow and shrink. Slots are never torn down while serving: a
+// retired worker drains its own queues and exits, and anything that still
+// lands in them gets stolen. Growing reuses the slot with a new thread.
+enum { WORKER_OFF, WORKER_RUNNING, WORKER_RETIRING };
 
-static pthread_mutex_t queue_mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  queue_cv  = PTHREAD_COND_INITIALIZER;
+typedef struct {
+    wsdeque_t *deque;  // only the owner pushes/pops, others steal
+    mpmc_t *inbox;     // any acceptor pushes, the owner (or a thief) pops
+    pthread_t id;
+    int state;         // WORKER_*, only the supervisor moves it away from OFF
+    int joinable;      // a thread was started here and hasn't been joined yet
+    unsigned seed;     // picks steal victims
+    int cpu;           // where the slot's thread runs, -1 for anywhere
+} __attribute__((aligned(CACHE_LINE))) worker_t;
 
-static pthread_t worker_ids[MAX_THREADS];
-static size_t worker_count = 0;
+static worker_t workers[MAX_THREADS];
+static size_t worker_slots = 0;    // slots that have queues - only ever grows
+static size_t active_workers = 0;  // slots with a running (not retiring) worker
+static size_t next_worker = 0;  // round-robin starting point for placement
 
-static int shutting_down = 0; // flag to tell workers when to exit
+// CPUs to pin workers to, slot i on cpus[i % n] - empty leaves them to the scheduler
+static cpulist_t worker_cpus;
 
-// Worker thread function - what each thread runs
-static void *worker_thread(void *arg) {
-    (void)arg; //unused parameter
+// Pool bounds - equal unless set_pool_bounds asked for an adaptive pool
+static size_t pool_min = 0;
+static size_t pool_max = 0;
+
+// The supervisor thread resizes the pool
+static pthread_t supervisor_id;
+static int supervisor_running = 0;
+static pthread_mutex_t supervisor_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t supervisor_cv = PTHREAD_COND_INITIALIZER;
+
+// Queue wait since the supervisor last looked
+static uint64_t wait_total_ns = 0;
+static unsigned long wait_jobs = 0;
+
+// Resize metrics
+static unsigned long grow_count = 0;
+static unsigned long shrink_count = 0;
+
+// Jobs sitting in inboxes and deques, for the queue limit
+static size_t queued = 0;
+
+// Idle workers sleep here until a job shows up somewhere
+static pthread_mutex_t idle_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cv = PTHREAD_COND_INITIALIZER;
+static unsigned idle_workers = 0;
+static unsigned long idle_seq = 0;
+
+// Acceptors waiting for room sleep here until a worker takes a job
+static pthread_mutex_t room_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t room_cv = PTHREAD_COND_INITIALIZER;
+static unsigned room_waiters = 0;
+static unsigned long room_seq = 0;
+
+static int shutting_down = 0;
+
+// Optional shortest-first order. Instead of the per-worker queues, every job
+// goes into one heap ordered by arrival time plus a delay proportional to its
+// size. Small files overtake big ones, but a big file's deadline only moves
+// so far, so it can't be starved - it just waits its size's worth.
+static int srpt_enabled = 0;
+static pthread_mutex_t srpt_mtx = PTHREAD_MUTEX_INITIALIZER;
+static job_t **srpt_heap;
+static size_t srpt_len = 0;  // written under srpt_mtx, peeked at without it
+static size_t srpt_cap = 0;
+
+// File sizes seen by the workers, so the acceptor can guess a job's size
+// without touching the disk. Direct-mapped, one word per slot: a tag from the
+// path's hash in the top 24 bits and the size (up to 1 TB) in the rest.
+#define SIZE_BITS 40
+static uint64_t size_cache[SIZE_CACHE_SLOTS];
+
+// Single-flight lookups. The first job for a path does the content_get (and
+// its delay) and fstat; jobs for the same path that show up meanwhile wait on
+// it without holding a worker, then go back in the queues with the answer.
+// The bytes themselves come out of the page cache after the first read.
+typedef struct {
+    pthread_mutex_t lock;
+    job_t *leaders;  // jobs with a lookup under way
+} flight_shard_t;
+
+static flight_shard_t flights[FLIGHT_SHARDS];
+static unsigned long coalesced_count = 0;  // lookups saved
+
+// File contents kept in memory, so hot files skip content_get, fstat and the
+// read altogether. Filled by whichever job looks a file up first.
+static size_t cache_budget = 0;
+static ccache_t *content_cache;
+
+// fd, size and mtime from earlier lookups, so even files too big for the
+// content cache skip content_get and fstat. Rechecked with an fstat every
+// meta_recheck_ms; a change also drops the file's cached contents.
+static unsigned meta_recheck_ms = META_RECHECK_MS;
+static metacache_t *meta_cache;
+
+// Next-file predictor. A row belongs to one path (by hash) and counts the
+// paths that came right after it in the request stream. Once one of them has
+// followed at least predict_min times, and more often than not, a request for
+// the row's path has the prefetch thread look it up ahead of time - into the
+// metadata and content caches, or at least the page cache. The stream is all
+// clients interleaved, so only the stronger patterns stand out.
+typedef struct {
+    uint64_t hash;
+    unsigned count;
+    char path[JOB_PATH_SIZE];
+} predict_next_t;
+
+typedef struct {
+    uint64_t tag;  // hash of the path this row is about, 0 if unused
+    predict_next_t next[PREDICT_WAYS];
+} predict_row_t;
+
+static unsigned predict_min = PREDICT_MIN_COUNT;  // 0 turns prediction off
+static predict_row_t *predict_rows;
+static pthread_mutex_t predict_locks[PREDICT_LOCKS];
+static uint64_t predict_last = 0;  // hash of the previous request's path
+static mpmc_t *prefetch_queue;
+static pthread_t prefetch_id;
+static int prefetch_running = 0;
+static unsigned long prefetch_count = 0;
+
+// Admission control - 0 means no limit of our own (just the inbox sizes)
+static size_t queue_limit = 0;
+static int queue_block = 0;   // full queue: 1 = make the acceptor wait, 0 = reject right away
+
+// Overload counters
+static unsigned long shed_count = 0;     // requests turned away with GF_ERROR
+static unsigned long blocked_count = 0;  // times the acceptor had to wait for room
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t worker_load(const worker_t *w) {
+    return mpmc_size(w->inbox) + wsdeque_size(w->deque);
+}
+
+static int worker_state(const worker_t *w) {
+    return __atomic_load_n(&w->state, __ATOMIC_ACQUIRE);
+}
+
+static size_t slot_count() {
+    return __atomic_load_n(&worker_slots, __ATOMIC_ACQUIRE);
+}
+
+// FNV-1a
+static uint64_t path_hash(const char *path) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *path; path++) {
+        h = (h ^ (unsigned char)*path) * 1099511628211ull;
+    }
+    return h;
+}
+
+static void size_cache_put(const char *path, size_t size) {
+    uint64_t h = path_hash(path);
+    if (size >= (1ull << SIZE_BITS)) {
+        size = (1ull << SIZE_BITS) - 1;
+    }
+    uint64_t word = (h >> SIZE_BITS << SIZE_BITS) | size;
+    __atomic_store_n(&size_cache[h & (SIZE_CACHE_SLOTS - 1)], word, __ATOMIC_RELAXED);
+}
+
+// Size last seen for this path, or 0 if we don't know it (unknown files go in as small)
+static size_t size_cache_get(const char *path) {
+    uint64_t h = path_hash(path);
+    uint64_t word = __atomic_load_n(&size_cache[h & (SIZE_CACHE_SLOTS - 1)], __ATOMIC_RELAXED);
+    if (word >> SIZE_BITS != h >> SIZE_BITS) {
+        return 0;
+    }
+    return (size_t)(word & ((1ull << SIZE_BITS) - 1));
+}
+
+// Binary min-heap on deadline, srpt_mtx held
+static void heap_swap(size_t a, size_t b) {
+    job_t *t = srpt_heap[a];
+    srpt_heap[a] = srpt_heap[b];
+    srpt_heap[b] = t;
+}
+
+static int srpt_push(job_t *job) {
+    pthread_mutex_lock(&srpt_mtx);
+    if (srpt_len == srpt_cap) {
+        pthread_mutex_unlock(&srpt_mtx);
+        return -1;
+    }
+    size_t i = srpt_len;
+    srpt_heap[i] = job;
+    while (i > 0 && srpt_heap[(i - 1) / 2]->deadline > srpt_heap[i]->deadline) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    __atomic_store_n(&srpt_len, srpt_len + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&srpt_mtx);
+    return 0;
+}
+
+static job_t *srpt_pop() {
+    if (__atomic_load_n(&srpt_len, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&srpt_mtx);
+    job_t *job = NULL;
+    if (srpt_len > 0) {
+        job = srpt_heap[0];
+        size_t n = srpt_len - 1;
+        srpt_heap[0] = srpt_heap[n];
+        __atomic_store_n(&srpt_len, n, __ATOMIC_SEQ_CST);
+
+        size_t i = 0;
+        while (1) {
+            size_t l = 2 * i + 1, r = l + 1, m = i;
+            if (l < n && srpt_heap[l]->deadline < srpt_heap[m]->deadline) {
+                m = l;
+            }
+            if (r < n && srpt_heap[r]->deadline < srpt_heap[m]->deadline) {
+                m = r;
+            }
+            if (m == i) {
+                break;
+            }
+            heap_swap(i, m);
+            i = m;
+        }
+    }
+    pthread_mutex_unlock(&srpt_mtx);
+    return job;
+}
+
+// Place in line for a job: its arrival time plus its expected size's worth of delay
+static void srpt_tag(job_t *job) {
+    size_t size = size_cache_get(job->path);
+    size_t off, len;
+    if (gfs_get_range(&job->ctx, &off, &len)) {
+        size = len && len < size ? len : (off < size ? size - off : 0);
+    }
+    job->deadline = job->queued_ns + (uint64_t)(size >> 10) * SRPT_AGE_NS_PER_KB;
+}
+
+// Wake one idle worker if there is one. The fence pairs with the one in
+// worker_idle: either we see it counted as idle or it sees our job.
+static void wake_idle() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idle_workers, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&idle_mtx);
+        idle_seq++;
+        pthread_cond_signal(&idle_cv);
+        pthread_mutex_unlock(&idle_mtx);
+    }
+}
+
+// A job left the queues - note how long it waited and let a waiting acceptor retry.
+// Waiters a flight put back come through here a second time; their request was
+// already stamped and counted on the way out the first time.
+static void job_taken(job_t *job) {
+    uint64_t now = now_ns();
+    uint64_t wait = now - job->queued_ns;
+    if (!job->resolved) {
+        stats_record(STAT_QUEUE_WAIT, wait);
+        trace_record_at(TRACE_DEQUEUE, gfs_trace_id(&job->ctx), 0, now);
+    }
+    __atomic_add_fetch(&wait_total_ns, wait, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&wait_jobs, 1, __ATOMIC_RELAXED);
+
+    __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&room_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&room_mtx);
+        room_seq++;
+        pthread_cond_broadcast(&room_cv);
+        pthread_mutex_unlock(&room_mtx);
+    }
+}
+
+// Hand a job to a running worker: the less loaded of the next round-robin pick
+// and the one after it, falling back to anyone with room. -1 if every inbox is full.
+static int place_job(job_t *job) {
+    if (srpt_enabled) {
+        if (srpt_push(job) < 0) {
+            return -1;
+        }
+        wake_idle();
+        return 0;
+    }
+
+    size_t n = slot_count();
+    size_t start = __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % n;
+
+    worker_t *best = NULL;
+    size_t seen = 0;
+    for (size_t i = 0; i < n && seen < 2; i++) {
+        worker_t *w = &workers[(start + i) % n];
+        if (worker_state(w) != WORKER_RUNNING) {
+            continue;
+        }
+        if (!best || worker_load(w) < worker_load(best)) {
+            best = w;
+        }
+        seen++;
+    }
+    if (best && mpmc_try_push(best->inbox, job) == 0) {
+        wake_idle();
+        return 0;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        worker_t *w = &workers[(start + i) % n];
+        if (worker_state(w) == WORKER_RUNNING && mpmc_try_push(w->inbox, job) == 0) {
+            wake_idle();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Reserve a spot under the queue limit and place the job. -1 if it didn't fit.
+static int admit_job(job_t *job) {
+    if (queue_limit && __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST) > queue_limit) {
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    if (!queue_limit) {
+        __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    }
+    if (place_job(job) < 0) {
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    return 0;
+}
 
+// Block until a worker frees up room for the job. -1 if we're shutting down.
+static int admit_job_wait(job_t *job) {
     while (1) {
-        // lock the queue to check for jobs
-        pthread_mutex_lock(&queue_mtx);
+        pthread_mutex_lock(&room_mtx);
+        __atomic_add_fetch(&room_waiters, 1, __ATOMIC_SEQ_CST);
+        unsigned long seq = room_seq;
+        pthread_mutex_unlock(&room_mtx);
+
+        // Retry after announcing ourselves so a job taken in between isn't missed
+        int rc = admit_job(job);
+
+        pthread_mutex_lock(&room_mtx);
+        while (rc < 0 && seq == room_seq && !__atomic_load_n(&shutting_down, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&room_cv, &room_mtx);
+        }
+        __atomic_sub_fetch(&room_waiters, 1, __ATOMIC_SEQ_CST);
+        int stop = __atomic_load_n(&shutting_down, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&room_mtx);
+
+        if (rc == 0) {
+            return 0;
+        }
+        if (stop) {
+            return -1;
+        }
+    }
+}
+
+// Next job for this worker: its own deque, then a batch from its inbox, then
+// whatever it can steal from the others (unless it's retiring). NULL if there's
+// nothing it can take.
+static job_t *find_job(worker_t *self) {
+    if (srpt_enabled) {
+        return srpt_pop();  // everything's in the shared heap, nothing to steal
+    }
+
+    job_t *job = wsdeque_pop(self->deque);
+    if (job) {
+        return job;
+    }
+
+    // Take a batch off the inbox, pushed newest-first so we pop them oldest-first
+    job_t *batch[DEQUE_CAPACITY];
+    size_t count = 0;
+    while (count < DEQUE_CAPACITY && (batch[count] = mpmc_try_pop(self->inbox))) {
+        count++;
+    }
+    if (count > 0) {
+        while (count > 1) {
+            wsdeque_push(self->deque, batch[--count]);
+        }
+        if (wsdeque_size(self->deque) > 0) {
+            wake_idle();  // there's more than we can do right now - let someone steal it
+        }
+        return batch[0];
+    }
+
+    if (worker_state(self) != WORKER_RUNNING) {
+        return NULL;
+    }
+
+    // Steal - older work first from the victim's deque, then straight out of its inbox.
+    // Retired slots too, an acceptor may have got a job in just as their worker left.
+    size_t n = slot_count();
+    size_t start = rand_r(&self->seed) % n;
+    for (size_t i = 0; i < n; i++) {
+        worker_t *victim = &workers[(start + i) % n];
+        if (victim == self) {
+            continue;
+        }
+        if ((job = wsdeque_steal(victim->deque)) || (job = mpmc_try_pop(victim->inbox))) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static int any_work() {
+    if (__atomic_load_n(&srpt_len, __ATOMIC_SEQ_CST) > 0) {
+        return 1;
+    }
+    size_t n = slot_count();
+    for (size_t i = 0; i < n; i++) {
+        if (worker_load(&workers[i]) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-        // wait if there's no work and we're not shutting down
-        while (steque_isempty(&job_queue) && !shutting_down) {
-            pthread_cond_wait(&queue_cv, &queue_mtx);
+// Nothing to do - sleep until a job is placed. 0 to go look again, -1 to exit.
+static int worker_idle(worker_t *self) {
+    pthread_mutex_lock(&idle_mtx);
+    __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long seq = idle_seq;
+
+    int stop = 0;
+    while (!any_work()) {
+        if (__atomic_load_n(&shutting_down, __ATOMIC_ACQUIRE)) {
+            stop = 1;  // everything's drained
+            break;
+        }
+        if (seq != idle_seq || worker_state(self) != WORKER_RUNNING) {
+            break;  // woken for a job someone else may have taken already, look anyway
         }
+        pthread_cond_wait(&idle_cv, &idle_mtx);
+    }
+
+    __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&idle_mtx);
+    return stop ? -1 : 0;
+}
+
+// Wait on a lookup already under way for the same path. Returns 1 if there is
+// one - the job is parked on it if wait is set (the leader takes it from
+// there) and left alone if not. 0 if this job leads.
+static int flight_join(job_t *job, int wait) {
+    job->hash = path_hash(job->path);
+    flight_shard_t *shard = &flights[job->hash % FLIGHT_SHARDS];
 
-        // check if we should exit
-        if (shutting_down && steque_isempty(&job_queue)) {
-            pthread_mutex_unlock(&queue_mtx);
-            break; // exit the thread
+    pthread_mutex_lock(&shard->lock);
+    for (job_t *leader = shard->leaders; leader; leader = leader->flight_next) {
+        if (leader->hash == job->hash && strcmp(leader->path, job->path) == 0) {
+            if (!wait) {
+                pthread_mutex_unlock(&shard->lock);
+                return 1;
+            }
+            job->flight_next = leader->waiters;
+            leader->waiters = job;
+            pthread_mutex_unlock(&shard->lock);
+            __atomic_add_fetch(&coalesced_count, 1, __ATOMIC_RELAXED);
+            return 1;
         }
+    }
+    job->waiters = NULL;
+    job->flight_next = shard->leaders;
+    shard->leaders = job;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
 
-        // grab a job from the queue
-        job_t *job = steque_front(&job_queue);
-        steque_pop(&job_queue);
+static void serve_job(job_t *job);
 
-        pthread_mutex_unlock(&queue_mtx);
+// Lookup's done - pass the answer to everyone who waited and put them back in
+// the queues so any worker can send their responses
+static void flight_land(job_t *leader) {
+    flight_shard_t *shard = &flights[leader->hash % FLIGHT_SHARDS];
 
-        // now do the work for this job
-        int fd = content_get(job->path);
+    pthread_mutex_lock(&shard->lock);
+    job_t **link = &shard->leaders;
+    while (*link != leader) {
+        link = &(*link)->flight_next;
+    }
+    *link = leader->flight_next;
+    job_t *waiter = leader->waiters;
+    pthread_mutex_unlock(&shard->lock);
+
+    while (waiter) {
+        job_t *next = waiter->flight_next;
+        waiter->resolved = 1;
+        waiter->fd = leader->fd;
+        waiter->stat_ok = leader->stat_ok;
+        waiter->size = leader->size;
+        waiter->cached = leader->cached;
+        if (waiter->cached) {
+            ccache_ref(waiter->cached);
+        }
 
-        if (fd < 0) {
-            // File not found - send error response
-            gfs_sendheader(&job->ctx, GF_FILE_NOT_FOUND, 0); 
+        // already admitted once, so no limit check - just count it as queued again
+        waiter->queued_ns = now_ns();
+        __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+        if (place_job(waiter) < 0) {
+            __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+            serve_job(waiter);  // queues are full, send it ourselves
+        }
+        waiter = next;
+    }
+}
+
+// Content cache key for path's compressed copy
+static void deflate_key(const char *path, char key[DEFLATE_KEY_SIZE]) {
+    snprintf(key, DEFLATE_KEY_SIZE, "%s%s", path, DEFLATE_KEY);
+}
+
+// Get the file's bytes into the content cache, if it's small enough to go there
+static void cache_contents(job_t *job) {
+    if (content_cache && job->size <= ccache_max_size(content_cache)) {
+        job->cached = ccache_fill(content_cache, job->path, job->fd, job->size);
+    }
+}
+
+// Tell the kernel the file's going to be read front to back, and get the
+// start of it coming off the disk now rather than a page fault at a time.
+// Once per file - when it's first looked up, and again if it changes.
+static void warm_file(int fd, size_t size) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, (off_t)(size < READAHEAD_MAX ? size : READAHEAD_MAX), POSIX_FADV_WILLNEED);
+}
+
+// Find the file - content_get and fstat, results go in the job (and the
+// metadata cache). Small enough files get read into the content cache on the way.
+static void lookup_job(job_t *job) {
+    struct stat st;
+
+    uint64_t start = now_ns();
+    job->fd = content_get(job->path);
+    uint64_t got = now_ns();
+    stats_record(STAT_CONTENT_GET, got - start);
+
+    job->stat_ok = job->fd >= 0 && fstat(job->fd, &st) == 0;
+    if (job->fd >= 0) {
+        stats_record(STAT_FSTAT, now_ns() - got);
+    }
+    job->size = job->stat_ok ? (size_t)st.st_size : 0;
+    job->resolved = 1;
+
+    if (!job->stat_ok) {
+        return;
+    }
+    if (metacache_put(meta_cache, job->path, job->fd, &st)) {
+        warm_file(job->fd, job->size);
+    }
+    if (srpt_enabled) {
+        size_cache_put(job->path, job->size);  // so the next request for it knows its place
+    }
+    cache_contents(job);
+}
+
+// The file's bytes from the content cache, if they're there and from the
+// file as it is now
+static void cached_contents(job_t *job) {
+    if (content_cache && (job->cached = ccache_get(content_cache, job->path)) &&
+        ccache_size(job->cached) != job->size) {
+        // filled from the old file just as it changed - the next recheck sorts it out
+        ccache_release(job->cached);
+        job->cached = NULL;
+    }
+}
+
+// What lookup_cached found
+#define LOOKUP_MISS 0  // never looked up, or dropped out of the metadata cache
+#define LOOKUP_HIT 1   // the job's ready to serve
+#define LOOKUP_FILL 2  // known, but the bytes belong in the content cache and aren't there
+
+// Looked up before - take the answer from the metadata cache, and the bytes
+// from the content cache when they're there. No content_get, and no fstat
+// unless the entry is due a recheck. Reading the bytes in is left to the
+// flight leader, so a burst of requests for a file fills the cache once.
+static int lookup_cached(job_t *job) {
+    metacache_info_t info;
+    if (!metacache_get(meta_cache, job->path, &info)) {
+        return LOOKUP_MISS;
+    }
+    job->fd = info.fd;
+    job->stat_ok = 1;
+    job->size = info.size;
+    job->resolved = 1;
+
+    if (info.changed) {
+        warm_file(job->fd, job->size);
+
+        // whatever we had in memory is out of date now
+        if (content_cache) {
+            char key[DEFLATE_KEY_SIZE];
+            deflate_key(job->path, key);
+            ccache_invalidate(content_cache, job->path);
+            ccache_invalidate(content_cache, key);
+        }
+        if (srpt_enabled) {
+            size_cache_put(job->path, job->size);
+        }
+    }
+
+    cached_contents(job);
+    if (!job->cached && content_cache && job->size <= ccache_max_size(content_cache)) {
+        return LOOKUP_FILL;
+    }
+    return LOOKUP_HIT;
+}
+
+// Flight leader's half of LOOKUP_FILL - the last leader may have filled it
+// just before we joined, so look once more before reading it in
+static void fill_contents(job_t *job) {
+    cached_contents(job);
+    if (!job->cached) {
+        cache_contents(job);
+    }
+}
+
+// Send part of the file, from the cache when we have it there
+static void send_body(job_t *job, size_t off, size_t len) {
+    if (job->cached) {
+        ccache_entry_t *e = job->cached;
+        job->cached = NULL;  // the send holds on to it now
+        gfs_sendbuf(&job->ctx, ccache_data(e) + off, len, ccache_release, e);
+    } else {
+        gfs_sendfile(&job->ctx, job->fd, (off_t)off, len);
+    }
+}
+
+// The file's compressed copy, from the content cache or made now from the
+// bytes we have there. NULL if the file isn't in memory, is too small to
+// bother with, or doesn't compress - that last answer is cached too, as an
+// empty entry, so nobody tries again until the file changes.
+static ccache_entry_t *deflated_copy(job_t *job) {
+    if (!job->cached || job->size < DEFLATE_MIN) {
+        return NULL;
+    }
+
+    char key[DEFLATE_KEY_SIZE];
+    deflate_key(job->path, key);
+    ccache_entry_t *z = ccache_peek(content_cache, key);  // the file itself was the hit
+    if (!z) {
+        uLongf zlen = compressBound(job->size);
+        Bytef *buf = malloc(zlen);
+        if (!buf) {
+            return NULL;
+        }
+        if (compress2(buf, &zlen, (const Bytef *)ccache_data(job->cached), job->size,
+                      Z_BEST_COMPRESSION) != Z_OK || zlen >= job->size - job->size / 8) {
+            zlen = 0;  // saves less than an eighth - send it as it is
+        }
+        z = ccache_put(content_cache, key, buf, zlen);
+        free(buf);
+        if (!z) {
+            return NULL;
+        }
+    }
+
+    if (ccache_size(z) == 0) {
+        ccache_release(z);
+        return NULL;
+    }
+    return z;
+}
+
+// Send the response for a looked-up job, then recycle it
+static void serve_job(job_t *job) {
+    int fd = job->fd;
+    size_t off, len;
+    ccache_entry_t *z;
+
+    if (fd < 0) {
+        // File not found - send error response
+        gfs_sendheader(&job->ctx, GF_FILE_NOT_FOUND, 0); 
+    }
+    else if (!job->stat_ok) {
+        // Couldn't stat file - send error response
+        gfs_sendheader(&job->ctx, GF_ERROR, 0); 
+    }
+    else if (gfs_get_range(&job->ctx, &off, &len)) {
+        // Just a slice - clamp it to the file, a start past the end is the client's mistake
+        size_t size = job->size;
+        if (off > size) {
+            gfs_sendheader(&job->ctx, GF_INVALID, 0);
         }
         else {
-            struct stat st;
+            if (len == 0 || len > size - off) {
+                len = size - off;  // 0 means "to the end"
+            }
+            gfs_sendheader_range(&job->ctx, off, len, size);
+            send_body(job, off, len);
+        }
+    }
+    else if (gfs_accepts_deflate(&job->ctx) && (z = deflated_copy(job))) {
+        // Compressed copy - the header gives both its length and the file's
+        gfs_sendheader_deflate(&job->ctx, ccache_size(z), job->size);
+        gfs_sendbuf(&job->ctx, ccache_data(z), ccache_size(z), ccache_release, z);
+    }
+    else {
+        // Send the OK header with the file size
+        gfs_sendheader(&job->ctx, GF_OK, job->size); 
+
+        // Stream the body (handed to a writer thread, or sent right here)
+        send_body(job, 0, job->size);
+    }
+    // not closing because content.c does that 
+
+    // The context is released once the response completes. If it's still
+    // here the response never finished, so drop the connection.
+    if (job->ctx) {
+        gfs_abort(&job->ctx);
+    }
+    if (job->cached) {
+        ccache_release(job->cached);  // went unused (bad range)
+    }
+
+    // clean up the job
+    objpool_put(job_pool, job);
+}
+
+// Count path following whatever was requested just before it
+static void predict_learn(uint64_t prev, uint64_t hash, const char *path) {
+    size_t r = prev & (PREDICT_ROWS - 1);
+    predict_row_t *row = &predict_rows[r];
+
+    pthread_mutex_lock(&predict_locks[r % PREDICT_LOCKS]);
+    if (row->tag != prev) {
+        memset(row, 0, sizeof(*row));  // the slot's changed hands
+        row->tag = prev;
+    }
+
+    // Bump it if we know it, otherwise it takes the place of the weakest one
+    predict_next_t *slot = NULL;
+    predict_next_t *weakest = &row->next[0];
+    for (int i = 0; i < PREDICT_WAYS; i++) {
+        predict_next_t *n = &row->next[i];
+        if (n->count && n->hash == hash) {
+            slot = n;
+            break;
+        }
+        if (n->count < weakest->count) {
+            weakest = n;
+        }
+    }
+    if (!slot) {
+        slot = weakest;
+        slot->hash = hash;
+        slot->count = 0;
+        snprintf(slot->path, sizeof(slot->path), "%s", path);
+    }
+
+    if (++slot->count >= PREDICT_COUNT_MAX) {
+        for (int i = 0; i < PREDICT_WAYS; i++) {
+            row->next[i].count /= 2;
+        }
+    }
+    pthread_mutex_unlock(&predict_locks[r % PREDICT_LOCKS]);
+}
+
+// The path that usually comes after this one, if there's a clear favourite
+static int predict_next(uint64_t hash, char *out) {
+    size_t r = hash & (PREDICT_ROWS - 1);
+    predict_row_t *row = &predict_rows[r];
+    int found = 0;
 
-            if (fstat(fd, &st) < 0) {
-                // Couldn't stat file - send error response
-                gfs_sendheader(&job->ctx, GF_ERROR, 0); 
+    pthread_mutex_lock(&predict_locks[r % PREDICT_LOCKS]);
+    if (row->tag == hash) {
+        predict_next_t *best = &row->next[0];
+        unsigned total = 0;
+        for (int i = 0; i < PREDICT_WAYS; i++) {
+            total += row->next[i].count;
+            if (row->next[i].count > best->count) {
+                best = &row->next[i];
             }
-            else {
-                // Send the OK header with the file size
-                gfs_sendheader(&job->ctx, GF_OK, st.st_size); 
+        }
+        if (best->count >= predict_min && best->count * 2 > total) {
+            memcpy(out, best->path, JOB_PATH_SIZE);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&predict_locks[r % PREDICT_LOCKS]);
+    return found;
+}
 
-                char buf[BUFSIZE];
-                off_t offset = 0;
-                off_t remaining = st.st_size;
+// A new request came in for this job's path: learn from it, and if it has a
+// likely successor, queue that up for the prefetch thread
+static void predict_observe(job_t *job) {
+    if (!predict_rows) {
+        return;
+    }
 
-                // Read the file in chunks
-                while (remaining > 0) {
+    uint64_t hash = path_hash(job->path);
+    uint64_t prev = __atomic_exchange_n(&predict_last, hash, __ATOMIC_RELAXED);
+    if (prev && prev != hash) {
+        predict_learn(prev, hash, job->path);
+    }
 
-                    size_t chunk = remaining > BUFSIZE ? BUFSIZE : remaining;
+    char next[JOB_PATH_SIZE];
+    job_t *ahead;
+    if (!predict_next(hash, next) || !(ahead = objpool_get(job_pool))) {
+        return;
+    }
+    memcpy(ahead->path, next, sizeof(next));
+    if (mpmc_try_push(prefetch_queue, ahead) < 0) {
+        objpool_put(job_pool, ahead);  // the prefetcher's behind anyway
+    }
+}
 
-                    ssize_t bytes = pread(fd, buf, chunk, offset);
+// Prefetch thread - looks up predicted paths like a request would, minus the
+// response. It's a leader like any other, so requests for the file that turn
+// up meanwhile wait on it instead of looking it up again.
+static void *prefetch_thread(void *arg) {
+    (void)arg;
+    job_t *job;
 
-                    if (bytes <= 0)
-                        break; // error or EDF
+    while ((job = mpmc_pop(prefetch_queue))) {
+        job->ctx = NULL;
+        job->resolved = 0;
+        job->cached = NULL;
 
-                    ssize_t sent = gfs_send(&job->ctx, buf, bytes); 
+        int found = lookup_cached(job);
+        if (found != LOOKUP_HIT && !flight_join(job, 0)) {
+            if (found == LOOKUP_FILL) {
+                fill_contents(job);
+            } else {
+                lookup_job(job);
+            }
+            flight_land(job);
+        }
+        __atomic_add_fetch(&prefetch_count, 1, __ATOMIC_RELAXED);
 
-                    if (sent <= 0)
-                        break; // client disconnected maybe?
+        if (job->cached) {
+            ccache_release(job->cached);
+        }
+        objpool_put(job_pool, job);
+    }
+    return NULL;
+}
 
-                    offset    += sent;
-                    remaining -= sent;
+// Worker thread function - what each thread runs
+static void *worker_thread(void *arg) {
+    worker_t *self = arg;
+
+    while (1) {
+        // Told to retire - finish what's ours, then leave
+        if (worker_state(self) == WORKER_RETIRING && worker_load(self) == 0) {
+            break;
+        }
+
+        job_t *job = find_job(self);
+        if (!job) {
+            // sleeps while there's nothing to do
+            if (worker_idle(self) < 0) {
+                break; // exit the thread
+            }
+            continue;
+        }
+        job_taken(job);
+
+        // now do the work for this job - unless the same file is being looked up already
+        if (!job->resolved) {
+            predict_observe(job);
+            int found = lookup_cached(job);
+            if (found != LOOKUP_HIT) {
+                if (flight_join(job, 1)) {
+                    continue;
+                }
+                if (found == LOOKUP_FILL) {
+                    fill_contents(job);
+                } else {
+                    lookup_job(job);
                 }
+                flight_land(job);
             }
-            // not closing because content.c does that 
         }
 
-        // Signal we are done with this context
-        job->ctx = NULL;
+        serve_job(job);
+    }
+
+    __atomic_store_n(&self->state, WORKER_OFF, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Start a worker on the next free slot. Supervisor (or init) only. -1 if there's
+// no slot or we can't get its queues or thread.
+static int start_worker() {
+    size_t n = slot_count();
+    worker_t *w = NULL;
+
+    // Reuse a retired slot before opening a new one
+    for (size_t i = 0; i < n; i++) {
+        if (worker_state(&workers[i]) == WORKER_OFF) {
+            w = &workers[i];
+            break;
+        }
+    }
+
+    if (w && w->joinable) {
+        pthread_join(w->id, NULL);  // already done, it set OFF on its way out
+        w->joinable = 0;
+    }
+
+    if (!w) {
+        if (n >= MAX_THREADS) {
+            return -1;
+        }
+        w = &workers[n];
+        w->cpu = worker_cpus.n ? worker_cpus.cpus[n % (size_t)worker_cpus.n] : -1;
 
-        // clean up the job
-        free(job->path);
-        free(job);
+        // Allocate the queues from the worker's CPU so they land on its node
+        cpu_set_t saved;
+        int moved = w->cpu >= 0 && affinity_enter(w->cpu, &saved) == 0;
+        w->deque = wsdeque_create(DEQUE_CAPACITY);
+        w->inbox = mpmc_create(INBOX_CAPACITY);
+        if (moved) {
+            affinity_leave(&saved);
+        }
+        if (!w->deque || !w->inbox) {
+            wsdeque_destroy(w->deque);
+            mpmc_destroy(w->inbox);
+            w->deque = NULL;
+            w->inbox = NULL;
+            return -1;
+        }
+        w->seed = (unsigned)n * 2654435761u + 1;
+        w->state = WORKER_OFF;
+        // the queues have to exist before anyone sees the slot
+        __atomic_store_n(&worker_slots, n + 1, __ATOMIC_RELEASE);
     }
 
+    // Pinned from the first instruction, so its own allocations are node-local too
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (w->cpu >= 0) {
+        affinity_attr_cpu(&attr, w->cpu);
+    }
+
+    __atomic_store_n(&w->state, WORKER_RUNNING, __ATOMIC_RELEASE);
+    int rc = pthread_create(&w->id, &attr, worker_thread, w);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        __atomic_store_n(&w->state, WORKER_OFF, __ATOMIC_RELEASE);
+        return -1;
+    }
+    w->joinable = 1;
+    __atomic_add_fetch(&active_workers, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Ask the running worker in the highest slot to finish up and leave.
+// Supervisor only. -1 if nobody's running.
+static int retire_worker() {
+    for (size_t i = slot_count(); i-- > 0; ) {
+        if (worker_state(&workers[i]) == WORKER_RUNNING) {
+            __atomic_store_n(&workers[i].state, WORKER_RETIRING, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&active_workers, 1, __ATOMIC_RELAXED);
+
+            // it may be asleep
+            pthread_mutex_lock(&idle_mtx);
+            pthread_cond_broadcast(&idle_cv);
+            pthread_mutex_unlock(&idle_mtx);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Supervisor thread - every SUPERVISE_MS look at the queue wait time and depth.
+// Jobs waiting with nobody idle means we're short of workers: grow by a quarter.
+// Workers sitting idle for SHRINK_IDLE_MS straight means we have too many: retire one.
+static void *supervisor_thread(void *arg) {
+    (void)arg;
+    uint64_t idle_since = 0;  // 0 = somebody was busy last time we looked
+    struct timespec deadline;
+
+    pthread_mutex_lock(&supervisor_mtx);
+    while (supervisor_running) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SUPERVISE_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&supervisor_cv, &supervisor_mtx, &deadline);
+        if (!supervisor_running) {
+            break;
+        }
+
+        uint64_t total = __atomic_exchange_n(&wait_total_ns, 0, __ATOMIC_RELAXED);
+        unsigned long jobs = __atomic_exchange_n(&wait_jobs, 0, __ATOMIC_RELAXED);
+        double wait_ms = jobs ? total / 1e6 / jobs : 0;
+        size_t depth = __atomic_load_n(&queued, __ATOMIC_RELAXED);
+        unsigned idle = __atomic_load_n(&idle_workers, __ATOMIC_RELAXED);
+        size_t active = __atomic_load_n(&active_workers, __ATOMIC_RELAXED);
+        uint64_t now = now_ns();
+
+        if (idle == 0 && active < pool_max && (wait_ms >= GROW_WAIT_MS || depth >= active)) {
+            size_t step = active / 4 ? active / 4 : 1;
+            if (step > pool_max - active) {
+                step = pool_max - active;
+            }
+            size_t started = 0;
+            while (started < step && start_worker() == 0) {
+                started++;
+            }
+            if (started) {
+                __atomic_add_fetch(&grow_count, 1, __ATOMIC_RELAXED);
+                fprintf(stderr, "pool: grow %zu -> %zu workers (queued %zu, avg wait %.1f ms)\n",
+                        active, active + started, depth, wait_ms);
+            }
+            idle_since = 0;
+        }
+        else if (idle > 0 && depth == 0) {
+            if (!idle_since) {
+                idle_since = now;
+            }
+            else if (active > pool_min && now - idle_since >= SHRINK_IDLE_MS * 1000000ull) {
+                if (retire_worker() == 0) {
+                    __atomic_add_fetch(&shrink_count, 1, __ATOMIC_RELAXED);
+                    fprintf(stderr, "pool: shrink %zu -> %zu workers (%u idle for %d ms)\n",
+                            active, active - 1, idle, SHRINK_IDLE_MS);
+                }
+                idle_since = now;  // one at a time, then wait out another cooldown
+            }
+        }
+        else {
+            idle_since = 0;
+        }
+    }
+    pthread_mutex_unlock(&supervisor_mtx);
+
     return NULL;
 }
 
 
+// Cap the number of queued jobs. When the queue is full new requests either get
+// an immediate GF_ERROR or (block != 0) the acceptor stalls until a worker frees
+// a slot, which leaves the pressure to the listen backlog.
+void set_queue_limit(size_t limit, int block) {
+    queue_limit = limit;
+    queue_block = block;
+}
+
+// Serve queued jobs shortest-first (with aging) instead of in arrival order.
+// Has to be called before init_threads.
+void set_sched_srpt(int enabled) {
+    srpt_enabled = enabled;
+}
+
+// Keep up to bytes of file contents in memory, 0 for none. Has to be called
+// before init_threads.
+void set_content_cache(size_t bytes) {
+    cache_budget = bytes;
+}
+
+// How long looked-up metadata is trusted before an fstat checks it again,
+// 0 to check every time. Has to be called before init_threads.
+void set_meta_recheck(unsigned ms) {
+    meta_recheck_ms = ms;
+}
+
+// Pin worker slot i to cpus[i % n]; NULL or an empty list leaves them unpinned.
+// Has to be called before init_threads.
+void set_worker_cpus(const cpulist_t *cpus) {
+    if (cpus) {
+        worker_cpus = *cpus;
+    } else {
+        worker_cpus.n = 0;
+    }
+}
+
+// Metadata cache counters
+static metacache_stats_t meta_stats() {
+    metacache_stats_t st = { 0 };
+    if (meta_cache) {
+        metacache_stats(meta_cache, &st);
+    }
+    return st;
+}
+
+unsigned long meta_hit_count() {
+    return meta_stats().hits;
+}
+
+unsigned long meta_recheck_count() {
+    return meta_stats().rechecks;
+}
+
+unsigned long meta_change_count() {
+    return meta_stats().changes;
+}
+
+// Prefetch a file once it has followed another at least min_count times (and
+// more often than not), 0 to turn prediction off. Has to be called before init_threads.
+void set_prefetch(unsigned min_count) {
+    predict_min = min_count;
+}
+
+// Predicted files the prefetch thread has looked at
+unsigned long prefetch_total() {
+    return __atomic_load_n(&prefetch_count, __ATOMIC_RELAXED);
+}
+
+// Content cache counters - all 0 with the cache off
+static ccache_stats_t cache_stats() {
+    ccache_stats_t st = { 0 };
+    if (content_cache) {
+        ccache_stats(content_cache, &st);
+    }
+    return st;
+}
+
+unsigned long cache_hit_count() {
+    return cache_stats().hits;
+}
+
+unsigned long cache_miss_count() {
+    return cache_stats().misses;
+}
+
+unsigned long cache_eviction_count() {
+    return cache_stats().evictions;
+}
+
+size_t cache_bytes() {
+    return cache_stats().bytes;
+}
+
+// Let the pool size itself between min and max workers instead of staying at
+// the init_threads count. Has to be called before init_threads.
+void set_pool_bounds(size_t min, size_t max) {
+    pool_min = min < 1 ? 1 : min;
+    pool_max = max > MAX_THREADS ? MAX_THREADS : max;
+    if (pool_max < pool_min) {
+        pool_max = pool_min;
+    }
+}
+
+// Pool size right now, and how many times it grew / shrank
+size_t pool_worker_count() {
+    return __atomic_load_n(&active_workers, __ATOMIC_RELAXED);
+}
+
+unsigned long pool_grow_count() {
+    return __atomic_load_n(&grow_count, __ATOMIC_RELAXED);
+}
+
+unsigned long pool_shrink_count() {
+    return __atomic_load_n(&shrink_count, __ATOMIC_RELAXED);
+}
+
+// Requests that rode along on another request's lookup instead of doing their own
+unsigned long flight_coalesced_count() {
+    return __atomic_load_n(&coalesced_count, __ATOMIC_RELAXED);
+}
+
+// How many requests were shed / made the acceptor wait so far
+unsigned long queue_shed_count() {
+    return __atomic_load_n(&shed_count, __ATOMIC_RELAXED);
+}
+
+unsigned long queue_blocked_count() {
+    return __atomic_load_n(&blocked_count, __ATOMIC_RELAXED);
+}
+
+// Jobs waiting for a worker right now
+unsigned long queue_length() {
+    return (unsigned long)__atomic_load_n(&queued, __ATOMIC_RELAXED);
+}
+
 // Initialize the thread pool with the specified number of threads
 void init_threads(size_t numthreads) {
     // safety check - don't create too many threads
     if (numthreads > MAX_THREADS)
         numthreads = MAX_THREADS;
 
-    steque_init(&job_queue);
+    if (numthreads < 1)
+        numthreads = 1;
+
+    if (!job_pool) {
+        job_pool = objpool_create(sizeof(job_t), JOB_SLAB);
+        for (int i = 0; i < FLIGHT_SHARDS; i++) {
+            pthread_mutex_init(&flights[i].lock, NULL);
+        }
+    }
+
+    if (!meta_cache) {
+        meta_cache = metacache_create(meta_recheck_ms);
+        if (!meta_cache) {
+            perror("metacache_create");
+            exit(1);
+        }
+    }
+
+    if (cache_budget && !content_cache) {
+        content_cache = ccache_create(cache_budget);
+        if (!content_cache) {
+            perror("ccache_create");
+            exit(1);
+        }
+    }
+
+    if (predict_min && !predict_rows) {
+        predict_rows = calloc(PREDICT_ROWS, sizeof(predict_row_t));
+        prefetch_queue = mpmc_create(PREFETCH_QUEUE);
+        if (!predict_rows || !prefetch_queue) {
+            perror("init_threads");
+            exit(1);
+        }
+        for (int i = 0; i < PREDICT_LOCKS; i++) {
+            pthread_mutex_init(&predict_locks[i], NULL);
+        }
+        prefetch_running = 1;
+        pthread_create(&prefetch_id, NULL, prefetch_thread, NULL);
+    }
+
+    if (srpt_enabled && !srpt_heap) {
+        srpt_cap = queue_limit ? queue_limit : SRPT_CAPACITY;
+        srpt_heap = malloc(srpt_cap * sizeof(job_t *));
+        if (!srpt_heap) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    // a fixed pool unless set_pool_bounds said otherwise
+    if (!pool_max) {
+        pool_min = pool_max = numthreads;
+    }
+    if (numthreads < pool_min)
+        numthreads = pool_min;
+    if (numthreads > pool_max)
+        numthreads = pool_max;
 
     shutting_down = 0;
-    worker_count = numthreads;
 
     // spin up all the worker threads
-    for (size_t i = 0; i < worker_count; i++) {
-        pthread_create(&worker_ids[i], NULL, worker_thread, NULL);
+    for (size_t i = 0; i < numthreads; i++) {
+        if (start_worker() < 0) {
+            perror("init_threads");
+            exit(1);
+        }
+    }
+
+    // and something to keep an eye on them if they're allowed to change
+    if (pool_min < pool_max) {
+        supervisor_running = 1;
+        pthread_create(&supervisor_id, NULL, supervisor_thread, NULL);
     }
 }
 
 // Shut down the thread pool cleanly
 void cleanup_threads() {
-    // Tell all workers to finish
-    pthread_mutex_lock(&queue_mtx);
-    shutting_down = 1;
-    pthread_cond_broadcast(&queue_cv); // wake up all the workers
-    pthread_mutex_unlock(&queue_mtx);
+    // No more resizing
+    if (supervisor_running) {
+        pthread_mutex_lock(&supervisor_mtx);
+        supervisor_running = 0;
+        pthread_cond_signal(&supervisor_cv);
+        pthread_mutex_unlock(&supervisor_mtx);
+        pthread_join(supervisor_id, NULL);
+    }
+
+    // Stop prefetching first - its lookups can still hand waiters to the workers
+    if (prefetch_running) {
+        mpmc_close(prefetch_queue);
+        pthread_join(prefetch_id, NULL);
+        prefetch_running = 0;
+    }
+
+    // Tell all workers to finish - they drain what's queued, then exit
+    pthread_mutex_lock(&idle_mtx);
+    __atomic_store_n(&shutting_down, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&idle_cv);
+    pthread_mutex_unlock(&idle_mtx);
+
+    // and any acceptor still waiting for room gives up
+    pthread_mutex_lock(&room_mtx);
+    pthread_cond_broadcast(&room_cv);
+    pthread_mutex_unlock(&room_mtx);
+
+    // Wait for all workers to finish (retired ones too, if nobody joined them yet)
+    size_t n = slot_count();
+    for (size_t i = 0; i < n; i++) {
+        if (workers[i].joinable) {
+            pthread_join(workers[i].id, NULL);
+            workers[i].joinable = 0;
+        }
+    }
 
-    // Wait for all workers to finish
-    for (size_t i = 0; i < worker_count; i++) {
-        pthread_join(worker_ids[i], NULL);
+    for (size_t i = 0; i < n; i++) {
+        wsdeque_destroy(workers[i].deque);
+        mpmc_destroy(workers[i].inbox);
+        workers[i].deque = NULL;
+        workers[i].inbox = NULL;
+        workers[i].state = WORKER_OFF;
     }
+    worker_slots = 0;
+    active_workers = 0;
+
+    free(srpt_heap);
+    srpt_heap = NULL;
+    srpt_cap = 0;
+
+    // anything a writer is still sending keeps its own reference
+    ccache_destroy(content_cache);
+    content_cache = NULL;
+    metacache_destroy(meta_cache);
+    meta_cache = NULL;
+
+    // workers may have queued a last prediction or two after the prefetcher left
+    job_t *left;
+    while (prefetch_queue && (left = mpmc_try_pop(prefetch_queue))) {
+        objpool_put(job_pool, left);
+    }
+    mpmc_destroy(prefetch_queue);
+    prefetch_queue = NULL;
+    free(predict_rows);
+    predict_rows = NULL;
 }
 
 // Main request handler - called by the server for each incoming request
@@ -147,9 +1431,10 @@ gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void *arg) {
     (void)arg; // not used
 
     // Create a new job for this request
-    job_t *job = malloc(sizeof(job_t));
+    size_t path_len = strlen(path);
+    job_t *job = (job_pool && path_len < JOB_PATH_SIZE) ? objpool_get(job_pool) : NULL;
     if (!job) {
-        // Out of memory - send error response
+        // Out of memory (or a path we can't hold) - send error response
         gfs_sendheader(ctx, GF_ERROR, 0);
         *ctx = NULL;
         return gfh_failure;
@@ -158,21 +1443,38 @@ gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void *arg) {
     // Transfer ownership of the context to the job
     job->ctx = *ctx;
 
-    // Make a copy of the path
-    job->path = strdup(path);
-    if (!job->path) {
-        // strdup failed
-        free(job);
-        gfs_sendheader(ctx, GF_ERROR, 0);
-        *ctx = NULL;
-        return gfh_failure;
+    // Copy the path in - no separate allocation
+    memcpy(job->path, path, path_len + 1);
+    job->queued_ns = now_ns();
+    job->resolved = 0;
+    job->cached = NULL;
+    trace_record_at(TRACE_ENQUEUE, gfs_trace_id(ctx), __atomic_load_n(&queued, __ATOMIC_RELAXED),
+                    job->queued_ns);
+    if (srpt_enabled) {
+        srpt_tag(job);
     }
 
-    // Add the job to the queue
-    pthread_mutex_lock(&queue_mtx);
-    steque_enqueue(&job_queue, job);
-    pthread_cond_signal(&queue_cv); // wake up one worker
-    pthread_mutex_unlock(&queue_mtx);
+    // Hand the job to a worker, if there's room
+    if (admit_job(job) < 0) {
+        if (queue_limit && !queue_block) {
+            // Full - fail fast instead of making everyone wait longer
+            __atomic_add_fetch(&shed_count, 1, __ATOMIC_RELAXED);
+            objpool_put(job_pool, job);
+            gfs_sendheader(ctx, GF_ERROR, 0);
+            *ctx = NULL;
+            return gfh_failure;
+        }
+
+        // Wait for a worker to make room
+        __atomic_add_fetch(&blocked_count, 1, __ATOMIC_RELAXED);
+        if (admit_job_wait(job) < 0) {
+            // shutting down
+            objpool_put(job_pool, job);
+            gfs_sendheader(ctx, GF_ERROR, 0);
+            *ctx = NULL;
+            return gfh_failure;
+        }
+    }
 
     // Done with this context now - the worker thread will handle it 
     *ctx = NULL;
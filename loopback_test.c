@@ -0,0 +1,1697 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "trace.h"
+
+// End-to-end checks over loopback: starts gfserver_main on a set of files made
+// up for the run (sizes around the buffer and chunk edges, up to a few MB of
+// random bytes), talks GETFILE to it and compares every byte that comes back.
+// The downloads run under each of the server's accept and send paths in turn,
+// or just under the options given after --. Exits non-zero if anything's off.
+// Build with gcc -O2 -pthread loopback_test.c -lz
+
+#define MAX_SERVER_ARGS 64
+#define HEADER_MAX 256
+#define BURST 64                    // connections opened all at once
+#define SLOW_READERS 8
+#define SLOW_BYTES (256 << 10)      // read this much of the body slowly before draining it
+#define SOON_MS 1000                // how quickly "right away" has to be on a busy machine
+#define SERVER_HEADER_MAX 4096      // the server's request buffer
+#define SERVER_COALESCE_MAX 16384   // bodies the server sends in one go with the header
+#define SERVER_MUX_FRAME_MAX 16384  // biggest mux frame payload
+#define IDLE_SECONDS 1              // keep-alive idle timeout the server gets
+#define MUX_FLOOD 200               // more streams than the server lets one connection have
+#define MUX_WORKERS "-t 192"        // enough that the flood's streams can't take every worker
+#define COLD_PATHS 64               // names for one file, each slow the first time it's looked up
+#define COLD_FILE 1                 // the file they name
+#define ADMIT_CLIENTS 6
+#define ADMIT_DELAY_MS 300          // -d for the admission checks
+#define CUT_AFTER (1 << 20)         // bytes of the biggest file the cutting proxy lets through
+#define DEADLINE_SECONDS 1          // -r and -w for the deadline checks
+#define POOL_MAX 8                  // -t 1 -T 1:POOL_MAX for the pool checks
+#define POOL_DELAY_MS 200           // -d for the pool checks
+#define SERVER_SHRINK_IDLE_MS 5000  // idle time before the server retires a worker
+#define SRPT_DELAY_MS 300           // how long the blocker holds the only worker
+#define SRPT_GAP_MS 5               // between queued requests, well inside the aging slack
+#define TEXT_SIZE (64 << 10)        // /text.txt, which compresses well
+#define ABORTED_SCRAPES 16
+
+#define USAGE                                                                  \
+  "usage:\n"                                                                   \
+  "  loopback_test [options] [-- server options]\n"                            \
+  "options:\n"                                                                 \
+  "  -h                  Show this help message\n"                             \
+  "  -s [server]         gfserver_main to test (Default: ./gfserver_main)\n"   \
+  "  -c [client]         gfclient_download to check as well (Default: none)\n" \
+  "  -p [port]           Port for the test server (Default: 57123)\n"          \
+  "  -n [rounds]         Times through the file set (Default: 3)\n"
+
+static struct option gLongOptions[] = {
+  {"server", required_argument, NULL, 's'},
+  {"client", required_argument, NULL, 'c'},
+  {"port", required_argument, NULL, 'p'},
+  {"rounds", required_argument, NULL, 'n'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+// Sizes either side of the server's buffers, frames and io_uring chunks
+static const size_t file_sizes[] = {
+  1, 100, 4095, 4096, 4097, 16384, 16385, 65536, 65537, 300000, 1048577, 5 << 20
+};
+#define NFILES (sizeof(file_sizes) / sizeof(file_sizes[0]))
+#define BIGGEST (NFILES - 1)
+
+// Server options the downloads are run under, one server each
+static const char *modes[] = {
+  "",              // blocking accept loop
+  "-e",            // epoll loop
+  "-l 4",          // listeners sharing the port
+  "-e -l 4",       // an epoll loop behind each of them
+  "-u",            // io_uring accepts and header reads
+  "-u -W 0 -c 0",  // ... and io_uring body sends, uncached so they read the files
+  "-c 0",          // bodies sent zero-copy from the files by writer threads
+  "-e -W 0 -c 0",  // ... and by the workers
+};
+#define NMODES (sizeof(modes) / sizeof(modes[0]))
+
+static char dir[] = "/tmp/loopback_test_XXXXXX";
+static unsigned short port = 57123;
+static const char *server = "./gfserver_main";
+static pid_t server_pid = -1;
+static char *files[NFILES];  // what each one should hold
+static char *text;           // what /text.txt should hold
+static int rounds = 3;
+static int next_cold = 0;
+static int failures = 0;
+
+// A response: status word, body length, what came after the length on the
+// header line, and the body itself (NULL if there isn't one)
+typedef struct {
+  char status[16];
+  size_t len;
+  char opts[HEADER_MAX];  // e.g. " RANGE 0 100 KEEPALIVE"
+  int keepalive;
+  char *body;
+} reply_t;
+
+static void check(int ok, const char *what) {
+  fprintf(stdout, "%-48s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void nap_ms(long ms) {
+  struct timespec nap = { ms / 1000, (ms % 1000) * 1000000L };
+  nanosleep(&nap, NULL);
+}
+
+// Random bytes, different for every size, so a chunk in the wrong place shows
+static char *make_file(size_t size) {
+  char *data = malloc(size);
+  uint64_t x = 0x9e3779b97f4a7c15ull ^ size;
+  for (size_t i = 0; data && i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    data[i] = (char)x;
+  }
+  return data;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// The files, the content map that points at them, and a workload listing them
+// Rewrite the file behind /changing.bin in place with file i's bytes
+static int write_changing(size_t i) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/changing.bin", dir);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int rc = fd >= 0 ? write_all(fd, files[i], file_sizes[i]) : -1;
+  if (fd >= 0) {
+    close(fd);
+  }
+  return rc;
+}
+
+// Lines of text, as compressible as a real text file
+static char *make_text(size_t size) {
+  char *data = malloc(size + 1);
+  for (size_t have = 0, line = 0; data && have < size; line++) {
+    have += (size_t)snprintf(data + have, size + 1 - have, "line %zu of a text file\n", line);
+  }
+  return data;
+}
+
+static int make_files() {
+  if (!mkdtemp(dir)) {
+    return -1;
+  }
+  char path[512];
+  snprintf(path, sizeof(path), "%s/content.txt", dir);
+  FILE *map = fopen(path, "w");
+  snprintf(path, sizeof(path), "%s/workload.txt", dir);
+  FILE *workload = fopen(path, "w");
+  if (!map || !workload) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < NFILES; i++) {
+    files[i] = make_file(file_sizes[i]);
+    snprintf(path, sizeof(path), "%s/f%zu.bin", dir, file_sizes[i]);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!files[i] || fd < 0 || write_all(fd, files[i], file_sizes[i]) < 0) {
+      return -1;
+    }
+    close(fd);
+    fprintf(map, "/f%zu.bin %s\n", file_sizes[i], path);
+    fprintf(workload, "/f%zu.bin\n", file_sizes[i]);
+  }
+
+  // The server only pays -d on a lookup it hasn't made before
+  for (int c = 0; c < COLD_PATHS; c++) {
+    fprintf(map, "/cold%d.bin %s/f%zu.bin\n", c, dir, file_sizes[COLD_FILE]);
+  }
+  fprintf(map, "/changing.bin %s/changing.bin\n", dir);
+  text = make_text(TEXT_SIZE);
+  snprintf(path, sizeof(path), "%s/text.txt", dir);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (!text || fd < 0 || write_all(fd, text, TEXT_SIZE) < 0) {
+    return -1;
+  }
+  close(fd);
+  fprintf(map, "/text.txt %s\n", path);
+  if (write_changing(2) < 0) {
+    return -1;
+  }
+  fclose(map);
+  fclose(workload);
+  return 0;
+}
+
+static void remove_files() {
+  char cmd[600];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  if (system(cmd) != 0) {
+    fprintf(stderr, "left %s behind\n", dir);
+  }
+}
+
+static int connect_to(unsigned short to, int rcvbuf) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (rcvbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  struct timeval tv = { 30, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(to);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int connect_server(int rcvbuf) {
+  return connect_to(port, rcvbuf);
+}
+
+// Start the server with opts (space separated) and then extra. Its output
+// goes to server.log, after a line saying which options it was given.
+static int start_server(const char *opts, char **extra, int nextra) {
+  static char optbuf[512];
+  char portbuf[16], map[512], log[512];
+  snprintf(portbuf, sizeof(portbuf), "%u", port);
+  snprintf(map, sizeof(map), "%s/content.txt", dir);
+  snprintf(log, sizeof(log), "%s/server.log", dir);
+  snprintf(optbuf, sizeof(optbuf), "%s", opts);
+
+  char *argv[MAX_SERVER_ARGS + 6];
+  int argc = 0;
+  argv[argc++] = (char *)server;
+  argv[argc++] = "-p";
+  argv[argc++] = portbuf;
+  argv[argc++] = "-m";
+  argv[argc++] = map;
+  for (char *tok = strtok(optbuf, " "); tok && argc < MAX_SERVER_ARGS; tok = strtok(NULL, " ")) {
+    argv[argc++] = tok;
+  }
+  for (int i = 0; i < nextra && argc < MAX_SERVER_ARGS; i++) {
+    argv[argc++] = extra[i];
+  }
+  argv[argc] = NULL;
+
+  FILE *f = fopen(log, "a");
+  if (f) {
+    fprintf(f, "== %s", opts);
+    for (int i = 0; i < nextra; i++) {
+      fprintf(f, " %s", extra[i]);
+    }
+    fprintf(f, "\n");
+    fclose(f);
+  }
+
+  server_pid = fork();
+  if (server_pid == 0) {
+    int fd = open(log, O_WRONLY | O_APPEND);
+    if (fd >= 0) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+    execv(server, argv);
+    _exit(127);
+  }
+
+  // Up once it takes a connection
+  for (int tries = 0; server_pid > 0 && tries < 100; tries++) {
+    int fd = connect_server(0);
+    if (fd >= 0) {
+      close(fd);
+      return 0;
+    }
+    nap_ms(50);
+  }
+  fprintf(stderr, "%s didn't come up on port %u - see %s/server.log\n", server, port, dir);
+  return -1;
+}
+
+// Shut the server down - it should still be there to shut down
+static void stop_server() {
+  if (server_pid <= 0) {
+    return;
+  }
+  if (waitpid(server_pid, NULL, WNOHANG) == server_pid) {
+    check(0, "server stayed up");
+  } else {
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+  }
+  server_pid = -1;
+
+  // An io_uring server's listener outlives it for a moment while the kernel
+  // tears the ring down - the next server can't bind until it's gone
+  int fd;
+  for (int tries = 0; tries < 100 && (fd = connect_server(0)) >= 0; tries++) {
+    close(fd);
+    nap_ms(20);
+  }
+}
+
+static int send_request(int fd, const char *path, const char *opts) {
+  char req[HEADER_MAX];
+  int n = snprintf(req, sizeof(req), "GETFILE GET %s%s\r\n\r\n", path, opts);
+  return write_all(fd, req, (size_t)n);
+}
+
+// Fill in r from a response header, len bytes ending in the blank line
+static int parse_header(const char *hdr, size_t len, reply_t *r) {
+  char buf[HEADER_MAX + 1];
+  memset(r, 0, sizeof(*r));
+  if (len < 4 || len > HEADER_MAX) {
+    return -1;
+  }
+  memcpy(buf, hdr, len - 4);
+  buf[len - 4] = '\0';
+
+  int used = 0;
+  if (sscanf(buf, "GETFILE %15s%n", r->status, &used) < 1) {
+    return -1;
+  }
+  char *rest = buf + used;
+  if (strcmp(r->status, "OK") == 0) {
+    char *end;
+    r->len = strtoull(rest, &end, 10);
+    if (end == rest) {
+      return -1;
+    }
+    rest = end;
+  }
+  snprintf(r->opts, sizeof(r->opts), "%s", rest);
+  r->keepalive = strstr(r->opts, "KEEPALIVE") != NULL;
+  return 0;
+}
+
+// Read a response header a byte at a time, so nothing past it is taken off the socket
+static int read_header(int fd, reply_t *r) {
+  char buf[HEADER_MAX];
+  size_t have = 0;
+  memset(r, 0, sizeof(*r));
+  while (have < 4 || memcmp(buf + have - 4, "\r\n\r\n", 4) != 0) {
+    if (have == HEADER_MAX || recv(fd, buf + have, 1, 0) != 1) {
+      return -1;
+    }
+    have++;
+  }
+  return parse_header(buf, have, r);
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+  for (size_t got = 0; got < len;) {
+    ssize_t n = recv(fd, (char *)buf + got, len - got, 0);
+    if (n <= 0) {
+      return -1;
+    }
+    got += (size_t)n;
+  }
+  return 0;
+}
+
+// The body after a header. Slow readers take their time over the first
+// SLOW_BYTES so the server's send buffer fills up.
+static int read_body(int fd, reply_t *r, int slow) {
+  if (r->len == 0) {
+    return 0;
+  }
+  r->body = malloc(r->len);
+  size_t got = 0;
+  while (r->body && got < r->len) {
+    size_t want = r->len - got;
+    if (slow && got < SLOW_BYTES) {
+      want = want < 2048 ? want : 2048;
+      nap_ms(1);
+    }
+    ssize_t n = recv(fd, r->body + got, want, 0);
+    if (n <= 0) {
+      return -1;
+    }
+    got += (size_t)n;
+  }
+  return r->body ? 0 : -1;
+}
+
+static int read_reply(int fd, reply_t *r, int slow) {
+  return read_header(fd, r) == 0 ? read_body(fd, r, slow) : -1;
+}
+
+static void reply_free(reply_t *r) {
+  free(r->body);
+  r->body = NULL;
+}
+
+// Did file i come back whole?
+static int is_file(const reply_t *r, size_t i) {
+  return strcmp(r->status, "OK") == 0 && r->len == file_sizes[i] &&
+         memcmp(r->body, files[i], file_sizes[i]) == 0;
+}
+
+// One request on a connection of its own
+static int get(const char *path, const char *opts, reply_t *r) {
+  int fd = connect_server(0);
+  if (fd < 0) {
+    memset(r, 0, sizeof(*r));
+    return -1;
+  }
+  int rc = send_request(fd, path, opts) == 0 ? read_reply(fd, r, 0) : -1;
+  close(fd);
+  return rc;
+}
+
+static int send_file_request(int fd, size_t i, const char *opts) {
+  char path[32];
+  snprintf(path, sizeof(path), "/f%zu.bin", file_sizes[i]);
+  return send_request(fd, path, opts);
+}
+
+static int get_file(size_t i, int rcvbuf, int slow) {
+  int fd = connect_server(rcvbuf);
+  if (fd < 0) {
+    return -1;
+  }
+  reply_t r;
+  int ok = send_file_request(fd, i, "") == 0 && read_reply(fd, &r, slow) == 0 && is_file(&r, i);
+  reply_free(&r);
+  close(fd);
+  return ok ? 0 : -1;
+}
+
+// A small body comes in the same segment as its header, so the very first read
+// once the reply starts arriving has all of it
+static int arrives_whole(size_t i) {
+  char buf[HEADER_MAX + SERVER_COALESCE_MAX];
+  char hdr[HEADER_MAX];
+  int hlen = snprintf(hdr, sizeof(hdr), "GETFILE OK %zu\r\n\r\n", file_sizes[i]);
+  int fd = connect_server(0);
+  if (fd < 0) {
+    return 0;
+  }
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  ssize_t n = send_file_request(fd, i, "") == 0 && poll(&pfd, 1, 30000) == 1
+              ? recv(fd, buf, sizeof(buf), 0) : -1;
+  close(fd);
+  return n == hlen + (ssize_t)file_sizes[i] && memcmp(buf, hdr, (size_t)hlen) == 0 &&
+         memcmp(buf + hlen, files[i], file_sizes[i]) == 0;
+}
+
+static void *slow_reader(void *arg) {
+  return (void *)(intptr_t)get_file((size_t)(uintptr_t)arg, 4096, 1);
+}
+
+static void *fast_reader(void *arg) {
+  return (void *)(intptr_t)get_file((size_t)(uintptr_t)arg, 0, 0);
+}
+
+// Start n readers of file i and wait for them all. Returns 1 if all of them got it.
+static int readers(void *(*reader)(void *), int n, size_t i) {
+  pthread_t tids[BURST];
+  int ok = 1;
+  n = n < BURST ? n : BURST;
+  for (int t = 0; t < n; t++) {
+    pthread_create(&tids[t], NULL, reader, (void *)(uintptr_t)i);
+  }
+  for (int t = 0; t < n; t++) {
+    void *rc;
+    pthread_join(tids[t], &rc);
+    ok = ok && rc == NULL;
+  }
+  return ok;
+}
+
+// Download every file twice with gfclient_download from port to, and compare
+static void run_client(const char *client, unsigned short to, const char *what) {
+  char cmd[2048], label[64];
+  snprintf(cmd, sizeof(cmd),
+           "rm -rf %s/dl && mkdir %s/dl && cd %s/dl && %s -s 127.0.0.1 -p %u -w %s/workload.txt"
+           " -t 4 -r %zu > %s/client.log 2>&1", dir, dir, dir, client, to, dir, 2 * NFILES, dir);
+  snprintf(label, sizeof(label), "%s: client ran", what);
+  check(system(cmd) == 0, label);
+
+  // Downloads are named after the request plus a counter, in request order
+  int ok = 1;
+  for (size_t n = 0; n < 2 * NFILES; n++) {
+    size_t i = n % NFILES;
+    char path[600];
+    snprintf(path, sizeof(path), "%s/dl/f%zu.bin-%06zu", dir, file_sizes[i], n);
+    FILE *f = fopen(path, "rb");
+    char *data = malloc(file_sizes[i] + 1);
+    size_t got = f && data ? fread(data, 1, file_sizes[i] + 1, f) : 0;
+    if (got != file_sizes[i] || memcmp(data, files[i], got) != 0) {
+      fprintf(stdout, "  %s doesn't match\n", path);
+      ok = 0;
+    }
+    free(data);
+    if (f) {
+      fclose(f);
+    }
+  }
+  snprintf(label, sizeof(label), "%s: every byte matches", what);
+  check(ok, label);
+}
+
+// Every file, one request per connection, a missing one, small ones in a single
+// read, a burst of connections at once, and the biggest to several readers at
+// once that can't keep up
+static void downloads(const char *client) {
+  int ok = 1;
+  for (int r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < NFILES; i++) {
+      ok = ok && get_file(i, 0, 0) == 0;
+    }
+  }
+  check(ok, "one request per connection");
+
+  reply_t r;
+  check(get("/missing.bin", "", &r) == 0 && strcmp(r.status, "FILE_NOT_FOUND") == 0 && !r.body,
+        "missing file is FILE_NOT_FOUND");
+
+  ok = 1;
+  for (size_t i = 0; i < NFILES && file_sizes[i] <= SERVER_COALESCE_MAX; i++) {
+    ok = ok && arrives_whole(i);
+  }
+  check(ok, "small bodies arrive with their header");
+
+  check(readers(fast_reader, BURST, 6), "a burst of connections all get served");
+  check(readers(slow_reader, SLOW_READERS, BIGGEST), "slow readers get every byte");
+
+  if (client) {
+    run_client(client, port, "gfclient_download");
+  }
+}
+
+// The slice [off, off + len) of file i - with len 0, or past the end, the rest of it
+static int range_is(size_t i, size_t off, size_t len) {
+  char opts[64];
+  snprintf(opts, sizeof(opts), " RANGE %zu %zu", off, len);
+  if (len == 0 || len > file_sizes[i] - off) {
+    len = file_sizes[i] - off;
+  }
+  int fd = connect_server(0);
+  reply_t r;
+  size_t got_off = 0, total = 0;
+  int ok = fd >= 0 && send_file_request(fd, i, opts) == 0 && read_reply(fd, &r, 0) == 0 &&
+           strcmp(r.status, "OK") == 0 && r.len == len &&
+           sscanf(r.opts, " RANGE %zu %zu", &got_off, &total) == 2 && got_off == off &&
+           total == file_sizes[i] && (len == 0 || memcmp(r.body, files[i] + off, len) == 0);
+  reply_free(&r);
+  if (fd >= 0) {
+    close(fd);
+  }
+  return ok;
+}
+
+// Byte ranges: slices of each file put back together, open-ended and
+// overlong ones, and one that starts past the end
+static void range_checks() {
+  int ok = 1;
+  for (size_t i = 0; i < NFILES; i++) {
+    size_t half = file_sizes[i] / 2;
+    ok = ok && range_is(i, 0, half ? half : 1) && (half == 0 || range_is(i, half, 0));
+  }
+  check(ok, "range: two halves make every file");
+  check(range_is(BIGGEST, 123457, 1 << 20), "range: a slice from the middle");
+  check(range_is(9, file_sizes[9] - 10, 1000), "range: one past the end is cut short");
+  check(range_is(9, file_sizes[9], 0), "range: starting at the end is empty");
+  char path[32], opts[64];
+  reply_t r;
+  snprintf(path, sizeof(path), "/f%zu.bin", file_sizes[9]);
+  snprintf(opts, sizeof(opts), " RANGE %zu 0", file_sizes[9] + 1);
+  check(get(path, opts, &r) == 0 && strcmp(r.status, "INVALID") == 0,
+        "range: starting past the end is INVALID");
+  reply_free(&r);
+}
+
+// Send raw request bytes, in pieces of step bytes with a pause between them
+// (0 for all at once), and read what comes back
+static int raw_request(const char *req, size_t len, size_t step, reply_t *r) {
+  memset(r, 0, sizeof(*r));
+  int fd = connect_server(0);
+  if (fd < 0) {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  int rc = 0;
+  for (size_t off = 0, n; rc == 0 && off < len; off += n) {
+    n = step && len - off > step ? step : len - off;
+    rc = write_all(fd, req + off, n);
+    if (step) {
+      nap_ms(2);
+    }
+  }
+  rc = rc == 0 ? read_reply(fd, r, 0) : -1;
+  close(fd);
+  return rc;
+}
+
+static int raw_status(const char *req, size_t step, const char *status) {
+  reply_t r;
+  int ok = raw_request(req, strlen(req), step, &r) == 0 && strcmp(r.status, status) == 0;
+  reply_free(&r);
+  return ok;
+}
+
+// Request headers that arrive in pieces, that are padded out, and that are wrong
+static void parser_checks() {
+  reply_t r;
+  const char *req = "GETFILE GET /f4097.bin\r\n\r\n";
+  int ok = raw_request(req, strlen(req), 1, &r) == 0 && is_file(&r, 4);
+  reply_free(&r);
+  check(ok, "parser: header a byte at a time");
+  ok = raw_request(req, strlen(req), strlen(req) - 2, &r) == 0 && is_file(&r, 4);
+  reply_free(&r);
+  check(ok, "parser: end marker split across reads");
+
+  check(raw_status("GETFILE   GET  /f100.bin \r\n\r\n", 0, "OK"), "parser: extra spaces");
+  check(raw_status("GETFILE GET /f100.bin SOMEDAY MAYBE\r\n\r\n", 0, "OK"),
+        "parser: unknown options ignored");
+  check(raw_status("HELLO\r\n\r\n", 0, "INVALID"), "parser: not GETFILE is INVALID");
+  check(raw_status("GETFILE PUT /f100.bin\r\n\r\n", 0, "INVALID"), "parser: not GET is INVALID");
+  check(raw_status("GETFILE GET f100.bin\r\n\r\n", 0, "INVALID"), "parser: relative path is INVALID");
+  check(raw_status("GETFILE GET /f100.bin a b c d e f\r\n\r\n", 0, "INVALID"),
+        "parser: too many tokens is INVALID");
+
+  char big[SERVER_HEADER_MAX + 64];
+  snprintf(big, sizeof(big), "GETFILE GET /%0300d\r\n\r\n", 0);
+  check(raw_status(big, 0, "INVALID"), "parser: overlong path is INVALID");
+  memset(big, 'x', SERVER_HEADER_MAX);
+  memcpy(big, "GETFILE GET /", 13);
+  big[SERVER_HEADER_MAX] = '\0';
+  check(raw_status(big, 0, "INVALID"), "parser: header that never ends is INVALID");
+}
+
+// 1 if the server closes fd (without sending anything more) within ms
+static int closed_within(int fd, long ms) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  char c;
+  return poll(&pfd, 1, (int)ms) == 1 && recv(fd, &c, 1, 0) == 0;
+}
+
+// Keep-alive: epoll connections take request after request (pipelined too) and
+// are let go when the client stops asking or goes quiet; the blocking loop
+// doesn't keep connections at all
+static void keepalive_checks() {
+  char opts[64];
+  snprintf(opts, sizeof(opts), "-e -k %d", IDLE_SECONDS);
+  if (start_server(opts, NULL, 0) < 0) {
+    check(0, "keep-alive server starts");
+    return;
+  }
+  reply_t r;
+  int fd = connect_server(0);
+  int ok = fd >= 0;
+  for (size_t i = 0; ok && i < NFILES; i++) {
+    ok = send_file_request(fd, i, " KEEPALIVE") == 0 && read_reply(fd, &r, 0) == 0 &&
+         is_file(&r, i) && r.keepalive;
+    reply_free(&r);
+  }
+  check(ok, "keep-alive: every file over one connection");
+
+  char two[2 * HEADER_MAX];
+  int n = snprintf(two, sizeof(two),
+                   "GETFILE GET /f%zu.bin KEEPALIVE\r\n\r\nGETFILE GET /f%zu.bin KEEPALIVE\r\n\r\n",
+                   file_sizes[2], file_sizes[3]);
+  ok = ok && write_all(fd, two, (size_t)n) == 0;
+  for (size_t i = 2; ok && i <= 3; i++) {
+    ok = read_reply(fd, &r, 0) == 0 && is_file(&r, i) && r.keepalive;
+    reply_free(&r);
+  }
+  check(ok, "keep-alive: pipelined requests both answered");
+
+  ok = ok && send_file_request(fd, 1, "") == 0 && read_reply(fd, &r, 0) == 0 && is_file(&r, 1) &&
+       !r.keepalive && closed_within(fd, SOON_MS);
+  reply_free(&r);
+  check(ok, "keep-alive: a request without it closes");
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  fd = connect_server(0);
+  ok = fd >= 0 && send_file_request(fd, 1, " KEEPALIVE") == 0 && read_reply(fd, &r, 0) == 0 &&
+       r.keepalive;
+  reply_free(&r);
+  uint64_t start = now_ms();
+  ok = ok && closed_within(fd, IDLE_SECONDS * 1000 + 2 * SOON_MS) &&
+       now_ms() - start >= IDLE_SECONDS * 1000 - 100;
+  check(ok, "keep-alive: idle connection closed after -k");
+  if (fd >= 0) {
+    close(fd);
+  }
+  stop_server();
+
+  snprintf(opts, sizeof(opts), "-k %d", IDLE_SECONDS);
+  if (start_server(opts, NULL, 0) < 0) {
+    check(0, "blocking server starts");
+    return;
+  }
+  fd = connect_server(0);
+  ok = fd >= 0 && send_file_request(fd, 1, " KEEPALIVE") == 0 && read_reply(fd, &r, 0) == 0 &&
+       is_file(&r, 1) && !r.keepalive && closed_within(fd, SOON_MS);
+  reply_free(&r);
+  check(ok, "keep-alive: blocking loop closes after one");
+  if (fd >= 0) {
+    close(fd);
+  }
+  stop_server();
+}
+
+// One response on a mux connection, put back together from its frames
+typedef struct {
+  char *data;
+  size_t len, cap;
+  size_t header;  // header bytes, 0 until the blank line is in
+  reply_t r;      // body points into data
+  int done;
+} stream_t;
+
+// Read frames until all n streams (ids 1 to n) have their whole response, or
+// the connection ends. Returns how many finished, with their ids in order[].
+static int mux_read(int fd, stream_t *st, int n, int *order) {
+  int done = 0;
+  while (done < n) {
+    uint32_t frame[2];
+    if (recv_all(fd, frame, sizeof(frame)) < 0) {
+      break;
+    }
+    uint32_t id = ntohl(frame[0]), len = ntohl(frame[1]);
+    if (id < 1 || id > (uint32_t)n) {
+      break;
+    }
+    stream_t *s = &st[id - 1];
+    if (s->len + len > s->cap) {
+      s->cap = (s->len + len) * 2;
+      s->data = realloc(s->data, s->cap);
+    }
+    if (!s->data || recv_all(fd, s->data + s->len, len) < 0) {
+      break;
+    }
+    s->len += len;
+
+    for (size_t i = 4; !s->header && i <= s->len && i <= HEADER_MAX; i++) {
+      if (memcmp(s->data + i - 4, "\r\n\r\n", 4) == 0) {
+        s->header = parse_header(s->data, i, &s->r) == 0 ? i : 0;
+        break;
+      }
+    }
+    if (s->header && !s->done && s->len - s->header >= s->r.len) {
+      s->r.body = s->data + s->header;
+      s->done = 1;
+      order[done++] = (int)id;
+    }
+  }
+  return done;
+}
+
+static void streams_free(stream_t *st, int n) {
+  for (int i = 0; i < n; i++) {
+    free(st[i].data);
+  }
+}
+
+// Mux: every file and a missing one as streams on one connection, answered as
+// they're ready; and a connection asking for too many at once is refused
+// without holding up anyone else
+static void mux_checks() {
+  // Mux bodies go out from the workers, so each stream stuck on a client that
+  // isn't reading holds one until the send times out
+  if (start_server("-e " MUX_WORKERS, NULL, 0) < 0) {
+    check(0, "mux server starts");
+    return;
+  }
+  int n = (int)NFILES + 1;  // the last one's missing
+  char req[NFILES * 64];
+  size_t len = 0;
+  for (int id = 1; id <= n; id++) {
+    size_t i = (size_t)id - 1;
+    len += (size_t)snprintf(req + len, sizeof(req) - len,
+                            "GETFILE GET /%s%zu.bin STREAM %d\r\n\r\n",
+                            i < NFILES ? "f" : "missing", i < NFILES ? file_sizes[i] : 0, id);
+  }
+  stream_t st[NFILES + 1];
+  int order[NFILES + 1];
+  memset(st, 0, sizeof(st));
+  int fd = connect_server(0);
+  int ok = fd >= 0 && write_all(fd, req, len) == 0 && mux_read(fd, st, n, order) == n;
+  for (size_t i = 0; ok && i < NFILES; i++) {
+    ok = is_file(&st[i].r, i);
+  }
+  check(ok, "mux: every stream gets its own file");
+  check(ok && strcmp(st[n - 1].r.status, "FILE_NOT_FOUND") == 0, "mux: missing file on its stream");
+  // The small ones (up to a frame) are all done before the biggest
+  int small = 0;
+  for (int k = 0; ok && order[k] != (int)BIGGEST + 1; k++) {
+    small += order[k] <= (int)NFILES && file_sizes[order[k] - 1] <= SERVER_MUX_FRAME_MAX;
+  }
+  int nsmall = 0;
+  for (size_t i = 0; i < NFILES; i++) {
+    nsmall += file_sizes[i] <= SERVER_MUX_FRAME_MAX;
+  }
+  check(ok && small == nsmall, "mux: the biggest doesn't hold up the rest");
+  streams_free(st, n);
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  // Flood streams for a file that won't all fit in the socket buffers, and don't read
+  static char flood[MUX_FLOOD * 64];
+  len = 0;
+  for (int id = 1; id <= MUX_FLOOD; id++) {
+    len += (size_t)snprintf(flood + len, sizeof(flood) - len,
+                            "GETFILE GET /f%zu.bin STREAM %d\r\n\r\n", file_sizes[9], id);
+  }
+  fd = connect_server(4096);
+  ok = fd >= 0 && write_all(fd, flood, len) == 0;
+  nap_ms(100);
+  uint64_t start = now_ms();
+  check(ok && get_file(1, 0, 0) == 0 && now_ms() - start < SOON_MS,
+        "mux: a flood doesn't hold up others");
+
+  // Some streams are turned away with ERROR, or the whole connection is
+  stream_t *fst = calloc(MUX_FLOOD, sizeof(stream_t));
+  int *forder = calloc(MUX_FLOOD, sizeof(int));
+  int finished = ok && fst && forder ? mux_read(fd, fst, MUX_FLOOD, forder) : 0;
+  int refused = finished < MUX_FLOOD;
+  for (int id = 0; ok && fst && id < MUX_FLOOD; id++) {
+    if (fst[id].done && strcmp(fst[id].r.status, "ERROR") == 0) {
+      refused = 1;
+    } else if (fst[id].done && !is_file(&fst[id].r, 9)) {
+      ok = 0;
+    }
+  }
+  check(ok && refused, "mux: too many streams are refused");
+  if (fst) {
+    streams_free(fst, MUX_FLOOD);
+  }
+  free(fst);
+  free(forder);
+  if (fd >= 0) {
+    close(fd);
+  }
+  stop_server();
+}
+
+// The last value the server logged after label (its shutdown counters), or -1
+static long log_counter(const char *label) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/server.log", dir);
+  FILE *f = fopen(path, "r");
+  long value = -1;
+  char line[512];
+  while (f && fgets(line, sizeof(line), f)) {
+    char *at = strstr(line, label);
+    if (at) {
+      value = strtol(at + strlen(label), NULL, 10);
+    }
+  }
+  if (f) {
+    fclose(f);
+  }
+  return value;
+}
+
+// A request timed from connect to the end of the reply
+typedef struct {
+  char path[32];
+  reply_t r;
+  int rc;
+  uint64_t ms;
+} timed_t;
+
+static void *timed_get(void *arg) {
+  timed_t *t = arg;
+  uint64_t start = now_ms();
+  t->rc = get(t->path, "", &t->r);
+  t->ms = now_ms() - start;
+  return NULL;
+}
+
+// n requests at once, for the paths already in t
+static void timed_gets(timed_t *t, int n) {
+  pthread_t tids[BURST];
+  n = n < BURST ? n : BURST;
+  for (int i = 0; i < n; i++) {
+    pthread_create(&tids[i], NULL, timed_get, &t[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    pthread_join(tids[i], NULL);
+  }
+}
+
+// n requests at once, each for a cold path the server hasn't looked up yet
+static void cold_gets(timed_t *t, int n) {
+  for (int i = 0; i < n && i < BURST; i++) {
+    snprintf(t[i].path, sizeof(t[i].path), "/cold%d.bin", next_cold++ % COLD_PATHS);
+  }
+  timed_gets(t, n);
+}
+
+// Admission: one slow worker and room for one more job. With reject the rest
+// get ERROR right away; with block they all wait their turn and get the file.
+static void admission_checks() {
+  char opts[64];
+  timed_t t[ADMIT_CLIENTS];
+  snprintf(opts, sizeof(opts), "-t 1 -q 1 -d %d", ADMIT_DELAY_MS * 1000);
+  if (start_server(opts, NULL, 0) < 0) {
+    check(0, "admission server starts");
+    return;
+  }
+  cold_gets(t, ADMIT_CLIENTS);
+  int ok = 1, fast = 1, errors = 0;
+  for (int i = 0; i < ADMIT_CLIENTS; i++) {
+    if (t[i].rc == 0 && strcmp(t[i].r.status, "ERROR") == 0) {
+      errors++;
+      fast = fast && t[i].ms < ADMIT_DELAY_MS / 2;
+    } else {
+      ok = ok && t[i].rc == 0 && is_file(&t[i].r, COLD_FILE);
+    }
+    reply_free(&t[i].r);
+  }
+  check(ok && errors > 0, "admission: a full queue turns requests away");
+  check(errors > 0 && fast, "admission: ... right away");
+  stop_server();
+  check(log_counter("requests shed:") == errors, "admission: turned away requests counted");
+
+  snprintf(opts, sizeof(opts), "-t 1 -q 1 -Q block -d %d", ADMIT_DELAY_MS * 1000 / 3);
+  if (start_server(opts, NULL, 0) < 0) {
+    check(0, "admission server starts");
+    return;
+  }
+  cold_gets(t, ADMIT_CLIENTS);
+  ok = 1;
+  for (int i = 0; i < ADMIT_CLIENTS; i++) {
+    ok = ok && t[i].rc == 0 && is_file(&t[i].r, COLD_FILE);
+    reply_free(&t[i].r);
+  }
+  check(ok, "admission: with -Q block everyone gets served");
+  stop_server();
+  check(log_counter("acceptor blocked:") > 0, "admission: ... after the acceptor waited");
+}
+
+// Cutting proxy: passes one request per connection on to the server and the
+// reply back, except that a whole-file request for the biggest file is cut off
+// part way through its body
+static int proxy_fd = -1;
+
+static void *proxy_conn(void *arg) {
+  int cfd = (int)(intptr_t)arg;
+  char req[HEADER_MAX + 1];
+  size_t have = 0;
+  while (have < HEADER_MAX && (have < 4 || memcmp(req + have - 4, "\r\n\r\n", 4) != 0) &&
+         recv(cfd, req + have, 1, 0) == 1) {
+    have++;
+  }
+  req[have] = '\0';
+  char big[32];
+  snprintf(big, sizeof(big), "/f%zu.bin ", file_sizes[BIGGEST]);
+  int cut = strstr(req, big) && !strstr(req, "RANGE");
+
+  int sfd = connect_server(0);
+  char buf[64 << 10];
+  size_t passed = 0;
+  if (sfd >= 0 && write_all(sfd, req, have) == 0) {
+    ssize_t n;
+    while ((!cut || passed < CUT_AFTER) && (n = recv(sfd, buf, sizeof(buf), 0)) > 0 &&
+           write_all(cfd, buf, (size_t)n) == 0) {
+      passed += (size_t)n;
+    }
+  }
+  if (sfd >= 0) {
+    close(sfd);
+  }
+  close(cfd);
+  return NULL;
+}
+
+static void *proxy_accept(void *arg) {
+  (void)arg;
+  int cfd;
+  while ((cfd = accept(proxy_fd, NULL, NULL)) >= 0) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, proxy_conn, (void *)(intptr_t)cfd);
+    pthread_detach(tid);
+  }
+  return NULL;
+}
+
+// Listen on the port after the server's. Returns -1 if that didn't work.
+static int start_proxy(pthread_t *tid) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons((unsigned short)(port + 1));
+  int one = 1;
+  proxy_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (proxy_fd < 0 || setsockopt(proxy_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+      bind(proxy_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(proxy_fd, 64) < 0 ||
+      pthread_create(tid, NULL, proxy_accept, NULL) != 0) {
+    if (proxy_fd >= 0) {
+      close(proxy_fd);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+static void stop_proxy(pthread_t tid) {
+  shutdown(proxy_fd, SHUT_RDWR);  // wakes the accept
+  pthread_join(tid, NULL);
+  close(proxy_fd);
+}
+
+// gfclient_download picks a cut-off download up where it broke off
+static void resume_checks(const char *client) {
+  pthread_t tid;
+  if (start_server("", NULL, 0) < 0 || start_proxy(&tid) < 0) {
+    check(0, "resume: server and proxy start");
+    stop_server();
+    return;
+  }
+  run_client(client, (unsigned short)(port + 1), "resume");
+  stop_proxy(tid);
+  stop_server();
+
+  char cmd[600];
+  snprintf(cmd, sizeof(cmd), "grep -q '^Resuming .*/f%zu.bin at byte' %s/client.log",
+           file_sizes[BIGGEST], dir);
+  check(system(cmd) == 0, "resume: the client asked for the rest");
+}
+
+// Header and send deadlines under each engine - the ones with a send path of
+// their own run uncached, so the file sends are what stalls
+static const char *deadline_modes[] = { "", "-e -W 0 -c 0", "-u -W 0 -c 0" };
+
+// 1 if the server hangs up within ms, having sent nothing - or just INVALID,
+// which is how the blocking loop lets a header that ran out of time go
+static int hung_up_within(int fd, long ms) {
+  char buf[HEADER_MAX];
+  size_t have = 0;
+  uint64_t end = now_ms() + (uint64_t)ms;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  while (have < sizeof(buf) && now_ms() < end && poll(&pfd, 1, (int)(end - now_ms())) == 1) {
+    ssize_t n = recv(fd, buf + have, sizeof(buf) - have, 0);
+    if (n <= 0) {
+      return have == 0 || (have >= 15 && memcmp(buf, "GETFILE INVALID", 15) == 0);
+    }
+    have += (size_t)n;
+  }
+  return 0;
+}
+
+// TCP state of the server's end of our connection fd, from /proc/net/tcp
+// (1 is established), or -1 if it's not there
+static int server_state(int fd) {
+  struct sockaddr_in me;
+  socklen_t len = sizeof(me);
+  if (getsockname(fd, (struct sockaddr *)&me, &len) < 0) {
+    return -1;
+  }
+  FILE *f = fopen("/proc/net/tcp", "r");
+  char line[256];
+  int state = -1;
+  while (f && state < 0 && fgets(line, sizeof(line), f)) {
+    unsigned long laddr, raddr;
+    unsigned lport, rport, st;
+    if (sscanf(line, " %*d: %lx:%x %lx:%x %x", &laddr, &lport, &raddr, &rport, &st) == 5 &&
+        lport == port && rport == ntohs(me.sin_port)) {
+      state = (int)st;
+    }
+  }
+  if (f) {
+    fclose(f);
+  }
+  return state;
+}
+
+// A client that stops reading part way through the biggest file is cut off.
+// The server's send buffer keeps growing for a while, and that counts as
+// progress, so wait for its end to actually give up before draining what's
+// there - which then comes up short.
+static int stall_gets_cut() {
+  int fd = connect_server(4096);
+  reply_t r;
+  int ok = fd >= 0 && send_file_request(fd, BIGGEST, "") == 0 && read_header(fd, &r) == 0 &&
+           r.len == file_sizes[BIGGEST];
+  uint64_t end = now_ms() + DEADLINE_SECONDS * 1000 + 10 * SOON_MS;
+  while (ok && server_state(fd) == 1 && now_ms() < end) {
+    nap_ms(50);
+  }
+  char buf[64 << 10];
+  size_t got = 0;
+  ssize_t n;
+  while (ok && (n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    got += (size_t)n;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return ok && got < r.len;
+}
+
+static void *stalled_reader(void *arg) {
+  (void)arg;
+  return (void *)(intptr_t)(stall_gets_cut() ? 0 : -1);
+}
+
+static void deadline_checks() {
+  for (size_t m = 0; m < sizeof(deadline_modes) / sizeof(deadline_modes[0]); m++) {
+    char opts[128], label[64];
+    snprintf(opts, sizeof(opts), "%s -r %d -w %d", deadline_modes[m], DEADLINE_SECONDS,
+             DEADLINE_SECONDS);
+    if (start_server(opts, NULL, 0) < 0) {
+      check(0, "deadline server starts");
+      continue;
+    }
+    const char *name = *deadline_modes[m] ? deadline_modes[m] : "blocking";
+
+    int fd = connect_server(0);
+    const char *half = "GETFILE GET /f1";
+    uint64_t start = now_ms();
+    int ok = fd >= 0 && write_all(fd, half, strlen(half)) == 0 &&
+             hung_up_within(fd, DEADLINE_SECONDS * 1000 + 2 * SOON_MS) &&
+             now_ms() - start >= DEADLINE_SECONDS * 1000 - 100;
+    if (fd >= 0) {
+      close(fd);
+    }
+    snprintf(label, sizeof(label), "deadline: header (%s)", name);
+    check(ok, label);
+
+    // Others are served while the stalled one waits out its deadline
+    pthread_t tid;
+    pthread_create(&tid, NULL, stalled_reader, NULL);
+    nap_ms(SOON_MS / 2);
+    start = now_ms();
+    ok = get_file(1, 0, 0) == 0 && now_ms() - start < SOON_MS;
+    void *rc;
+    pthread_join(tid, &rc);
+    snprintf(label, sizeof(label), "deadline: send (%s)", name);
+    check(rc == NULL, label);
+    snprintf(label, sizeof(label), "deadline: others served (%s)", name);
+    check(ok, label);
+    stop_server();
+  }
+}
+
+// Adaptive pool: starting from one worker, a burst of slow lookups makes it
+// grow, so the burst takes far less than one worker would need. Left idle,
+// it shrinks again.
+static void pool_checks() {
+  char opts[64];
+  timed_t t[POOL_MAX];
+  snprintf(opts, sizeof(opts), "-t 1 -T 1:%d -d %d", POOL_MAX, POOL_DELAY_MS * 1000);
+  if (start_server(opts, NULL, 0) < 0) {
+    check(0, "pool server starts");
+    return;
+  }
+  cold_gets(t, POOL_MAX);
+  int ok = 1;
+  uint64_t slowest = 0;
+  for (int i = 0; i < POOL_MAX; i++) {
+    ok = ok && t[i].rc == 0 && is_file(&t[i].r, COLD_FILE);
+    slowest = t[i].ms > slowest ? t[i].ms : slowest;
+    reply_free(&t[i].r);
+  }
+  check(ok, "pool: a burst of slow lookups all served");
+  check(slowest < POOL_MAX * POOL_DELAY_MS * 3 / 4, "pool: ... sooner than one worker could");
+  nap_ms(SERVER_SHRINK_IDLE_MS + 2 * SOON_MS);
+  stop_server();
+  check(log_counter("pool grew:") > 0, "pool: grew for the burst");
+  check(log_counter("shrank:") > 0, "pool: shrank when idle");
+}
+
+// Writers: with a single worker, a client that stops reading the biggest file
+// only holds up a writer thread - the worker goes straight on to the next
+// request. Uncached, so the stalled body is a file send.
+static void writer_checks() {
+  if (start_server("-t 1 -W 1 -c 0", NULL, 0) < 0) {
+    check(0, "writer server starts");
+    return;
+  }
+  int fd = connect_server(4096);
+  reply_t r;
+  memset(&r, 0, sizeof(r));
+  int ok = fd >= 0 && send_file_request(fd, BIGGEST, "") == 0 && read_header(fd, &r) == 0;
+  nap_ms(SOON_MS / 2);
+  uint64_t start = now_ms();
+  check(ok && get_file(1, 0, 0) == 0 && now_ms() - start < SOON_MS,
+        "writers: a stalled reader holds up nobody");
+
+  // The stalled one still gets the lot once it reads again
+  r.body = malloc(r.len);
+  ok = ok && r.body && r.len == file_sizes[BIGGEST] && recv_all(fd, r.body, r.len) == 0 &&
+       is_file(&r, BIGGEST);
+  check(ok, "writers: ... and gets every byte when it reads");
+  reply_free(&r);
+  if (fd >= 0) {
+    close(fd);
+  }
+  stop_server();
+}
+
+// A request queued behind the blocker. Big ones read their header and then
+// stop until released, which leaves the only worker stuck sending the body.
+typedef struct {
+  timed_t t;
+  int big;
+  int done;
+} queued_t;
+
+static int queue_released = 0;
+
+static void *queued_get(void *arg) {
+  queued_t *q = arg;
+  if (!q->big) {
+    timed_get(&q->t);
+  } else {
+    int fd = connect_server(4096);
+    memset(&q->t.r, 0, sizeof(q->t.r));
+    q->t.rc = -1;
+    if (fd >= 0 && send_file_request(fd, BIGGEST, "") == 0 && read_header(fd, &q->t.r) == 0) {
+      while (!__atomic_load_n(&queue_released, __ATOMIC_ACQUIRE)) {
+        nap_ms(10);
+      }
+      q->t.rc = read_body(fd, &q->t.r, 0);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  __atomic_store_n(&q->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// One worker, held up by a slow cold lookup while two requests for the
+// biggest file and then two for a small one queue behind it. Returns how many
+// of the small ones were served while the big readers were stalled, or -1 if
+// anything failed.
+static int smalls_served(const char *policy) {
+  char opts[64];
+  snprintf(opts, sizeof(opts), "-t 1 -W 0 -c 0 -P 0 -S %s -d %d", policy, SRPT_DELAY_MS * 1000);
+  if (start_server(opts, NULL, 0) < 0) {
+    return -1;
+  }
+  // The queue ranks by the sizes of files already looked up
+  int ok = get_file(BIGGEST, 0, 0) == 0 && get_file(1, 0, 0) == 0;
+
+  timed_t blocker;
+  queued_t q[4];
+  pthread_t blocker_tid, tids[4];
+  snprintf(blocker.path, sizeof(blocker.path), "/cold%d.bin", next_cold++ % COLD_PATHS);
+  pthread_create(&blocker_tid, NULL, timed_get, &blocker);
+  nap_ms(SRPT_DELAY_MS / 6);
+  __atomic_store_n(&queue_released, 0, __ATOMIC_RELEASE);
+  for (int i = 0; i < 4; i++) {
+    memset(&q[i], 0, sizeof(q[i]));
+    q[i].big = i < 2;
+    snprintf(q[i].t.path, sizeof(q[i].t.path), "/f%zu.bin", file_sizes[1]);
+    pthread_create(&tids[i], NULL, queued_get, &q[i]);
+    nap_ms(SRPT_GAP_MS);
+  }
+
+  nap_ms(SRPT_DELAY_MS + SOON_MS);
+  int served = 0;
+  for (int i = 2; i < 4; i++) {
+    served += __atomic_load_n(&q[i].done, __ATOMIC_ACQUIRE);
+  }
+  __atomic_store_n(&queue_released, 1, __ATOMIC_RELEASE);
+
+  pthread_join(blocker_tid, NULL);
+  ok = ok && blocker.rc == 0 && is_file(&blocker.r, COLD_FILE);
+  reply_free(&blocker.r);
+  for (int i = 0; i < 4; i++) {
+    pthread_join(tids[i], NULL);
+    ok = ok && q[i].t.rc == 0 && is_file(&q[i].t.r, q[i].big ? BIGGEST : 1);
+    reply_free(&q[i].t.r);
+  }
+  stop_server();
+  return ok ? served : -1;
+}
+
+// SRPT: small requests overtake big ones queued just before them, where
+// FIFO serves them in the order they came
+static void srpt_checks() {
+  check(smalls_served("srpt") == 2, "srpt: small requests jump the queue");
+  check(smalls_served("fifo") == 0, "srpt: ... and don't with -S fifo");
+}
+
+// Single flight: a burst of requests for one cold path shares a single slow
+// lookup, so with two workers it takes about one delay instead of three
+static void flight_checks() {
+  char opts[64];
+  timed_t t[ADMIT_CLIENTS];
+  snprintf(opts, sizeof(opts), "-t 2 -d %d", ADMIT_DELAY_MS * 1000);
+  if (start_server(opts, NULL, 0) < 0) {
+    check(0, "flight server starts");
+    return;
+  }
+  int cold = next_cold++ % COLD_PATHS;
+  for (int i = 0; i < ADMIT_CLIENTS; i++) {
+    snprintf(t[i].path, sizeof(t[i].path), "/cold%d.bin", cold);
+  }
+  timed_gets(t, ADMIT_CLIENTS);
+  int ok = 1;
+  uint64_t slowest = 0;
+  for (int i = 0; i < ADMIT_CLIENTS; i++) {
+    ok = ok && t[i].rc == 0 && is_file(&t[i].r, COLD_FILE);
+    slowest = t[i].ms > slowest ? t[i].ms : slowest;
+    reply_free(&t[i].r);
+  }
+  check(ok, "flight: one cold file for everyone at once");
+  check(slowest < ADMIT_DELAY_MS * 2, "flight: ... in about one lookup's time");
+  stop_server();
+  check(log_counter("lookups coalesced:") > 0, "flight: lookups coalesced");
+}
+
+// Metadata cache: with -V 0 every hit checks the file again, so one rewritten
+// in place is served as it is now - bigger or smaller - not from the old size
+// or the old cached bytes
+static void metadata_checks() {
+  if (write_changing(2) < 0 || start_server("-V 0", NULL, 0) < 0) {
+    check(0, "metadata server starts");
+    return;
+  }
+  reply_t r;
+  int ok = get("/changing.bin", "", &r) == 0 && is_file(&r, 2);
+  reply_free(&r);
+  ok = ok && write_changing(9) == 0 && get("/changing.bin", "", &r) == 0 && is_file(&r, 9);
+  reply_free(&r);
+  check(ok, "metadata: a file that grew is served whole");
+  ok = ok && write_changing(2) == 0 && get("/changing.bin", "", &r) == 0 && is_file(&r, 2);
+  reply_free(&r);
+  check(ok, "metadata: ... and one that shrank");
+  stop_server();
+  check(log_counter("changed:") >= 2, "metadata: changes counted");
+}
+
+// Compression: a client that offers DEFLATE gets text compressed, with the
+// file's own length in the header, and random bytes as they are
+static void deflate_checks() {
+  if (start_server("", NULL, 0) < 0) {
+    check(0, "deflate server starts");
+    return;
+  }
+  reply_t r;
+  size_t orig = 0;
+  uLongf inflated = TEXT_SIZE;
+  char *out = malloc(TEXT_SIZE);
+  int ok = out && get("/text.txt", " DEFLATE", &r) == 0 && strcmp(r.status, "OK") == 0 &&
+           sscanf(r.opts, " DEFLATE %zu", &orig) == 1 && orig == TEXT_SIZE && r.len < TEXT_SIZE;
+  check(ok, "deflate: text comes back compressed");
+  ok = ok && uncompress((Bytef *)out, &inflated, (const Bytef *)r.body, r.len) == Z_OK &&
+       inflated == TEXT_SIZE && memcmp(out, text, TEXT_SIZE) == 0;
+  check(ok, "deflate: ... and inflates to the file");
+  reply_free(&r);
+  free(out);
+
+  char path[32];
+  snprintf(path, sizeof(path), "/f%zu.bin", file_sizes[9]);
+  ok = get(path, " DEFLATE", &r) == 0 && is_file(&r, 9) && strstr(r.opts, "DEFLATE") == NULL;
+  check(ok, "deflate: random bytes come back as they are");
+  reply_free(&r);
+  ok = get("/text.txt", "", &r) == 0 && strcmp(r.status, "OK") == 0 && r.len == TEXT_SIZE &&
+       memcmp(r.body, text, TEXT_SIZE) == 0;
+  check(ok, "deflate: only when the client asks");
+  reply_free(&r);
+  stop_server();
+}
+
+// Prefetching: requests that keep coming in the same order teach the server
+// what follows what, so it looks the next file up before it's asked for. Off
+// with -P 0.
+static int prefetched_after_pairs(const char *opts) {
+  if (start_server(opts, NULL, 0) < 0) {
+    return -1;
+  }
+  int ok = 1;
+  for (int i = 0; i < 8; i++) {
+    ok = ok && get_file(2, 0, 0) == 0 && get_file(9, 0, 0) == 0;
+  }
+  stop_server();
+  return ok ? (int)log_counter("prefetched:") : -1;
+}
+
+static void prefetch_checks() {
+  check(prefetched_after_pairs("-P 2") > 0, "prefetch: a file that always follows is fetched");
+  check(prefetched_after_pairs("-P 0") == 0, "prefetch: ... and not with -P 0");
+}
+
+// The admin port's reply to GET path, status line to the end - NULL if there
+// wasn't one. It's NUL-terminated as well, for replies that are text.
+static char *scrape(const char *path, size_t *out_len) {
+  int fd = connect_to((unsigned short)(port + 2), 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  char req[HEADER_MAX];
+  int n = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n\r\n", path);
+  size_t len = 0, size = 64 << 10;
+  char *buf = write_all(fd, req, (size_t)n) == 0 ? malloc(size) : NULL;
+  for (ssize_t got = 1; buf && got > 0; len += (size_t)got) {
+    if (len + 1 == size) {
+      char *bigger = realloc(buf, size *= 2);
+      if (!bigger) {
+        free(buf);
+        buf = NULL;
+        break;
+      }
+      buf = bigger;
+    }
+    got = recv(fd, buf + len, size - 1 - len, 0);
+    got = got < 0 ? 0 : got;
+  }
+  close(fd);
+  if (buf) {
+    buf[len] = '\0';
+    *out_len = len;
+  }
+  return buf;
+}
+
+static int scrape_has(const char *path, const char *status, const char *text) {
+  size_t len;
+  char *reply = scrape(path, &len);
+  int ok = reply && strncmp(reply, status, strlen(status)) == 0 && strstr(reply, text);
+  free(reply);
+  return ok;
+}
+
+static int open_fds(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+  DIR *d = opendir(path);
+  int n = 0;
+  while (d && readdir(d)) {
+    n++;
+  }
+  if (d) {
+    closedir(d);
+  }
+  return d ? n : -1;
+}
+
+// Admin port: /metrics has the stage histograms, anything else is a 404 that
+// lists what's there, and scrapers that hang up early don't leave sockets
+// behind
+static void admin_checks() {
+  char opts[32];
+  snprintf(opts, sizeof(opts), "-M %u", port + 2);
+  if (start_server(opts, NULL, 0) < 0) {
+    check(0, "admin server starts");
+    return;
+  }
+  int ok = get_file(1, 0, 0) == 0;
+  ok = ok && scrape_has("/metrics", "HTTP/1.0 200", "gf_stage_seconds_bucket{stage=\"queue_wait\"");
+  ok = ok && scrape_has("/metrics", "HTTP/1.0 200", "gf_stage_seconds_count{stage=\"queue_wait\"}");
+  check(ok, "admin: /metrics has the stage histograms");
+  check(scrape_has("/metrics?x=1", "HTTP/1.0 200", "gf_"), "admin: ... and ignores parameters");
+  check(scrape_has("/nope", "HTTP/1.0 404", "/metrics\n"),
+        "admin: an unknown path lists the routes");
+
+  // Half of them hang up before asking, the rest reset right after asking
+  int before = open_fds(server_pid);
+  for (int i = 0; i < ABORTED_SCRAPES; i++) {
+    int fd = connect_to((unsigned short)(port + 2), 0);
+    if (fd < 0) {
+      continue;
+    }
+    if (i % 2) {
+      struct linger lg = { 1, 0 };
+      setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+      write_all(fd, "GET /metrics HTTP/1.0\r\n\r\n", 27);
+    }
+    close(fd);
+  }
+  // Scrapes are answered one at a time, so this one comes after all of those
+  ok = scrape_has("/metrics", "HTTP/1.0 200", "gf_");
+  check(ok && before > 0 && open_fds(server_pid) == before,
+        "admin: aborted scrapes don't leak sockets");
+  stop_server();
+}
+
+// Requests a trace dump saw finish, or -1 if it isn't one
+static int traced_requests(const char *dump, size_t len) {
+  trace_file_header_t hdr;
+  if (len < sizeof(hdr)) {
+    return -1;
+  }
+  memcpy(&hdr, dump, sizeof(hdr));
+  len -= sizeof(hdr);
+  if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.record_size != sizeof(trace_record_t) || len % sizeof(trace_record_t) != 0) {
+    return -1;
+  }
+  int done = 0;
+  for (size_t off = sizeof(hdr); off < sizeof(hdr) + len; off += sizeof(trace_record_t)) {
+    trace_record_t rec;
+    memcpy(&rec, dump + off, sizeof(rec));
+    done += rec.event == TRACE_LAST_BYTE;
+  }
+  return done;
+}
+
+// Tracing: the timelines come out of /trace on the admin port, and into the
+// dump file on SIGUSR1
+static void trace_checks() {
+  char opts[600], path[512];
+  snprintf(path, sizeof(path), "%s/trace.bin", dir);
+  snprintf(opts, sizeof(opts), "-x %s -M %u", path, port + 2);
+  if (start_server(opts, NULL, 0) < 0) {
+    check(0, "trace server starts");
+    return;
+  }
+  int ok = 1;
+  for (size_t i = 0; i < 3; i++) {
+    ok = ok && get_file(i, 0, 0) == 0;
+  }
+
+  size_t len = 0;
+  char *reply = scrape("/trace", &len);
+  char *body = reply ? strstr(reply, "\r\n\r\n") : NULL;
+  ok = ok && body && strncmp(reply, "HTTP/1.0 200", 12) == 0;
+  ok = ok && traced_requests(body + 4, len - (size_t)(body + 4 - reply)) >= 3;
+  check(ok, "trace: /trace has every request");
+  free(reply);
+
+  // The dump thread writes the file when the signal comes
+  unlink(path);
+  kill(server_pid, SIGUSR1);
+  ok = 0;
+  for (int tries = 0; !ok && tries < SOON_MS / 10; tries++) {
+    nap_ms(10);
+    FILE *f = fopen(path, "r");
+    char dump[64 << 10];
+    len = f ? fread(dump, 1, sizeof(dump), f) : 0;
+    ok = f && traced_requests(dump, len) >= 3;
+    if (f) {
+      fclose(f);
+    }
+  }
+  check(ok, "trace: SIGUSR1 writes the dump file");
+  stop_server();
+}
+
+// epoll loop: a client that stalls halfway through its header only holds up itself
+static void epoll_checks() {
+  if (start_server("-e", NULL, 0) < 0) {
+    check(0, "epoll server starts");
+    return;
+  }
+  int stalled = connect_server(0);
+  const char *half = "GETFILE GET /f1";
+  int ok = stalled >= 0 && write_all(stalled, half, strlen(half)) == 0;
+  uint64_t start = now_ms();
+  ok = ok && get_file(1, 0, 0) == 0 && now_ms() - start < SOON_MS;
+  check(ok, "epoll: a stalled header doesn't block others");
+  if (stalled >= 0) {
+    close(stalled);
+  }
+  stop_server();
+}
+
+int main(int argc, char **argv) {
+  const char *client = NULL;
+  int option_char = 0;
+
+  while ((option_char = getopt_long(argc, argv, "s:c:p:n:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 's':
+        server = optarg;
+        break;
+      case 'c':
+        client = optarg;
+        break;
+      case 'p':
+        port = (unsigned short)atoi(optarg);
+        break;
+      case 'n':
+        rounds = atoi(optarg);
+        break;
+      case 'h':
+        fprintf(stdout, "%s", USAGE);
+        exit(0);
+      default:
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+    }
+  }
+  if (rounds < 1) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  if (make_files() < 0) {
+    perror("Unable to set up the test files");
+    remove_files();
+    exit(1);
+  }
+
+  // The client runs from the download directory
+  char *client_path = client ? realpath(client, NULL) : NULL;
+  if (client && !client_path) {
+    fprintf(stderr, "Can't find %s\n", client);
+    exit(1);
+  }
+
+  // Downloads under every mode, or just the one we were given
+  int nmodes = optind < argc ? 1 : (int)NMODES;
+  for (int m = 0; m < nmodes; m++) {
+    char **extra = optind < argc ? argv + optind : NULL;
+    int nextra = optind < argc ? argc - optind : 0;
+    const char *opts = optind < argc ? "" : modes[m];
+    fprintf(stdout, "server options:%s%s", *opts ? " " : "", opts);
+    for (int i = 0; i < nextra; i++) {
+      fprintf(stdout, " %s", extra[i]);
+    }
+    fprintf(stdout, "%s\n", *opts || nextra ? "" : " (defaults)");
+    if (start_server(opts, extra, nextra) < 0) {
+      failures++;
+      continue;
+    }
+    downloads(client_path);
+    parser_checks();
+    range_checks();
+    stop_server();
+  }
+
+  fprintf(stdout, "features\n");
+  epoll_checks();
+  keepalive_checks();
+  mux_checks();
+  admission_checks();
+  deadline_checks();
+  pool_checks();
+  writer_checks();
+  srpt_checks();
+  flight_checks();
+  metadata_checks();
+  deflate_checks();
+  prefetch_checks();
+  admin_checks();
+  trace_checks();
+  if (client_path) {
+    resume_checks(client_path);
+  }
+
+  if (failures) {
+    fprintf(stdout, "FAILED - files and logs left in %s\n", dir);
+  } else {
+    remove_files();
+    fprintf(stdout, "all ok\n");
+  }
+  for (size_t i = 0; i < NFILES; i++) {
+    free(files[i]);
+  }
+  free(client_path);
+  return failures ? 1 : 0;
+}
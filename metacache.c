@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "metacache.h"
+
+#define METACACHE_SHARDS 64
+#define METACACHE_BUCKETS 256  // hash chains per shard, power of two
+
+typedef struct meta_entry {
+    struct meta_entry *hnext;
+    uint64_t hash;
+    int fd;
+    size_t size;
+    struct timespec mtime;
+    uint64_t checked_ns;  // last time we know it was right
+    char path[];
+} meta_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    meta_entry_t *buckets[METACACHE_BUCKETS];
+    size_t entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long rechecks;
+    unsigned long changes;
+} meta_shard_t;
+
+struct metacache {
+    uint64_t recheck_ns;
+    meta_shard_t shards[METACACHE_SHARDS];
+};
+
+// FNV-1a
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *path; path++) {
+        h = (h ^ (unsigned char)*path) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Coarse is plenty for a recheck interval, and it's a vDSO read rather than a syscall
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static meta_shard_t *shard_for(metacache_t *m, uint64_t hash) {
+    return &m->shards[(hash >> 32) % METACACHE_SHARDS];
+}
+
+static meta_entry_t **bucket_for(meta_shard_t *s, uint64_t hash) {
+    return &s->buckets[hash & (METACACHE_BUCKETS - 1)];
+}
+
+// Link to the entry for path (or to the NULL at the end of its chain), shard lock held
+static meta_entry_t **shard_find(meta_shard_t *s, uint64_t hash, const char *path) {
+    meta_entry_t **link = bucket_for(s, hash);
+    while (*link && ((*link)->hash != hash || strcmp((*link)->path, path) != 0)) {
+        link = &(*link)->hnext;
+    }
+    return link;
+}
+
+static void fill_info(const meta_entry_t *e, metacache_info_t *out) {
+    out->fd = e->fd;
+    out->size = e->size;
+    out->mtime = e->mtime;
+    out->changed = 0;
+}
+
+metacache_t *metacache_create(unsigned recheck_ms) {
+    metacache_t *m = calloc(1, sizeof(metacache_t));
+    if (!m) {
+        return NULL;
+    }
+    m->recheck_ns = (uint64_t)recheck_ms * 1000000ull;
+    for (int i = 0; i < METACACHE_SHARDS; i++) {
+        pthread_mutex_init(&m->shards[i].lock, NULL);
+    }
+    return m;
+}
+
+void metacache_destroy(metacache_t *m) {
+    if (!m) {
+        return;
+    }
+    for (int i = 0; i < METACACHE_SHARDS; i++) {
+        meta_shard_t *s = &m->shards[i];
+        for (int b = 0; b < METACACHE_BUCKETS; b++) {
+            meta_entry_t *e = s->buckets[b];
+            while (e) {
+                meta_entry_t *next = e->hnext;
+                free(e);
+                e = next;
+            }
+        }
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(m);
+}
+
+int metacache_get(metacache_t *m, const char *path, metacache_info_t *out) {
+    uint64_t hash = hash_path(path);
+    meta_shard_t *s = shard_for(m, hash);
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&s->lock);
+    meta_entry_t *e = *shard_find(s, hash, path);
+    if (!e) {
+        s->misses++;
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    s->hits++;
+    fill_info(e, out);
+    if (now < e->checked_ns + m->recheck_ns) {
+        pthread_mutex_unlock(&s->lock);
+        return 1;
+    }
+
+    // Due a recheck. Mark it done first so nobody else piles in meanwhile,
+    // and do the fstat without holding the shard.
+    e->checked_ns = now;
+    s->rechecks++;
+    pthread_mutex_unlock(&s->lock);
+
+    struct stat st;
+    int ok = fstat(out->fd, &st) == 0;
+
+    pthread_mutex_lock(&s->lock);
+    meta_entry_t **link = shard_find(s, hash, path);
+    if (!ok) {
+        if (*link) {
+            e = *link;
+            *link = e->hnext;
+            s->entries--;
+            free(e);
+        }
+        s->hits--;
+        s->misses++;
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    if ((size_t)st.st_size != out->size || st.st_mtim.tv_sec != out->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != out->mtime.tv_nsec) {
+        s->changes++;
+        if (*link) {
+            (*link)->size = (size_t)st.st_size;
+            (*link)->mtime = st.st_mtim;
+        }
+        out->size = (size_t)st.st_size;
+        out->mtime = st.st_mtim;
+        out->changed = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+int metacache_put(metacache_t *m, const char *path, int fd, const struct stat *st) {
+    uint64_t hash = hash_path(path);
+    meta_shard_t *s = shard_for(m, hash);
+
+    size_t plen = strlen(path) + 1;
+    meta_entry_t *fresh = malloc(sizeof(meta_entry_t) + plen);
+    if (!fresh) {
+        return 0;  // just means the next request does its own lookup
+    }
+    memcpy(fresh->path, path, plen);
+    fresh->hash = hash;
+    fresh->fd = fd;
+    fresh->size = (size_t)st->st_size;
+    fresh->mtime = st->st_mtim;
+    fresh->checked_ns = now_ns();
+
+    pthread_mutex_lock(&s->lock);
+    meta_entry_t **link = shard_find(s, hash, path);
+    if (*link) {
+        // Already there - refresh it in place
+        (*link)->fd = fd;
+        (*link)->size = fresh->size;
+        (*link)->mtime = fresh->mtime;
+        (*link)->checked_ns = fresh->checked_ns;
+        pthread_mutex_unlock(&s->lock);
+        free(fresh);
+        return 0;
+    }
+    fresh->hnext = NULL;
+    *link = fresh;
+    s->entries++;
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+void metacache_stats(metacache_t *m, metacache_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < METACACHE_SHARDS; i++) {
+        meta_shard_t *s = &m->shards[i];
+        pthread_mutex_lock(&s->lock);
+        out->hits += s->hits;
+        out->misses += s->misses;
+        out->rechecks += s->rechecks;
+        out->changes += s->changes;
+        out->entries += s->entries;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
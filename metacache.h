@@ -0,0 +1,44 @@
+#ifndef METACACHE_H
+#define METACACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// What content_get + fstat told us about a path, kept so a request can send
+// its header without either. Entries are trusted for a while, then checked
+// again with one fstat on the fd we already have - content.c keeps its fds
+// open, so the fd itself never goes stale, only what's behind it.
+typedef struct metacache metacache_t;
+
+typedef struct {
+    int fd;
+    size_t size;
+    struct timespec mtime;
+    int changed;  // the recheck just now found a different size or mtime
+} metacache_info_t;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long rechecks;  // fstats done to revalidate
+    unsigned long changes;   // rechecks that found the file different
+    size_t entries;
+} metacache_stats_t;
+
+// Entries older than recheck_ms get an fstat before they're used again;
+// 0 checks every time. NULL on failure.
+metacache_t *metacache_create(unsigned recheck_ms);
+void metacache_destroy(metacache_t *m);
+
+// 1 and *out filled in on a hit, 0 on a miss (counted). An entry whose fd
+// can't be stat'ed any more is dropped and reported as a miss.
+int metacache_get(metacache_t *m, const char *path, metacache_info_t *out);
+
+// Remember a successful lookup. 1 if the path is new to the cache, 0 if an
+// entry was refreshed (or there was no memory for a new one).
+int metacache_put(metacache_t *m, const char *path, int fd, const struct stat *st);
+
+void metacache_stats(metacache_t *m, metacache_stats_t *out);
+
+#endif
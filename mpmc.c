@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "mpmc.h"
+
+#define MPMC_SPINS 128  // quick retries before going to sleep
+#define CACHE_LINE 64
+
+typedef struct {
+    size_t seq;  // which lap of the ring this slot is ready for
+    void *item;
+} mpmc_cell_t;
+
+// Event count - sleepers note the epoch, re-check the queue, then wait for it to move.
+// Only one wakeup is in flight at a time: a burst of pushes wakes one sleeper, and
+// that one passes the baton on if it leaves work behind.
+typedef struct {
+    uint32_t epoch;
+    uint32_t waiters;
+    uint32_t signalled;  // a sleeper has been woken and hasn't run yet
+} mpmc_park_t;
+
+struct mpmc {
+    mpmc_cell_t *cells;
+    size_t cap;
+    int closed;
+    int spins;  // 0 on a single CPU - nobody else can make progress while we spin
+
+    // each end on its own cache line so producers and consumers don't fight over it
+    size_t head __attribute__((aligned(CACHE_LINE)));  // next slot to push into
+    size_t tail __attribute__((aligned(CACHE_LINE)));  // next slot to pop from
+
+    mpmc_park_t not_empty __attribute__((aligned(CACHE_LINE)));
+    mpmc_park_t not_full;
+};
+
+static void futex_wait(uint32_t *addr, uint32_t val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Announce we're about to sleep. The full fence pairs with the one in park_notify:
+// either the other side sees our waiter count or we see its item on the re-check.
+static uint32_t park_prepare(mpmc_park_t *p) {
+    uint32_t epoch = __atomic_load_n(&p->epoch, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+    return epoch;
+}
+
+// Awake again (or never slept) - whoever gets here next may be woken
+static void park_cancel(mpmc_park_t *p) {
+    __atomic_sub_fetch(&p->waiters, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->signalled, 0, __ATOMIC_SEQ_CST);
+}
+
+static void park_wait(mpmc_park_t *p, uint32_t epoch) {
+    futex_wait(&p->epoch, epoch);
+    park_cancel(p);
+}
+
+static void park_notify(mpmc_park_t *p, int all) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->waiters, __ATOMIC_RELAXED) > 0 &&
+        (all || !__atomic_exchange_n(&p->signalled, 1, __ATOMIC_ACQ_REL))) {
+        __atomic_add_fetch(&p->epoch, 1, __ATOMIC_RELEASE);
+        futex_wake(&p->epoch, all ? INT_MAX : 1);
+    }
+}
+
+mpmc_t *mpmc_create(size_t capacity) {
+    if (capacity == 0) {
+        return NULL;
+    }
+
+    mpmc_t *q = aligned_alloc(CACHE_LINE, (sizeof(mpmc_t) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
+    if (!q) {
+        return NULL;
+    }
+    q->cells = malloc(capacity * sizeof(mpmc_cell_t));
+    if (!q->cells) {
+        free(q);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        q->cells[i].seq = i;
+        q->cells[i].item = NULL;
+    }
+    q->cap = capacity;
+    q->closed = 0;
+    q->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MPMC_SPINS : 0;
+    q->head = 0;
+    q->tail = 0;
+    q->not_empty.epoch = q->not_empty.waiters = q->not_empty.signalled = 0;
+    q->not_full.epoch = q->not_full.waiters = q->not_full.signalled = 0;
+    return q;
+}
+
+void mpmc_destroy(mpmc_t *q) {
+    if (q) {
+        free(q->cells);
+        free(q);
+    }
+}
+
+int mpmc_try_push(mpmc_t *q, void *item) {
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    mpmc_cell_t *cell;
+
+    while (1) {
+        cell = &q->cells[pos % q->cap];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            // Slot is free on this lap - claim it
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;  // the consumer from the last lap hasn't emptied it - full
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);  // someone beat us to it
+        }
+    }
+
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    park_notify(&q->not_empty, 0);
+    return 0;
+}
+
+void *mpmc_try_pop(mpmc_t *q) {
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    mpmc_cell_t *cell;
+
+    while (1) {
+        cell = &q->cells[pos % q->cap];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;  // nothing published here yet - empty
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    void *item = cell->item;
+    __atomic_store_n(&cell->seq, pos + q->cap, __ATOMIC_RELEASE);  // free for the next lap
+    park_notify(&q->not_full, 0);
+    return item;
+}
+
+static int is_closed(const mpmc_t *q) {
+    return __atomic_load_n(&q->closed, __ATOMIC_ACQUIRE);
+}
+
+int mpmc_push(mpmc_t *q, void *item) {
+    for (int spins = 0; ; spins++) {
+        if (is_closed(q)) {
+            return -1;
+        }
+        if (mpmc_try_push(q, item) == 0) {
+            if (mpmc_size(q) < q->cap) {
+                park_notify(&q->not_full, 0);  // still room - let the next waiting producer in
+            }
+            return 0;
+        }
+        if (spins < q->spins) {
+            cpu_relax();
+            continue;
+        }
+
+        // Re-check after announcing ourselves, or a pop in between could go unnoticed
+        uint32_t epoch = park_prepare(&q->not_full);
+        if (mpmc_try_push(q, item) == 0) {
+            park_cancel(&q->not_full);
+            if (mpmc_size(q) < q->cap) {
+                park_notify(&q->not_full, 0);
+            }
+            return 0;
+        }
+        if (is_closed(q)) {
+            park_cancel(&q->not_full);
+            return -1;
+        }
+        park_wait(&q->not_full, epoch);
+    }
+}
+
+void *mpmc_pop(mpmc_t *q) {
+    for (int spins = 0; ; spins++) {
+        void *item = mpmc_try_pop(q);
+        if (item) {
+            if (mpmc_size(q) > 0) {
+                park_notify(&q->not_empty, 0);  // more left - wake someone else for it
+            }
+            return item;
+        }
+        if (is_closed(q)) {
+            return NULL;
+        }
+        if (spins < q->spins) {
+            cpu_relax();
+            continue;
+        }
+
+        uint32_t epoch = park_prepare(&q->not_empty);
+        item = mpmc_try_pop(q);
+        if (item) {
+            park_cancel(&q->not_empty);
+            if (mpmc_size(q) > 0) {
+                park_notify(&q->not_empty, 0);
+            }
+            return item;
+        }
+        if (is_closed(q)) {
+            park_cancel(&q->not_empty);
+            continue;  // drain anything pushed before the close, then give up
+        }
+        park_wait(&q->not_empty, epoch);
+    }
+}
+
+void mpmc_close(mpmc_t *q) {
+    __atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+
+    // Bump the epochs unconditionally so nobody goes back to sleep on a stale value
+    __atomic_add_fetch(&q->not_empty.epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&q->not_full.epoch, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&q->not_empty.epoch, INT_MAX);
+    futex_wake(&q->not_full.epoch, INT_MAX);
+}
+
+size_t mpmc_size(const mpmc_t *q) {
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    return head > tail ? head - tail : 0;
+}
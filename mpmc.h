@@ -0,0 +1,35 @@
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov's ring).
+// Producers and consumers each claim a slot with one CAS on their own end, so
+// they never touch a shared lock. Threads that find the queue empty (or full)
+// spin briefly and then sleep on a futex; the other side only makes a wake
+// syscall when someone is actually asleep.
+//
+// Items are opaque pointers and can't be NULL.
+typedef struct mpmc mpmc_t;
+
+// capacity is exact (it doesn't have to be a power of two). NULL on failure.
+mpmc_t *mpmc_create(size_t capacity);
+void mpmc_destroy(mpmc_t *q);
+
+// Non-blocking: 0 / item on success, -1 / NULL if full / empty
+int mpmc_try_push(mpmc_t *q, void *item);
+void *mpmc_try_pop(mpmc_t *q);
+
+// Blocking: wait for room / an item. Return -1 / NULL once the queue is closed
+// (pop still drains whatever was queued before the close).
+int mpmc_push(mpmc_t *q, void *item);
+void *mpmc_pop(mpmc_t *q);
+
+// Wake everyone up and make blocking calls return instead of waiting
+void mpmc_close(mpmc_t *q);
+
+// Items queued right now - only a snapshot while other threads are busy
+size_t mpmc_size(const mpmc_t *q);
+
+#endif
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "steque.h"
+#include "mpmc.h"
+
+// Microbenchmark: the lock-free ring vs. the old steque + mutex/condvar queue,
+// with the same producer/consumer shape as the server's acceptor and workers
+
+#define MAX_THREADS 256
+
+#define USAGE                                                                  \
+  "usage:\n"                                                                   \
+  "  mpmc_bench [options]\n"                                                   \
+  "options:\n"                                                                 \
+  "  -h                  Show this help message\n"                             \
+  "  -p [producers]      Producer threads (Default: 1)\n"                      \
+  "  -c [consumers]      Consumer threads (Default: 16)\n"                     \
+  "  -n [items]          Items pushed in total (Default: 2000000)\n"           \
+  "  -s [capacity]       Ring capacity (Default: 65536)\n"
+
+static struct option gLongOptions[] = {
+  {"producers", required_argument, NULL, 'p'},
+  {"consumers", required_argument, NULL, 'c'},
+  {"items", required_argument, NULL, 'n'},
+  {"capacity", required_argument, NULL, 's'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+// Shared benchmark setup
+static int nproducers = 1;
+static int nconsumers = 16;
+static long nitems = 2000000;
+
+// The queue under test - exactly one of these is in use per run
+static mpmc_t *ring;
+
+static steque_t locked_queue;
+static pthread_mutex_t locked_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t locked_cv = PTHREAD_COND_INITIALIZER;
+static int locked_done = 0;
+
+// Consumers add up what they pop so the work can't be optimized away
+static uint64_t checksum = 0;
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Items are 1..nitems smuggled through the pointer, so nothing is ever NULL
+static long share(long id) {
+  return nitems / nproducers + (id < nitems % nproducers ? 1 : 0);
+}
+
+static void *ring_producer(void *arg) {
+  long id = (long)arg;
+  long count = share(id);
+  for (long i = 0; i < count; i++) {
+    mpmc_push(ring, (void *)(uintptr_t)(id + i * nproducers + 1));
+  }
+  return NULL;
+}
+
+static void *ring_consumer(void *arg) {
+  (void)arg;
+  uint64_t sum = 0;
+  void *item;
+  while ((item = mpmc_pop(ring))) {
+    sum += (uintptr_t)item;
+  }
+  __atomic_add_fetch(&checksum, sum, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void *locked_producer(void *arg) {
+  long id = (long)arg;
+  long count = share(id);
+  for (long i = 0; i < count; i++) {
+    pthread_mutex_lock(&locked_mtx);
+    steque_enqueue(&locked_queue, (void *)(uintptr_t)(id + i * nproducers + 1));
+    pthread_cond_signal(&locked_cv);
+    pthread_mutex_unlock(&locked_mtx);
+  }
+  return NULL;
+}
+
+static void *locked_consumer(void *arg) {
+  (void)arg;
+  uint64_t sum = 0;
+  while (1) {
+    pthread_mutex_lock(&locked_mtx);
+    while (steque_isempty(&locked_queue) && !locked_done) {
+      pthread_cond_wait(&locked_cv, &locked_mtx);
+    }
+    if (steque_isempty(&locked_queue)) {
+      pthread_mutex_unlock(&locked_mtx);
+      break;
+    }
+    void *item = steque_front(&locked_queue);
+    steque_pop(&locked_queue);
+    pthread_mutex_unlock(&locked_mtx);
+    sum += (uintptr_t)item;
+  }
+  __atomic_add_fetch(&checksum, sum, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+// Start everyone, wait for the producers, tell the consumers to stop once
+// they've drained the queue, and time the whole thing
+static double run(void *(*producer)(void *), void *(*consumer)(void *), void (*finish)()) {
+  pthread_t producers[MAX_THREADS];
+  pthread_t consumers[MAX_THREADS];
+
+  checksum = 0;
+  double start = now_sec();
+
+  for (long i = 0; i < nconsumers; i++) {
+    pthread_create(&consumers[i], NULL, consumer, NULL);
+  }
+  for (long i = 0; i < nproducers; i++) {
+    pthread_create(&producers[i], NULL, producer, (void *)i);
+  }
+  for (int i = 0; i < nproducers; i++) {
+    pthread_join(producers[i], NULL);
+  }
+  finish();
+  for (int i = 0; i < nconsumers; i++) {
+    pthread_join(consumers[i], NULL);
+  }
+
+  return now_sec() - start;
+}
+
+static void ring_finish() {
+  mpmc_close(ring);
+}
+
+static void locked_finish() {
+  pthread_mutex_lock(&locked_mtx);
+  locked_done = 1;
+  pthread_cond_broadcast(&locked_cv);
+  pthread_mutex_unlock(&locked_mtx);
+}
+
+static void report(const char *name, double secs) {
+  uint64_t expect = (uint64_t)nitems * (uint64_t)(nitems + 1) / 2;
+  fprintf(stdout, "%-18s %8.3f s  %8.2f Mops/s  %s\n", name, secs, nitems / secs / 1e6,
+          checksum == expect ? "ok" : "CHECKSUM MISMATCH");
+}
+
+int main(int argc, char **argv) {
+  size_t capacity = 65536;
+  int option_char = 0;
+
+  while ((option_char = getopt_long(argc, argv, "p:c:n:s:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 'p':
+        nproducers = atoi(optarg);
+        break;
+      case 'c':
+        nconsumers = atoi(optarg);
+        break;
+      case 'n':
+        nitems = atol(optarg);
+        break;
+      case 's':
+        capacity = (size_t)atol(optarg);
+        break;
+      case 'h':
+        fprintf(stdout, "%s", USAGE);
+        exit(0);
+      default:
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+    }
+  }
+
+  if (nproducers < 1 || nproducers > MAX_THREADS || nconsumers < 1 || nconsumers > MAX_THREADS ||
+      nitems < 1 || capacity < 1) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  fprintf(stdout, "%d producers, %d consumers, %ld items\n", nproducers, nconsumers, nitems);
+
+  steque_init(&locked_queue);
+  report("steque + mutex", run(locked_producer, locked_consumer, locked_finish));
+  steque_destroy(&locked_queue);
+
+  ring = mpmc_create(capacity);
+  if (!ring) {
+    fprintf(stderr, "Unable to create the ring.\n");
+    exit(1);
+  }
+  report("mpmc ring", run(ring_producer, ring_consumer, ring_finish));
+  mpmc_destroy(ring);
+
+  return 0;
+}
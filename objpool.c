@@ -0,0 +1,184 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "objpool.h"
+
+#define OBJPOOL_CACHE 64                   // objects a thread keeps to itself
+#define OBJPOOL_BATCH (OBJPOOL_CACHE / 2)  // objects moved to/from the depot at a time
+#define OBJPOOL_ALIGN 16
+
+// Free objects are chained through their first word while they sit in the depot
+typedef struct freeobj {
+    struct freeobj *next;
+} freeobj_t;
+
+typedef struct slab {
+    struct slab *next;
+} slab_t;
+
+// Per-thread stash of free objects
+typedef struct {
+    objpool_t *pool;
+    size_t n;
+    void *objs[OBJPOOL_CACHE];
+} objcache_t;
+
+struct objpool {
+    size_t objsize;
+    size_t per_slab;
+    pthread_key_t key;  // this thread's objcache_t
+
+    pthread_mutex_t lock;  // guards everything below
+    freeobj_t *depot;
+    slab_t *slabs;
+};
+
+// Move up to count objects from a cache into the depot. Caller holds the lock.
+static void depot_push(objpool_t *pool, objcache_t *cache, size_t count) {
+    while (count-- > 0 && cache->n > 0) {
+        freeobj_t *obj = cache->objs[--cache->n];
+        obj->next = pool->depot;
+        pool->depot = obj;
+    }
+}
+
+// A thread is going away - its spare objects go back to the depot
+static void cache_release(void *arg) {
+    objcache_t *cache = arg;
+    objpool_t *pool = cache->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    depot_push(pool, cache, cache->n);
+    pthread_mutex_unlock(&pool->lock);
+    free(cache);
+}
+
+static objcache_t *get_cache(objpool_t *pool) {
+    objcache_t *cache = pthread_getspecific(pool->key);
+    if (!cache) {
+        cache = malloc(sizeof(objcache_t));
+        if (!cache) {
+            return NULL;
+        }
+        cache->pool = pool;
+        cache->n = 0;
+        pthread_setspecific(pool->key, cache);
+    }
+    return cache;
+}
+
+// Carve a fresh slab straight into the depot. Caller holds the lock.
+static int depot_grow(objpool_t *pool) {
+    size_t hdr = (sizeof(slab_t) + OBJPOOL_ALIGN - 1) & ~(size_t)(OBJPOOL_ALIGN - 1);
+    slab_t *slab = malloc(hdr + pool->objsize * pool->per_slab);
+    if (!slab) {
+        return -1;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    char *base = (char *)slab + hdr;
+    for (size_t i = 0; i < pool->per_slab; i++) {
+        freeobj_t *obj = (freeobj_t *)(base + i * pool->objsize);
+        obj->next = pool->depot;
+        pool->depot = obj;
+    }
+    return 0;
+}
+
+objpool_t *objpool_create(size_t objsize, size_t per_slab) {
+    objpool_t *pool = malloc(sizeof(objpool_t));
+    if (!pool) {
+        return NULL;
+    }
+
+    if (objsize < sizeof(freeobj_t)) {
+        objsize = sizeof(freeobj_t);
+    }
+    pool->objsize = (objsize + OBJPOOL_ALIGN - 1) & ~(size_t)(OBJPOOL_ALIGN - 1);
+    pool->per_slab = per_slab > OBJPOOL_BATCH ? per_slab : OBJPOOL_BATCH;
+    pool->depot = NULL;
+    pool->slabs = NULL;
+
+    if (pthread_key_create(&pool->key, cache_release) != 0) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+// Only safe once nobody is using the pool any more. Caches of threads that are
+// still alive are dropped, not freed.
+void objpool_destroy(objpool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_key_delete(pool->key);
+
+    slab_t *slab = pool->slabs;
+    while (slab) {
+        slab_t *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void *objpool_get(objpool_t *pool) {
+    objcache_t *cache = get_cache(pool);
+    if (!cache) {
+        // No cache for this thread - take one straight from the depot
+        pthread_mutex_lock(&pool->lock);
+        freeobj_t *obj = pool->depot;
+        if (obj || depot_grow(pool) == 0) {
+            obj = pool->depot;
+            pool->depot = obj->next;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return obj;
+    }
+
+    if (cache->n == 0) {
+        // Refill a batch from the depot, growing it if it's empty
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->depot && depot_grow(pool) < 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        while (cache->n < OBJPOOL_BATCH && pool->depot) {
+            freeobj_t *obj = pool->depot;
+            pool->depot = obj->next;
+            cache->objs[cache->n++] = obj;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return cache->objs[--cache->n];
+}
+
+void objpool_put(objpool_t *pool, void *obj) {
+    if (!obj) {
+        return;
+    }
+
+    objcache_t *cache = get_cache(pool);
+    if (!cache) {
+        // No cache for this thread - straight to the depot
+        pthread_mutex_lock(&pool->lock);
+        ((freeobj_t *)obj)->next = pool->depot;
+        pool->depot = obj;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    if (cache->n == OBJPOOL_CACHE) {
+        // Full - hand a batch back so other threads can use them
+        pthread_mutex_lock(&pool->lock);
+        depot_push(pool, cache, OBJPOOL_BATCH);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    cache->objs[cache->n++] = obj;
+}
@@ -0,0 +1,23 @@
+#ifndef OBJPOOL_H
+#define OBJPOOL_H
+
+#include <stddef.h>
+
+// Fixed-size object pool. Each thread keeps a small cache of free objects, so
+// get/put on the request path is a couple of array operations with no locking
+// and no malloc. Caches trade objects in batches with a shared depot when they
+// run dry or overflow, which is what makes it cheap for objects allocated on
+// one thread (the acceptor) and freed on another (a worker).
+//
+// Memory is carved out of slabs that are only given back by objpool_destroy.
+typedef struct objpool objpool_t;
+
+// Returns NULL if the pool couldn't be set up
+objpool_t *objpool_create(size_t objsize, size_t per_slab);
+void objpool_destroy(objpool_t *pool);
+
+// Returns NULL only when a new slab can't be allocated
+void *objpool_get(objpool_t *pool);
+void objpool_put(objpool_t *pool, void *obj);
+
+#endif
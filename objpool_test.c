@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "objpool.h"
+
+// Checks for the object pool: objects are distinct, aligned and don't overlap,
+// freed ones come back before new slabs are carved, and a stress run of gets
+// and puts from several threads - with objects handed between threads to be
+// put back on one that didn't get them - never gives one object to two owners.
+// Exits non-zero if anything's off. Build with the pool,
+// e.g. gcc -O2 -pthread objpool_test.c objpool.c
+
+#define MAX_THREADS 256
+#define PER_SLAB 32                   // a slab is at least a batch in objpool.c
+#define BASIC_OBJS (PER_SLAB * 32)    // whole slabs, so there are none spare
+#define HELD 32                       // objects a stress thread holds at most
+#define EXCHANGE 1024                 // objects in transit between stress threads
+#define ALIGN 16                      // same as objpool.c
+
+#define USAGE                                                                  \
+  "usage:\n"                                                                   \
+  "  objpool_test [options]\n"                                                 \
+  "options:\n"                                                                 \
+  "  -h                  Show this help message\n"                             \
+  "  -t [threads]        Stress threads (Default: 8)\n"                        \
+  "  -n [ops]            Pool operations per thread (Default: 1000000)\n"
+
+static struct option gLongOptions[] = {
+  {"threads", required_argument, NULL, 't'},
+  {"ops", required_argument, NULL, 'n'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static int nthreads = 8;
+static long nops = 1000000;
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+  fprintf(stdout, "%-48s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+static int cmp_ptr(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)*(void *const *)a, y = (uintptr_t)*(void *const *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Get n objects of size bytes, fill each with its own byte, and check nothing
+// overlapped. Returns 1 if they're all good.
+static int get_distinct(objpool_t *pool, void **objs, int n, size_t size) {
+  int ok = 1;
+  for (int i = 0; i < n; i++) {
+    objs[i] = objpool_get(pool);
+    ok = ok && objs[i] && (uintptr_t)objs[i] % ALIGN == 0;
+    if (objs[i]) {
+      memset(objs[i], i & 0xff, size);
+    }
+  }
+  for (int i = 0; ok && i < n; i++) {
+    const unsigned char *p = objs[i];
+    for (size_t b = 0; b < size; b++) {
+      ok = ok && p[b] == (i & 0xff);
+    }
+  }
+  return ok;
+}
+
+static void basics() {
+  static void *first[BASIC_OBJS], *second[BASIC_OBJS];
+  size_t size = 40;
+  objpool_t *pool = objpool_create(size, PER_SLAB);
+  check(pool != NULL, "pool is created");
+  if (!pool) {
+    return;
+  }
+
+  check(get_distinct(pool, first, BASIC_OBJS, size), "objects are aligned and don't overlap");
+
+  objpool_put(pool, first[7]);
+  void *again = objpool_get(pool);
+  check(again == first[7], "a put object is the next one got");
+
+  for (int i = 0; i < BASIC_OBJS; i++) {
+    objpool_put(pool, first[i]);
+  }
+  int ok = get_distinct(pool, second, BASIC_OBJS, size);
+  qsort(first, BASIC_OBJS, sizeof(void *), cmp_ptr);
+  qsort(second, BASIC_OBJS, sizeof(void *), cmp_ptr);
+  check(ok && memcmp(first, second, sizeof(first)) == 0, "freed objects are used before new ones");
+  objpool_destroy(pool);
+
+  // Smaller than the pointer that chains free objects together
+  pool = objpool_create(1, PER_SLAB);
+  ok = pool != NULL && get_distinct(pool, first, BASIC_OBJS, 1);
+  for (int i = 0; ok && i < BASIC_OBJS; i++) {
+    objpool_put(pool, first[i]);
+  }
+  ok = ok && get_distinct(pool, first, BASIC_OBJS, 1);
+  check(ok, "tiny objects work too");
+  if (pool) {
+    objpool_destroy(pool);
+  }
+}
+
+// Every object says who has it and since when - an object given to two
+// threads at once gets its stamp overwritten by the other one
+typedef struct {
+  int owner;
+  long seq;
+  char pad[40];
+} obj_t;
+
+typedef struct {
+  obj_t *obj;
+  int owner;
+  long seq;
+} stamp_t;
+
+static objpool_t *shared;
+static int stress_ok = 1;
+
+static pthread_mutex_t exchange_lock = PTHREAD_MUTEX_INITIALIZER;
+static stamp_t exchange[EXCHANGE];
+static int exchanged = 0;
+static long handed_over = 0;
+
+static int stamp_intact(const stamp_t *s) {
+  return s->obj->owner == s->owner && s->obj->seq == s->seq;
+}
+
+static void fail() {
+  __atomic_store_n(&stress_ok, 0, __ATOMIC_RELAXED);
+}
+
+// Put back an object some other thread got
+static void put_exchanged() {
+  stamp_t s = { NULL, 0, 0 };
+  pthread_mutex_lock(&exchange_lock);
+  if (exchanged > 0) {
+    s = exchange[--exchanged];
+    handed_over++;
+  }
+  pthread_mutex_unlock(&exchange_lock);
+  if (s.obj) {
+    if (!stamp_intact(&s)) {
+      fail();
+    }
+    objpool_put(shared, s.obj);
+  }
+}
+
+// Leave an object for another thread to put back. Returns 0 if there's no room.
+static int hand_over(const stamp_t *s) {
+  int ok = 0;
+  pthread_mutex_lock(&exchange_lock);
+  if (exchanged < EXCHANGE) {
+    exchange[exchanged++] = *s;
+    ok = 1;
+  }
+  pthread_mutex_unlock(&exchange_lock);
+  return ok;
+}
+
+static void *stress_thread(void *arg) {
+  int self = (int)(uintptr_t)arg;
+  unsigned seed = (unsigned)self;
+  stamp_t held[HELD];
+  int nheld = 0;
+
+  for (long i = 0; i < nops; i++) {
+    int op = rand_r(&seed) % 8;
+    if (op < 4 && nheld < HELD) {
+      obj_t *o = objpool_get(shared);
+      if (!o) {
+        fail();
+        break;
+      }
+      o->owner = self;
+      o->seq = i;
+      held[nheld++] = (stamp_t){ o, self, i };
+    } else if (op < 7 && nheld > 0) {
+      int k = rand_r(&seed) % nheld;
+      stamp_t s = held[k];
+      held[k] = held[--nheld];
+      if (!stamp_intact(&s)) {
+        fail();
+      }
+      if (op == 6 || !hand_over(&s)) {
+        objpool_put(shared, s.obj);
+      }
+    } else {
+      put_exchanged();
+    }
+  }
+
+  while (nheld > 0) {
+    stamp_t *s = &held[--nheld];
+    if (!stamp_intact(s)) {
+      fail();
+    }
+    objpool_put(shared, s->obj);
+  }
+  return NULL;
+}
+
+static void stress() {
+  pthread_t threads[MAX_THREADS];
+
+  shared = objpool_create(sizeof(obj_t), PER_SLAB);
+  if (!shared) {
+    check(0, "stress: pool is created");
+    return;
+  }
+  for (long i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, stress_thread, (void *)(i + 1));
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  while (exchanged > 0) {
+    put_exchanged();
+  }
+
+  check(stress_ok, "stress: no object had two owners");
+  check(nthreads < 2 || handed_over > 0, "stress: objects were put back by other threads");
+  objpool_destroy(shared);
+}
+
+int main(int argc, char **argv) {
+  int option_char = 0;
+
+  while ((option_char = getopt_long(argc, argv, "t:n:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 't':
+        nthreads = atoi(optarg);
+        break;
+      case 'n':
+        nops = atol(optarg);
+        break;
+      case 'h':
+        fprintf(stdout, "%s", USAGE);
+        exit(0);
+      default:
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+    }
+  }
+
+  if (nthreads < 1 || nthreads > MAX_THREADS || nops < 1) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  basics();
+  fprintf(stdout, "%d threads, %ld ops each\n", nthreads, nops);
+  stress();
+
+  fprintf(stdout, "%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
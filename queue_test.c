@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mpmc.h"
+#include "wsdeque.h"
+
+// Checks for the lock-free queues: the single-threaded basics first, then a
+// stress run of each with every item tagged, so a lost, doubled or reordered
+// item shows up. Exits non-zero if anything's off. Build with the queues,
+// e.g. gcc -O2 -pthread queue_test.c mpmc.c wsdeque.c
+
+#define MAX_THREADS 256
+
+#define USAGE                                                                  \
+  "usage:\n"                                                                   \
+  "  queue_test [options]\n"                                                   \
+  "options:\n"                                                                 \
+  "  -h                  Show this help message\n"                             \
+  "  -p [producers]      mpmc producer threads (Default: 4)\n"                 \
+  "  -c [consumers]      mpmc consumer / wsdeque thief threads (Default: 4)\n" \
+  "  -n [items]          Items through each queue (Default: 1000000)\n"        \
+  "  -s [capacity]       Queue capacity - small keeps them full (Default: 64)\n"
+
+static struct option gLongOptions[] = {
+  {"producers", required_argument, NULL, 'p'},
+  {"consumers", required_argument, NULL, 'c'},
+  {"items", required_argument, NULL, 'n'},
+  {"capacity", required_argument, NULL, 's'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static int nproducers = 4;
+static int nconsumers = 4;
+static long nitems = 1000000;
+static size_t capacity = 64;
+
+static int failures = 0;
+
+// How often each item came out - has to end up exactly 1 everywhere
+static unsigned char *seen;
+
+static void check(int ok, const char *what) {
+  fprintf(stdout, "%-48s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+// Items are 1..nitems through the pointer, so nothing is ever NULL
+static void *item(long i) {
+  return (void *)(uintptr_t)(i + 1);
+}
+
+static long index_of(void *p) {
+  return (long)(uintptr_t)p - 1;
+}
+
+// Every item taken exactly once
+static int all_seen_once() {
+  for (long i = 0; i < nitems; i++) {
+    if (seen[i] != 1) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void take(void *p) {
+  __atomic_add_fetch(&seen[index_of(p)], 1, __ATOMIC_RELAXED);
+}
+
+static void mpmc_basics() {
+  mpmc_t *q = mpmc_create(5);
+  int ok = q != NULL;
+  for (long i = 0; ok && i < 5; i++) {
+    ok = mpmc_try_push(q, item(i)) == 0;
+  }
+  check(ok && mpmc_size(q) == 5, "mpmc: fills to its exact capacity");
+  check(mpmc_try_push(q, item(5)) < 0, "mpmc: try_push on a full queue fails");
+
+  ok = 1;
+  for (long i = 0; i < 5; i++) {
+    ok = ok && mpmc_try_pop(q) == item(i);
+  }
+  check(ok, "mpmc: pops in push order");
+  check(mpmc_try_pop(q) == NULL, "mpmc: try_pop on an empty queue fails");
+
+  // Wrap round a few times
+  ok = 1;
+  for (long i = 0; i < 23; i++) {
+    ok = ok && mpmc_try_push(q, item(i)) == 0 && mpmc_try_pop(q) == item(i);
+  }
+  check(ok, "mpmc: keeps order across wrap-around");
+
+  mpmc_try_push(q, item(0));
+  mpmc_try_push(q, item(1));
+  mpmc_close(q);
+  check(mpmc_push(q, item(2)) < 0, "mpmc: push after close fails");
+  check(mpmc_pop(q) == item(0) && mpmc_pop(q) == item(1) && mpmc_pop(q) == NULL,
+        "mpmc: pop drains after close, then gives up");
+  mpmc_destroy(q);
+}
+
+static mpmc_t *ring;
+static int order_ok = 1;
+
+// Producer i pushes items i, i + nproducers, i + 2 * nproducers...
+static void *ring_producer(void *arg) {
+  long id = (long)arg;
+  for (long i = id; i < nitems; i += nproducers) {
+    mpmc_push(ring, item(i));
+  }
+  return NULL;
+}
+
+// Whatever one consumer gets from a given producer has to come in the order it went in
+static void *ring_consumer(void *arg) {
+  (void)arg;
+  long last[MAX_THREADS];
+  for (int i = 0; i < nproducers; i++) {
+    last[i] = -1;
+  }
+  void *p;
+  while ((p = mpmc_pop(ring))) {
+    long i = index_of(p);
+    long from = i % nproducers;
+    if (i <= last[from]) {
+      __atomic_store_n(&order_ok, 0, __ATOMIC_RELAXED);
+    }
+    last[from] = i;
+    take(p);
+  }
+  return NULL;
+}
+
+static void mpmc_stress() {
+  pthread_t producers[MAX_THREADS];
+  pthread_t consumers[MAX_THREADS];
+
+  memset(seen, 0, (size_t)nitems);
+  order_ok = 1;
+  ring = mpmc_create(capacity);
+  if (!ring) {
+    check(0, "mpmc: create");
+    return;
+  }
+
+  for (long i = 0; i < nconsumers; i++) {
+    pthread_create(&consumers[i], NULL, ring_consumer, NULL);
+  }
+  for (long i = 0; i < nproducers; i++) {
+    pthread_create(&producers[i], NULL, ring_producer, (void *)i);
+  }
+  for (int i = 0; i < nproducers; i++) {
+    pthread_join(producers[i], NULL);
+  }
+  mpmc_close(ring);
+  for (int i = 0; i < nconsumers; i++) {
+    pthread_join(consumers[i], NULL);
+  }
+
+  check(all_seen_once(), "mpmc stress: every item out exactly once");
+  check(order_ok, "mpmc stress: per-producer order kept");
+  mpmc_destroy(ring);
+}
+
+static void wsdeque_basics() {
+  wsdeque_t *d = wsdeque_create(5);  // rounds up to 8
+  int ok = d != NULL;
+  for (long i = 0; ok && i < 8; i++) {
+    ok = wsdeque_push(d, item(i)) == 0;
+  }
+  check(ok && wsdeque_size(d) == 8, "wsdeque: capacity rounds up to a power of two");
+  check(wsdeque_push(d, item(8)) < 0, "wsdeque: push on a full deque fails");
+
+  check(wsdeque_pop(d) == item(7) && wsdeque_pop(d) == item(6),
+        "wsdeque: owner pops newest first");
+  check(wsdeque_steal(d) == item(0) && wsdeque_steal(d) == item(1),
+        "wsdeque: thieves take oldest first");
+
+  ok = 1;
+  for (long i = 5; i >= 2; i--) {
+    ok = ok && wsdeque_pop(d) == item(i);
+  }
+  check(ok && wsdeque_pop(d) == NULL && wsdeque_steal(d) == NULL, "wsdeque: drains to empty");
+  wsdeque_destroy(d);
+}
+
+static wsdeque_t *deque;
+static int owner_done = 0;
+
+// Thieves steal until the owner's finished and nothing's left. Steals come
+// off the top, so each thief sees items in the order they were pushed.
+static void *thief(void *arg) {
+  (void)arg;
+  long last = -1;
+  while (1) {
+    void *p = wsdeque_steal(deque);
+    if (!p) {
+      if (__atomic_load_n(&owner_done, __ATOMIC_ACQUIRE) && wsdeque_size(deque) == 0) {
+        break;
+      }
+      sched_yield();  // let the owner get on with it, it may share our CPU
+      continue;
+    }
+    long i = index_of(p);
+    if (i <= last) {
+      __atomic_store_n(&order_ok, 0, __ATOMIC_RELAXED);
+    }
+    last = i;
+    take(p);
+  }
+  return NULL;
+}
+
+// Owner pushes everything in order, popping one of its own now and then, and
+// whenever the deque is full - like a worker taking on jobs and running them
+static void deque_owner() {
+  for (long i = 0; i < nitems; i++) {
+    while (wsdeque_push(deque, item(i)) < 0) {
+      void *p = wsdeque_pop(deque);
+      if (p) {
+        take(p);
+      }
+    }
+    if (i % 7 == 0) {
+      void *p = wsdeque_pop(deque);
+      if (p) {
+        take(p);
+      }
+    }
+  }
+  __atomic_store_n(&owner_done, 1, __ATOMIC_RELEASE);
+
+  void *p;
+  while ((p = wsdeque_pop(deque))) {
+    take(p);
+  }
+}
+
+static void wsdeque_stress() {
+  pthread_t thieves[MAX_THREADS];
+
+  memset(seen, 0, (size_t)nitems);
+  order_ok = 1;
+  owner_done = 0;
+  deque = wsdeque_create(capacity);
+  if (!deque) {
+    check(0, "wsdeque: create");
+    return;
+  }
+
+  for (long i = 0; i < nconsumers; i++) {
+    pthread_create(&thieves[i], NULL, thief, NULL);
+  }
+  deque_owner();
+  for (int i = 0; i < nconsumers; i++) {
+    pthread_join(thieves[i], NULL);
+  }
+
+  check(all_seen_once(), "wsdeque stress: every item taken exactly once");
+  check(order_ok, "wsdeque stress: steals in push order");
+  wsdeque_destroy(deque);
+}
+
+int main(int argc, char **argv) {
+  int option_char = 0;
+
+  while ((option_char = getopt_long(argc, argv, "p:c:n:s:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 'p':
+        nproducers = atoi(optarg);
+        break;
+      case 'c':
+        nconsumers = atoi(optarg);
+        break;
+      case 'n':
+        nitems = atol(optarg);
+        break;
+      case 's':
+        capacity = (size_t)atol(optarg);
+        break;
+      case 'h':
+        fprintf(stdout, "%s", USAGE);
+        exit(0);
+      default:
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+    }
+  }
+
+  if (nproducers < 1 || nproducers > MAX_THREADS || nconsumers < 1 || nconsumers > MAX_THREADS ||
+      nitems < 1 || capacity < 1) {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  seen = malloc((size_t)nitems);
+  if (!seen) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  mpmc_basics();
+  wsdeque_basics();
+
+  fprintf(stdout, "%d producers, %d consumers, %ld items, capacity %zu\n", nproducers, nconsumers,
+          nitems, capacity);
+  mpmc_stress();
+  wsdeque_stress();
+
+  free(seen);
+  fprintf(stdout, "%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
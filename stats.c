@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+#define CACHE_LINE 64
+
+// Histogram layout: values below 2 * SUB_COUNT get a bucket each, above that
+// every power of two is split into SUB_COUNT linear buckets
+#define SUB_BITS 3
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_BITS 36  // 2^36ns is about 69s - anything longer lands in the last bucket
+#define HIST_BUCKETS ((MAX_BITS - SUB_BITS) * SUB_COUNT + SUB_COUNT)
+
+// Exported histogram bounds are the powers of two in between - bucket edges,
+// so they come out exact
+#define EXPORT_MIN_BITS 10  // ~1us
+
+#define MAX_METRICS 64
+
+static const char *stage_names[STAT_STAGES] = {
+    "header_read", "queue_wait", "content_get", "fstat", "first_byte", "transfer"
+};
+
+static const char *status_names[] = { "OK", "FILE_NOT_FOUND", "ERROR", "INVALID" };
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// One thread's numbers. Only the owner writes, scrapes read whenever.
+typedef struct stats_shard {
+    struct stats_shard *next;       // every shard there is, for scrapes
+    struct stats_shard *spare_next; // left behind by a thread that exited
+    uint64_t counts[STAT_STAGES][HIST_BUCKETS];
+    uint64_t sum_ns[STAT_STAGES];
+    uint64_t counters[STAT_COUNTERS];
+} stats_shard_t;
+
+// Registry - only touched when a thread starts or exits, and by scrapes
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_shard_t *shards = NULL;
+static stats_shard_t *spares = NULL;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+
+static __thread stats_shard_t *my_shard;
+
+// Extra metrics read at scrape time
+typedef struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    unsigned long (*read)(void);
+} metric_t;
+
+static metric_t metrics[MAX_METRICS];
+static int metric_count = 0;
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t v) {
+    if (v < 2 * SUB_COUNT) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    int shift = msb - SUB_BITS;
+    return (shift + 1) * SUB_COUNT + (int)((v >> shift) & (SUB_COUNT - 1));
+}
+
+// First value past bucket i
+static uint64_t bucket_limit(int i) {
+    if (i < 2 * SUB_COUNT) {
+        return (uint64_t)i + 1;
+    }
+    int shift = i / SUB_COUNT - 1;
+    uint64_t low = (uint64_t)(SUB_COUNT + i % SUB_COUNT) << shift;
+    return low + (1ull << shift);
+}
+
+// A thread is going away - its shard (and its counts) go to the next new thread
+static void shard_retire(void *arg) {
+    stats_shard_t *s = arg;
+    pthread_mutex_lock(&registry_lock);
+    s->spare_next = spares;
+    spares = s;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void make_key() {
+    pthread_key_create(&shard_key, shard_retire);
+}
+
+static stats_shard_t *get_shard() {
+    stats_shard_t *s = my_shard;
+    if (s) {
+        return s;
+    }
+    pthread_once(&key_once, make_key);
+
+    pthread_mutex_lock(&registry_lock);
+    s = spares;
+    if (s) {
+        spares = s->spare_next;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (!s) {
+        void *mem;
+        if (posix_memalign(&mem, CACHE_LINE, sizeof(stats_shard_t)) != 0) {
+            return NULL;  // this thread's numbers just don't get counted
+        }
+        s = mem;
+        memset(s, 0, sizeof(*s));
+        pthread_mutex_lock(&registry_lock);
+        s->next = shards;
+        shards = s;
+        pthread_mutex_unlock(&registry_lock);
+    }
+
+    pthread_setspecific(shard_key, s);
+    my_shard = s;
+    return s;
+}
+
+// Single writer, so no locked add - just keep the store whole for readers
+static inline void bump(uint64_t *p, uint64_t n) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t peek(const uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+void stats_record(stat_stage_t stage, uint64_t ns) {
+    stats_shard_t *s = get_shard();
+    if (s) {
+        bump(&s->counts[stage][bucket_index(ns)], 1);
+        bump(&s->sum_ns[stage], ns);
+    }
+}
+
+void stats_add(stat_counter_t counter, uint64_t n) {
+    stats_shard_t *s = get_shard();
+    if (s) {
+        bump(&s->counters[counter], n);
+    }
+}
+
+void stats_metric(const char *name, const char *type, const char *help, unsigned long (*read)(void)) {
+    if (metric_count < MAX_METRICS) {
+        metrics[metric_count++] = (metric_t){ name, type, help, read };
+    }
+}
+
+// Smallest bucket limit that at least q of the samples are under
+static double quantile_seconds(const uint64_t *counts, uint64_t total, double q) {
+    uint64_t want = (uint64_t)(q * (double)total + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= want && seen > 0) {
+            return (double)bucket_limit(i) / 1e9;
+        }
+    }
+    return 0;
+}
+
+static void write_stages(FILE *out) {
+    uint64_t counts[STAT_STAGES][HIST_BUCKETS];
+    uint64_t sum[STAT_STAGES];
+    memset(counts, 0, sizeof(counts));
+    memset(sum, 0, sizeof(sum));
+
+    pthread_mutex_lock(&registry_lock);
+    for (stats_shard_t *s = shards; s; s = s->next) {
+        for (int st = 0; st < STAT_STAGES; st++) {
+            for (int i = 0; i < HIST_BUCKETS; i++) {
+                counts[st][i] += peek(&s->counts[st][i]);
+            }
+            sum[st] += peek(&s->sum_ns[st]);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    fprintf(out, "# HELP gf_stage_seconds Time requests spend in each stage.\n");
+    fprintf(out, "# TYPE gf_stage_seconds histogram\n");
+    for (int st = 0; st < STAT_STAGES; st++) {
+        uint64_t seen = 0;
+        int i = 0;
+        for (int bits = EXPORT_MIN_BITS; bits <= MAX_BITS; bits++) {
+            for (; i < HIST_BUCKETS && bucket_limit(i) <= (1ull << bits); i++) {
+                seen += counts[st][i];
+            }
+            fprintf(out, "gf_stage_seconds_bucket{stage=\"%s\",le=\"%.12g\"} %llu\n",
+                    stage_names[st], (double)(1ull << bits) / 1e9, (unsigned long long)seen);
+        }
+        for (; i < HIST_BUCKETS; i++) {
+            seen += counts[st][i];
+        }
+        fprintf(out, "gf_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                stage_names[st], (unsigned long long)seen);
+        fprintf(out, "gf_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[st], (double)sum[st] / 1e9);
+        fprintf(out, "gf_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[st], (unsigned long long)seen);
+    }
+
+    // The exported buckets double in width - these come from the fine ones
+    fprintf(out, "# HELP gf_stage_quantile_seconds Stage latency percentiles, to within 12.5%%.\n");
+    fprintf(out, "# TYPE gf_stage_quantile_seconds gauge\n");
+    for (int st = 0; st < STAT_STAGES; st++) {
+        uint64_t total = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            total += counts[st][i];
+        }
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            fprintf(out, "gf_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9g\n", stage_names[st],
+                    quantiles[q], quantile_seconds(counts[st], total, quantiles[q]));
+        }
+    }
+}
+
+static void write_counters(FILE *out) {
+    uint64_t counters[STAT_COUNTERS] = { 0 };
+    pthread_mutex_lock(&registry_lock);
+    for (stats_shard_t *s = shards; s; s = s->next) {
+        for (int c = 0; c < STAT_COUNTERS; c++) {
+            counters[c] += peek(&s->counters[c]);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    fprintf(out, "# HELP gf_sent_bytes_total Response body bytes sent.\n");
+    fprintf(out, "# TYPE gf_sent_bytes_total counter\n");
+    fprintf(out, "gf_sent_bytes_total %llu\n", (unsigned long long)counters[STAT_BYTES_SENT]);
+
+    fprintf(out, "# HELP gf_responses_total Responses by status.\n");
+    fprintf(out, "# TYPE gf_responses_total counter\n");
+    for (int c = STAT_STATUS_OK; c <= STAT_STATUS_INVALID; c++) {
+        fprintf(out, "gf_responses_total{status=\"%s\"} %llu\n", status_names[c - STAT_STATUS_OK],
+                (unsigned long long)counters[c]);
+    }
+}
+
+void stats_write(FILE *out) {
+    write_stages(out);
+    write_counters(out);
+    for (int i = 0; i < metric_count; i++) {
+        fprintf(out, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+        fprintf(out, "# TYPE %s %s\n", metrics[i].name, metrics[i].type);
+        fprintf(out, "%s %lu\n", metrics[i].name, metrics[i].read());
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Request latency histograms and counters. Every thread records into its own
+// shard - plain stores, no locks and no shared cache lines - and a scrape adds
+// the shards up. Histograms are HDR-style: log-linear buckets, 8 per power of
+// two, so any value is known to within 12.5% from 1ns up to about a minute.
+
+// Where a request spends its time
+typedef enum {
+    STAT_HEADER_READ,  // accept (or first byte of a kept-alive request) to end of header
+    STAT_QUEUE_WAIT,   // queued in gfs_handler to picked up by a worker
+    STAT_CONTENT_GET,
+    STAT_FSTAT,
+    STAT_FIRST_BYTE,   // end of header to response header sent
+    STAT_TRANSFER,     // end of header to last byte sent
+    STAT_STAGES
+} stat_stage_t;
+
+typedef enum {
+    STAT_BYTES_SENT,  // body bytes
+    STAT_STATUS_OK,
+    STAT_STATUS_FILE_NOT_FOUND,
+    STAT_STATUS_ERROR,
+    STAT_STATUS_INVALID,
+    STAT_COUNTERS
+} stat_counter_t;
+
+// Monotonic clock in ns, the one all stages are measured with
+uint64_t stats_now();
+
+void stats_record(stat_stage_t stage, uint64_t ns);
+void stats_add(stat_counter_t counter, uint64_t n);
+
+// Have a scrape also report read() as name - type is "counter" or "gauge".
+// Register everything before the first scrape.
+void stats_metric(const char *name, const char *type, const char *help, unsigned long (*read)(void));
+
+// Everything in Prometheus text format
+void stats_write(FILE *out);
+
+#endif
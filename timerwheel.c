@@ -0,0 +1,102 @@
+#include <time.h>
+
+#include "timerwheel.h"
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t current_tick(const timerwheel_t *tw) {
+    return (now_ms() - tw->start_ms) / tw->tick_ms;
+}
+
+static void slot_insert(timerwheel_t *tw, tw_timer_t *t) {
+    tw_timer_t *head = &tw->slots[t->expires & (TW_SLOTS - 1)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void unlink_timer(tw_timer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void timerwheel_init(timerwheel_t *tw, unsigned tick_ms) {
+    for (int i = 0; i < TW_SLOTS; i++) {
+        tw->slots[i].next = tw->slots[i].prev = &tw->slots[i];
+    }
+    tw->tick_ms = tick_ms ? tick_ms : 1;
+    tw->start_ms = now_ms();
+    tw->now = 0;
+    tw->count = 0;
+}
+
+void tw_timer_init(tw_timer_t *t, void (*fn)(tw_timer_t *t, void *arg), void *arg) {
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void timerwheel_arm(timerwheel_t *tw, tw_timer_t *t, unsigned timeout_ms) {
+    timerwheel_cancel(tw, t);
+
+    // Count from the real time, not the last tick we processed - the loop may be behind
+    uint64_t ticks = (timeout_ms + tw->tick_ms - 1) / tw->tick_ms;
+    uint64_t now = current_tick(tw);
+    t->expires = (now > tw->now ? now : tw->now) + (ticks ? ticks : 1);
+    slot_insert(tw, t);
+    tw->count++;
+}
+
+void timerwheel_cancel(timerwheel_t *tw, tw_timer_t *t) {
+    if (tw_timer_armed(t)) {
+        unlink_timer(t);
+        tw->count--;
+    }
+}
+
+void timerwheel_advance(timerwheel_t *tw) {
+    uint64_t target = current_tick(tw);
+
+    while (tw->now < target && tw->count > 0) {
+        tw->now++;
+        tw_timer_t *head = &tw->slots[tw->now & (TW_SLOTS - 1)];
+
+        // Walk a snapshot of the slot so callbacks can re-arm into it safely
+        tw_timer_t pending;
+        if (head->next == head) {
+            continue;
+        }
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head->next = head->prev = head;
+
+        while (pending.next != &pending) {
+            tw_timer_t *t = pending.next;
+            unlink_timer(t);
+            if (t->expires > tw->now) {
+                slot_insert(tw, t);  // a later lap round the wheel
+                continue;
+            }
+            tw->count--;
+            t->fn(t, t->arg);
+        }
+    }
+
+    // Nothing armed - just catch up
+    if (tw->now < target) {
+        tw->now = target;
+    }
+}
+
+int timerwheel_timeout(const timerwheel_t *tw) {
+    return tw->count > 0 ? (int)tw->tick_ms : -1;
+}
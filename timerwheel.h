@@ -0,0 +1,51 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hashed timing wheel. Timers live in the object they time out (no allocation),
+// arming and cancelling are O(1) list operations, and advancing only looks at
+// the slots for the ticks that passed. Deadlines further out than one turn of
+// the wheel just get skipped until their turn comes round.
+//
+// Not thread safe - each event loop owns its own wheel.
+
+#define TW_SLOTS 512  // power of two
+
+typedef struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer *prev;
+    uint64_t expires;  // tick it fires on
+    void (*fn)(struct tw_timer *t, void *arg);
+    void *arg;
+} tw_timer_t;
+
+typedef struct {
+    tw_timer_t slots[TW_SLOTS];  // list heads
+    unsigned tick_ms;
+    uint64_t start_ms;  // monotonic time at tick 0
+    uint64_t now;       // last tick processed
+    size_t count;       // armed timers
+} timerwheel_t;
+
+void timerwheel_init(timerwheel_t *tw, unsigned tick_ms);
+
+// Set up a timer that isn't armed yet - fn(t, arg) runs when it expires
+void tw_timer_init(tw_timer_t *t, void (*fn)(tw_timer_t *t, void *arg), void *arg);
+
+// Fire timeout_ms from now (rounded up to the tick). Re-arming moves the deadline.
+void timerwheel_arm(timerwheel_t *tw, tw_timer_t *t, unsigned timeout_ms);
+void timerwheel_cancel(timerwheel_t *tw, tw_timer_t *t);
+
+static inline int tw_timer_armed(const tw_timer_t *t) {
+    return t->next != NULL;
+}
+
+// Run everything that's due. Callbacks may arm and cancel timers, including their own.
+void timerwheel_advance(timerwheel_t *tw);
+
+// How long the caller can sleep before the next advance is worth doing, -1 if nothing is armed
+int timerwheel_timeout(const timerwheel_t *tw);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "timerwheel.h"
+
+// Checks for the timer wheel against the real clock: timers fire no sooner
+// than asked and not much later, including ones more than a lap of the wheel
+// out, and cancelling or re-arming - from outside or from a callback - does
+// what it says. Exits non-zero if anything's off. Build with the wheel,
+// e.g. gcc -O2 timerwheel_test.c timerwheel.c
+
+#define TICK_MS 1
+#define SLACK_MS 50  // how late a timer may fire on a busy machine
+#define MAX_TIMERS 8
+
+typedef struct {
+  tw_timer_t timer;
+  unsigned timeout_ms;
+  uint64_t armed_ms;
+  uint64_t fired_ms;
+  int fired;
+  int rearm;  // times the callback arms it again
+  tw_timer_t *cancel;  // timer the callback cancels, if any
+} probe_t;
+
+static timerwheel_t wheel;
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+  fprintf(stdout, "%-48s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void on_fire(tw_timer_t *t, void *arg) {
+  (void)t;
+  probe_t *p = arg;
+  p->fired++;
+  p->fired_ms = now_ms();
+  if (p->cancel) {
+    timerwheel_cancel(&wheel, p->cancel);
+  }
+  if (p->rearm > 0) {
+    p->rearm--;
+    p->armed_ms = p->fired_ms;
+    timerwheel_arm(&wheel, &p->timer, p->timeout_ms);
+  }
+}
+
+static void arm(probe_t *p, unsigned timeout_ms) {
+  p->timeout_ms = timeout_ms;
+  p->armed_ms = now_ms();
+  timerwheel_arm(&wheel, &p->timer, timeout_ms);
+}
+
+// Drive the wheel the way an event loop would, until nothing's armed or limit_ms passes
+static void run(unsigned limit_ms) {
+  uint64_t until = now_ms() + limit_ms;
+  struct timespec nap = { 0, TICK_MS * 1000000L };
+  while (timerwheel_timeout(&wheel) >= 0 && now_ms() < until) {
+    nanosleep(&nap, NULL);
+    timerwheel_advance(&wheel);
+  }
+}
+
+static int on_time(const probe_t *p) {
+  uint64_t took = p->fired_ms - p->armed_ms;
+  return p->fired == 1 && took >= p->timeout_ms && took <= p->timeout_ms + SLACK_MS;
+}
+
+static void reset(probe_t *probes) {
+  for (int i = 0; i < MAX_TIMERS; i++) {
+    probes[i] = (probe_t){ 0 };
+    tw_timer_init(&probes[i].timer, on_fire, &probes[i]);
+  }
+}
+
+int main() {
+  probe_t probes[MAX_TIMERS];
+  reset(probes);
+
+  // Expiry, near and far - 700 ticks is more than one lap of the wheel
+  timerwheel_init(&wheel, TICK_MS);
+  check(timerwheel_timeout(&wheel) < 0, "nothing armed: no timeout");
+  unsigned timeouts[] = { 1, 5, 20, 100, 700 };
+  for (int i = 0; i < 5; i++) {
+    arm(&probes[i], timeouts[i]);
+  }
+  check(wheel.count == 5 && timerwheel_timeout(&wheel) >= 0, "armed timers counted");
+  run(2000);
+  int ok = 1;
+  for (int i = 0; i < 5; i++) {
+    ok = ok && on_time(&probes[i]);
+  }
+  check(ok, "each fires once, on time");
+  check(probes[4].fired == 1 && probes[4].fired_ms - probes[4].armed_ms >= 700,
+        "a timer a lap out waits for its lap");
+  check(wheel.count == 0 && timerwheel_timeout(&wheel) < 0, "fired timers are disarmed");
+
+  // Cancel and re-arm from outside
+  reset(probes);
+  arm(&probes[0], 10);
+  arm(&probes[1], 10);
+  timerwheel_cancel(&wheel, &probes[0].timer);
+  timerwheel_cancel(&wheel, &probes[0].timer);  // twice is harmless
+  arm(&probes[1], 60);  // moves the deadline rather than adding a second one
+  check(wheel.count == 1 && !tw_timer_armed(&probes[0].timer), "cancel disarms");
+  run(500);
+  check(probes[0].fired == 0, "a cancelled timer never fires");
+  check(on_time(&probes[1]), "re-arming moves the deadline");
+
+  // Callbacks that re-arm themselves, and one that cancels a timer due on the same tick
+  reset(probes);
+  probes[0].rearm = 4;
+  arm(&probes[0], 3);
+  probes[1].cancel = &probes[2].timer;
+  arm(&probes[1], 15);
+  arm(&probes[2], 15);
+  run(1000);
+  check(probes[0].fired == 5, "a callback can re-arm its own timer");
+  check(probes[1].fired == 1 && probes[2].fired == 0, "a callback can cancel a timer in its slot");
+  check(wheel.count == 0, "count back to zero");
+
+  fprintf(stdout, "%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
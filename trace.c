@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define CACHE_LINE 64
+
+// One thread's ring. Only the owner writes. Each slot is its own little
+// seqlock: seq goes to 0 while the slot is rewritten, so a dump that catches
+// it halfway can tell and skip it.
+typedef struct trace_ring {
+    struct trace_ring *next;        // every ring there is, for dumps
+    struct trace_ring *spare_next;  // left behind by a thread that exited
+    uint32_t tid;
+    uint64_t ring_no;               // top bits of the request ids this ring hands out
+    uint64_t head;                  // records ever written (owner only)
+    uint64_t next_id;               // request ids handed out (owner only)
+    trace_record_t recs[TRACE_RING_RECORDS];
+} trace_ring_t;
+
+static int enabled = 0;
+
+// Registry - only touched when a thread first stamps or exits, and by dumps
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings = NULL;
+static trace_ring_t *spares = NULL;
+static uint64_t ring_count = 0;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static __thread trace_ring_t *my_ring;
+
+// Signal dumps
+static int dump_signo;
+static const char *dump_path;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void trace_enable() {
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+}
+
+// A thread is going away - its ring (records and all) goes to the next new thread
+static void ring_retire(void *arg) {
+    trace_ring_t *r = arg;
+    pthread_mutex_lock(&registry_lock);
+    r->spare_next = spares;
+    spares = r;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void make_key() {
+    pthread_key_create(&ring_key, ring_retire);
+}
+
+static trace_ring_t *get_ring() {
+    trace_ring_t *r = my_ring;
+    if (r) {
+        return r;
+    }
+    pthread_once(&key_once, make_key);
+
+    pthread_mutex_lock(&registry_lock);
+    r = spares;
+    if (r) {
+        spares = r->spare_next;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (!r) {
+        void *mem;
+        if (posix_memalign(&mem, CACHE_LINE, sizeof(trace_ring_t)) != 0) {
+            return NULL;  // this thread goes untraced
+        }
+        r = mem;
+        memset(r, 0, sizeof(*r));
+        pthread_mutex_lock(&registry_lock);
+        r->ring_no = ++ring_count;
+        r->next = rings;
+        rings = r;
+        pthread_mutex_unlock(&registry_lock);
+    }
+
+    r->tid = (uint32_t)syscall(SYS_gettid);
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+uint64_t trace_new_id() {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    trace_ring_t *r = get_ring();
+    if (!r) {
+        return 0;
+    }
+    // The ring number on top keeps ids unique without anything shared
+    return r->ring_no << 40 | (++r->next_id & ((1ull << 40) - 1));
+}
+
+void trace_record_at(trace_event_t event, uint64_t id, uint64_t arg, uint64_t ts_ns) {
+    if (id == 0) {
+        return;
+    }
+    trace_ring_t *r = get_ring();
+    if (!r) {
+        return;
+    }
+
+    uint64_t h = r->head++;
+    trace_record_t *rec = &r->recs[h & (TRACE_RING_RECORDS - 1)];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&rec->ts_ns, ts_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->id, id, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->tid, r->tid, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->event, (uint32_t)event, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->seq, h + 1, __ATOMIC_RELEASE);
+}
+
+void trace_record(trace_event_t event, uint64_t id, uint64_t arg) {
+    if (id != 0) {
+        trace_record_at(event, id, arg, now_ns());
+    }
+}
+
+// Copy a slot out unless it's empty or being rewritten. 1 if the copy is good.
+static int read_slot(const trace_record_t *rec, trace_record_t *out) {
+    uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0) {
+        return 0;
+    }
+    out->ts_ns = __atomic_load_n(&rec->ts_ns, __ATOMIC_RELAXED);
+    out->id = __atomic_load_n(&rec->id, __ATOMIC_RELAXED);
+    out->tid = __atomic_load_n(&rec->tid, __ATOMIC_RELAXED);
+    out->event = __atomic_load_n(&rec->event, __ATOMIC_RELAXED);
+    out->arg = __atomic_load_n(&rec->arg, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    out->seq = seq;
+    return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq;
+}
+
+void trace_write(FILE *out) {
+    trace_file_header_t hdr;
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.record_size = sizeof(trace_record_t);
+    hdr.ring_records = TRACE_RING_RECORDS;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    pthread_mutex_lock(&registry_lock);
+    for (trace_ring_t *r = rings; r; r = r->next) {
+        for (int i = 0; i < TRACE_RING_RECORDS; i++) {
+            trace_record_t rec;
+            if (read_slot(&r->recs[i], &rec)) {
+                fwrite(&rec, sizeof(rec), 1, out);
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void *dump_thread(void *arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, dump_signo);
+
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) {
+            continue;
+        }
+        FILE *out = fopen(dump_path, "w");
+        if (!out) {
+            perror(dump_path);
+            continue;
+        }
+        trace_write(out);
+        fclose(out);
+        fprintf(stderr, "trace written to %s\n", dump_path);
+    }
+    return NULL;
+}
+
+int trace_dump_on(int signo, const char *path) {
+    dump_signo = signo;
+    dump_path = path;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, dump_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Per-request timelines for chasing tail latency. Every thread stamps
+// fixed-size records into a ring of its own - no locks, and no allocation
+// past the ring itself on the thread's first stamp. Old records are simply
+// overwritten, so a dump is the most recent TRACE_RING_RECORDS per thread.
+// trace2json turns a dump into Chrome trace / Perfetto JSON.
+
+#define TRACE_RING_RECORDS 8192  // per thread, power of two
+#define TRACE_MAGIC "GFTRACE1"
+
+typedef enum {
+    TRACE_ACCEPT,       // connection accepted (or a kept-alive one's next request started arriving)
+    TRACE_HEADER,       // request header complete
+    TRACE_ENQUEUE,      // gfs_handler queued it - arg is the queue depth before it
+    TRACE_DEQUEUE,      // a worker took it
+    TRACE_HEADER_SENT,  // arg is the status: 0 OK, 1 FILE_NOT_FOUND, 2 ERROR, 3 INVALID
+    TRACE_LAST_BYTE,    // response complete - arg is the body length
+    TRACE_ABORT,        // connection dropped instead
+    TRACE_EVENTS
+} trace_event_t;
+
+// One stamp. Dumps are a trace_file_header_t followed by these up to the end
+// of the file (or stream), in no particular order - sort by ts_ns.
+typedef struct {
+    uint64_t seq;    // internal, 0 for a slot never written
+    uint64_t ts_ns;  // CLOCK_MONOTONIC
+    uint64_t id;     // request the stamp belongs to
+    uint32_t tid;    // thread that made it
+    uint32_t event;  // trace_event_t
+    uint64_t arg;
+} trace_record_t;
+
+typedef struct {
+    char magic[8];          // TRACE_MAGIC
+    uint32_t record_size;   // sizeof(trace_record_t)
+    uint32_t ring_records;  // TRACE_RING_RECORDS of the server that wrote it
+} trace_file_header_t;
+
+// Tracing is off until this is called - stamps cost one branch until then
+void trace_enable();
+
+// A process-unique id for a new request, 0 with tracing off
+uint64_t trace_new_id();
+
+// Stamp now (or at ts_ns) for request id. Nothing happens for id 0.
+void trace_record(trace_event_t event, uint64_t id, uint64_t arg);
+void trace_record_at(trace_event_t event, uint64_t id, uint64_t arg, uint64_t ts_ns);
+
+// Binary dump of every ring
+void trace_write(FILE *out);
+
+// Dump to path whenever signo arrives. Blocks signo in the caller, so call it
+// before any other thread is started - they all inherit the mask, and a
+// thread of our own takes the signal with sigwait. -1 if that can't start.
+int trace_dump_on(int signo, const char *path);
+
+#endif
@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+// Turns a gfserver trace dump (SIGUSR1 with -x, or /trace on the admin port)
+// into Chrome trace JSON for chrome://tracing or ui.perfetto.dev. Every
+// request becomes an async track with its stages nested under it, and every
+// stamp also shows as an instant on the thread that made it.
+
+#define USAGE                                                                  \
+  "usage:\n"                                                                   \
+  "  trace2json [options]\n"                                                   \
+  "options:\n"                                                                 \
+  "  -h                  Show this help message\n"                             \
+  "  -i [dumpfile]       Trace dump to read (Default: stdin)\n"                \
+  "  -o [jsonfile]       Where to write the JSON (Default: stdout)\n"
+
+static struct option gLongOptions[] = {
+  {"input", required_argument, NULL, 'i'},
+  {"output", required_argument, NULL, 'o'},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0}
+};
+
+static const char *event_names[TRACE_EVENTS] = {
+  "accept", "header", "enqueue", "dequeue", "header_sent", "last_byte", "abort"
+};
+
+static const char *status_names[] = { "OK", "FILE_NOT_FOUND", "ERROR", "INVALID" };
+
+// Stages drawn as slices: from one stamp to the next
+typedef struct {
+  const char *name;
+  int from;
+  int to;
+} stage_t;
+
+static const stage_t stages[] = {
+  { "header_read", TRACE_ACCEPT, TRACE_HEADER },
+  { "dispatch", TRACE_HEADER, TRACE_ENQUEUE },
+  { "queued", TRACE_ENQUEUE, TRACE_DEQUEUE },
+  { "handling", TRACE_DEQUEUE, TRACE_HEADER_SENT },
+  { "sending", TRACE_HEADER_SENT, TRACE_LAST_BYTE },
+};
+
+static uint64_t base_ns;  // earliest stamp - JSON times are relative to it
+static int first_event = 1;
+
+// Group stamps by request, in time order within each
+static int by_request(const void *a, const void *b) {
+  const trace_record_t *x = a, *y = b;
+  if (x->id != y->id) {
+    return x->id < y->id ? -1 : 1;
+  }
+  if (x->ts_ns != y->ts_ns) {
+    return x->ts_ns < y->ts_ns ? -1 : 1;
+  }
+  return (int)x->event - (int)y->event;
+}
+
+static double us(uint64_t ts_ns) {
+  return (double)(ts_ns - base_ns) / 1000.0;
+}
+
+static void begin_event(FILE *out) {
+  fprintf(out, first_event ? "\n  " : ",\n  ");
+  first_event = 0;
+}
+
+// One begin or end of an async slice on the request's track
+static void async_event(FILE *out, char ph, const char *name, uint64_t id, uint32_t tid, uint64_t ts_ns) {
+  begin_event(out);
+  fprintf(out, "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"%c\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%u,"
+          "\"ts\":%.3f}", name, ph, (unsigned long long)id, tid, us(ts_ns));
+}
+
+// The first stamp of kind event in a request's records, or NULL
+static const trace_record_t *find(const trace_record_t *recs, size_t n, uint32_t event) {
+  for (size_t i = 0; i < n; i++) {
+    if (recs[i].event == event) {
+      return &recs[i];
+    }
+  }
+  return NULL;
+}
+
+// All of one request's stamps
+static void write_request(FILE *out, const trace_record_t *recs, size_t n) {
+  uint64_t id = recs[0].id;
+  const trace_record_t *first = &recs[0];
+  const trace_record_t *last = &recs[n - 1];
+
+  // The whole request, with what the header said on the way out
+  char name[64];
+  const trace_record_t *hdr = find(recs, n, TRACE_HEADER_SENT);
+  const trace_record_t *aborted = find(recs, n, TRACE_ABORT);
+  const char *status = hdr && hdr->arg < 4 ? status_names[hdr->arg] : NULL;
+  snprintf(name, sizeof(name), "request%s%s%s", status ? " " : "", status ? status : "",
+           aborted ? " (aborted)" : "");
+  async_event(out, 'b', name, id, first->tid, first->ts_ns);
+
+  for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+    const trace_record_t *from = find(recs, n, (uint32_t)stages[s].from);
+    const trace_record_t *to = find(recs, n, (uint32_t)stages[s].to);
+    if (!to && stages[s].to == TRACE_LAST_BYTE) {
+      to = aborted;
+    }
+    if (from && to && to->ts_ns >= from->ts_ns) {
+      async_event(out, 'b', stages[s].name, id, from->tid, from->ts_ns);
+      async_event(out, 'e', stages[s].name, id, to->tid, to->ts_ns);
+    }
+  }
+
+  async_event(out, 'e', name, id, last->tid, last->ts_ns);
+
+  // And each stamp on the thread that made it
+  for (size_t i = 0; i < n; i++) {
+    const trace_record_t *r = &recs[i];
+    begin_event(out);
+    fprintf(out, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+            "\"args\":{\"request\":\"0x%llx\",\"arg\":%llu}}",
+            r->event < TRACE_EVENTS ? event_names[r->event] : "?", r->tid, us(r->ts_ns),
+            (unsigned long long)r->id, (unsigned long long)r->arg);
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *input = NULL;
+  const char *output = NULL;
+  int option_char;
+
+  while ((option_char = getopt_long(argc, argv, "i:o:h", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 'i':
+        input = optarg;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'h':
+        fprintf(stdout, "%s", USAGE);
+        exit(0);
+      default:
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+    }
+  }
+
+  FILE *in = input ? fopen(input, "rb") : stdin;
+  if (!in) {
+    perror(input);
+    exit(1);
+  }
+
+  trace_file_header_t hdr;
+  if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+    fprintf(stderr, "not a gfserver trace dump\n");
+    exit(1);
+  }
+  if (hdr.record_size != sizeof(trace_record_t)) {
+    fprintf(stderr, "dump has %u-byte records, this build reads %zu\n", hdr.record_size,
+            sizeof(trace_record_t));
+    exit(1);
+  }
+
+  // Records run to the end of the file
+  size_t count = 0, cap = 4096;
+  trace_record_t *recs = malloc(cap * sizeof(trace_record_t));
+  while (recs && fread(&recs[count], sizeof(trace_record_t), 1, in) == 1) {
+    if (++count == cap) {
+      cap *= 2;
+      trace_record_t *bigger = realloc(recs, cap * sizeof(trace_record_t));
+      if (!bigger) {
+        free(recs);
+      }
+      recs = bigger;
+    }
+  }
+  if (!recs) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  if (in != stdin) {
+    fclose(in);
+  }
+
+  qsort(recs, count, sizeof(trace_record_t), by_request);
+  base_ns = UINT64_MAX;
+  for (size_t i = 0; i < count; i++) {
+    if (recs[i].ts_ns < base_ns) {
+      base_ns = recs[i].ts_ns;
+    }
+  }
+
+  FILE *out = output ? fopen(output, "w") : stdout;
+  if (!out) {
+    perror(output);
+    exit(1);
+  }
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  begin_event(out);
+  fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"gfserver\"}}");
+
+  size_t requests = 0;
+  for (size_t i = 0; i < count; ) {
+    size_t j = i + 1;
+    while (j < count && recs[j].id == recs[i].id) {
+      j++;
+    }
+    write_request(out, &recs[i], j - i);
+    requests++;
+    i = j;
+  }
+  fprintf(out, "\n]}\n");
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  fprintf(stderr, "%zu stamps, %zu requests\n", count, requests);
+  free(recs);
+  return 0;
+}
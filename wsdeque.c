@@ -0,0 +1,98 @@
+#include <stdlib.h>
+
+#include "wsdeque.h"
+
+#define CACHE_LINE 64
+
+struct wsdeque {
+    void **buf;
+    size_t mask;
+
+    // thieves move top, the owner moves bottom - keep them apart
+    int64_t top __attribute__((aligned(CACHE_LINE)));
+    int64_t bottom __attribute__((aligned(CACHE_LINE)));
+};
+
+wsdeque_t *wsdeque_create(size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+
+    wsdeque_t *d = aligned_alloc(CACHE_LINE, (sizeof(wsdeque_t) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
+    if (!d) {
+        return NULL;
+    }
+    d->buf = calloc(cap, sizeof(void *));
+    if (!d->buf) {
+        free(d);
+        return NULL;
+    }
+
+    d->mask = cap - 1;
+    d->top = 0;
+    d->bottom = 0;
+    return d;
+}
+
+void wsdeque_destroy(wsdeque_t *d) {
+    if (d) {
+        free(d->buf);
+        free(d);
+    }
+}
+
+int wsdeque_push(wsdeque_t *d, void *item) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if ((size_t)(b - t) > d->mask) {
+        return -1;
+    }
+
+    __atomic_store_n(&d->buf[b & d->mask], item, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);  // publishes the slot to thieves
+    return 0;
+}
+
+void *wsdeque_pop(wsdeque_t *d) {
+    // Claim the bottom slot first, then look at top. Both seq_cst so a thief
+    // can't read the old bottom after we've read its old top.
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);  // was empty
+        return NULL;
+    }
+
+    void *item = __atomic_load_n(&d->buf[b & d->mask], __ATOMIC_RELAXED);
+    if (t == b) {
+        // Last one - a thief may be after it too, whoever moves top wins
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            item = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+void *wsdeque_steal(wsdeque_t *d) {
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+    if (t >= b) {
+        return NULL;
+    }
+
+    void *item = __atomic_load_n(&d->buf[t & d->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;  // lost to the owner or another thief, try somewhere else
+    }
+    return item;
+}
+
+size_t wsdeque_size(const wsdeque_t *d) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    return b > t ? (size_t)(b - t) : 0;
+}
@@ -0,0 +1,29 @@
+#ifndef WSDEQUE_H
+#define WSDEQUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Chase-Lev work-stealing deque. One owner thread pushes and pops at the
+// bottom without any contention; any other thread can steal from the top,
+// racing only with other thieves (and with the owner for the very last item).
+//
+// Fixed capacity - the owner decides how much it takes on, so there's no need
+// to grow. Items are opaque pointers and can't be NULL.
+typedef struct wsdeque wsdeque_t;
+
+// capacity is rounded up to a power of two. NULL on failure.
+wsdeque_t *wsdeque_create(size_t capacity);
+void wsdeque_destroy(wsdeque_t *d);
+
+// Owner only: 0 on success, -1 if full / the newest item or NULL if empty
+int wsdeque_push(wsdeque_t *d, void *item);
+void *wsdeque_pop(wsdeque_t *d);
+
+// Any thread: the oldest item, or NULL if empty or another thread got there first
+void *wsdeque_steal(wsdeque_t *d);
+
+// Items held right now - only a snapshot for anyone but the owner
+size_t wsdeque_size(const wsdeque_t *d);
+
+#endif